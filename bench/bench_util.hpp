@@ -0,0 +1,289 @@
+//
+// bench_util.hpp
+// ~~~~~~~~~~~~~~
+//
+// Copyright (c) 2020 Paul-Louis Ageneau (paul-louis at ageneau dot org)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef BENCH_UTIL_HPP
+#define BENCH_UTIL_HPP
+
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace bench {
+
+// ---------- Command line ----------
+
+// Parses arguments of the form --name=value, a lone --name is read as "1"
+class options
+{
+public:
+    options(int argc, char* argv[])
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg(argv[i]);
+            if (arg.compare(0, 2, "--") != 0) throw std::invalid_argument("bad argument: " + arg);
+
+            auto pos = arg.find('=');
+            if (pos == std::string::npos)
+                m_values[arg.substr(2)] = "1";
+            else
+                m_values[arg.substr(2, pos - 2)] = arg.substr(pos + 1);
+        }
+    }
+
+    std::string get(std::string const& name, std::string const& def) const
+    {
+        auto it = m_values.find(name);
+        return it != m_values.end() ? it->second : def;
+    }
+
+    double get(std::string const& name, double def) const
+    {
+        auto it = m_values.find(name);
+        return it != m_values.end() ? std::stod(it->second) : def;
+    }
+
+    long get(std::string const& name, long def) const
+    {
+        auto it = m_values.find(name);
+        return it != m_values.end() ? std::stol(it->second) : def;
+    }
+
+    // Comma-separated list
+    std::vector<std::string> get_list(std::string const& name, std::string const& def) const
+    {
+        std::vector<std::string> list;
+        std::istringstream ss(get(name, def));
+        std::string item;
+        while (std::getline(ss, item, ','))
+            if (!item.empty()) list.push_back(item);
+        return list;
+    }
+
+private:
+    std::map<std::string, std::string> m_values;
+};
+
+// ---------- Results ----------
+
+// One result per line as a flat JSON object, printed on stdout and optionally appended to a
+// file so runs can be compared over time
+class result
+{
+public:
+    explicit result(std::string const& benchmark) { add("benchmark", benchmark); }
+
+    result& add(std::string const& key, std::string const& value)
+    {
+        std::ostringstream ss;
+        ss << '"';
+        for (char c : value)
+        {
+            if (c == '"' || c == '\\') ss << '\\';
+            ss << c;
+        }
+        ss << '"';
+        m_fields.emplace_back(key, ss.str());
+        return *this;
+    }
+
+    result& add(std::string const& key, char const* value) { return add(key, std::string(value)); }
+
+    template <typename T> result& add(std::string const& key, T value)
+    {
+        std::ostringstream ss;
+        ss << std::setprecision(10) << value;
+        m_fields.emplace_back(key, ss.str());
+        return *this;
+    }
+
+    std::string str() const
+    {
+        std::ostringstream ss;
+        ss << '{';
+        for (std::size_t i = 0; i < m_fields.size(); ++i)
+            ss << (i ? "," : "") << '"' << m_fields[i].first << "\":" << m_fields[i].second;
+        ss << '}';
+        return ss.str();
+    }
+
+    void write(options const& opts) const
+    {
+        std::cout << str() << std::endl;
+
+        auto const output = opts.get("output", "");
+        if (!output.empty())
+        {
+            std::ofstream file(output, std::ios::app);
+            file << str() << '\n';
+        }
+    }
+
+private:
+    std::vector<std::pair<std::string, std::string>> m_fields;
+};
+
+// ---------- Timing ----------
+
+using clock = std::chrono::steady_clock;
+
+inline double seconds_since(clock::time_point start)
+{
+    return std::chrono::duration<double>(clock::now() - start).count();
+}
+
+// CPU time of the whole process in seconds
+inline double process_cpu_time() { return double(std::clock()) / CLOCKS_PER_SEC; }
+
+// ---------- Credentials ----------
+
+enum class key_type
+{
+    rsa2048,
+    ecdsa_p256,
+    ed25519
+};
+
+inline key_type parse_key_type(std::string const& name)
+{
+    if (name == "rsa2048") return key_type::rsa2048;
+    if (name == "ecdsa-p256") return key_type::ecdsa_p256;
+    if (name == "ed25519") return key_type::ed25519;
+    throw std::invalid_argument("unknown key type: " + name);
+}
+
+inline char const* to_string(key_type type)
+{
+    switch (type)
+    {
+    case key_type::rsa2048: return "rsa2048";
+    case key_type::ecdsa_p256: return "ecdsa-p256";
+    case key_type::ed25519: return "ed25519";
+    }
+    return "";
+}
+
+// PEM-encoded self-signed certificate and its private key
+struct credentials
+{
+    std::string certificate;
+    std::string private_key;
+};
+
+inline void check(int ret, char const* what)
+{
+    if (ret < 0) throw std::runtime_error(std::string(what) + ": " + gnutls_strerror(ret));
+}
+
+inline std::string to_string(gnutls_datum_t datum)
+{
+    std::string str(reinterpret_cast<char const*>(datum.data), datum.size);
+    gnutls_free(datum.data);
+    return str;
+}
+
+// Generates a self-signed certificate for "localhost"
+inline credentials generate_credentials(key_type type)
+{
+    gnutls_pk_algorithm_t algo = GNUTLS_PK_RSA;
+    unsigned int bits = 2048;
+    gnutls_digest_algorithm_t digest = GNUTLS_DIG_SHA256;
+    switch (type)
+    {
+    case key_type::rsa2048: break;
+    case key_type::ecdsa_p256:
+        algo = GNUTLS_PK_ECDSA;
+        bits = GNUTLS_CURVE_TO_BITS(GNUTLS_ECC_CURVE_SECP256R1);
+        break;
+    case key_type::ed25519:
+        algo = GNUTLS_PK_EDDSA_ED25519;
+        bits = GNUTLS_CURVE_TO_BITS(GNUTLS_ECC_CURVE_ED25519);
+        digest = GNUTLS_DIG_SHA512; // Ed25519 is defined with SHA-512
+        break;
+    }
+
+    gnutls_x509_privkey_t key;
+    check(gnutls_x509_privkey_init(&key), "gnutls_x509_privkey_init");
+    gnutls_x509_crt_t crt;
+    check(gnutls_x509_crt_init(&crt), "gnutls_x509_crt_init");
+
+    credentials creds;
+    try
+    {
+        check(gnutls_x509_privkey_generate(key, algo, bits, 0), "gnutls_x509_privkey_generate");
+
+        std::time_t const now = std::time(nullptr);
+        unsigned char const serial[] = {0x01};
+        char const name[] = "localhost";
+        check(gnutls_x509_crt_set_version(crt, 3), "gnutls_x509_crt_set_version");
+        check(gnutls_x509_crt_set_serial(crt, serial, sizeof(serial)),
+              "gnutls_x509_crt_set_serial");
+        check(gnutls_x509_crt_set_activation_time(crt, now - 3600),
+              "gnutls_x509_crt_set_activation_time");
+        check(gnutls_x509_crt_set_expiration_time(crt, now + 24 * 3600),
+              "gnutls_x509_crt_set_expiration_time");
+        check(gnutls_x509_crt_set_dn(crt, "CN=localhost", nullptr), "gnutls_x509_crt_set_dn");
+        check(gnutls_x509_crt_set_subject_alt_name(
+                  crt, GNUTLS_SAN_DNSNAME, name, sizeof(name) - 1, GNUTLS_FSAN_SET),
+              "gnutls_x509_crt_set_subject_alt_name");
+        check(gnutls_x509_crt_set_key(crt, key), "gnutls_x509_crt_set_key");
+        check(gnutls_x509_crt_sign2(crt, crt, key, digest, 0), "gnutls_x509_crt_sign2");
+
+        gnutls_datum_t datum;
+        check(gnutls_x509_crt_export2(crt, GNUTLS_X509_FMT_PEM, &datum), "gnutls_x509_crt_export2");
+        creds.certificate = to_string(datum);
+        check(gnutls_x509_privkey_export2_pkcs8(
+                  key, GNUTLS_X509_FMT_PEM, nullptr, GNUTLS_PKCS_PLAIN, &datum),
+              "gnutls_x509_privkey_export2_pkcs8");
+        creds.private_key = to_string(datum);
+    }
+    catch (...)
+    {
+        gnutls_x509_crt_deinit(crt);
+        gnutls_x509_privkey_deinit(key);
+        throw;
+    }
+
+    gnutls_x509_crt_deinit(crt);
+    gnutls_x509_privkey_deinit(key);
+    return creds;
+}
+
+// ---------- Priorities ----------
+
+inline std::string priority_string(std::string const& tls_version, std::string const& cipher)
+{
+    std::string priority = "NORMAL:-VERS-ALL:+VERS-TLS" + tls_version;
+    if (!cipher.empty()) priority += ":-CIPHER-ALL:+" + cipher;
+    return priority;
+}
+
+inline void set_priority(gnutls_session_t session, std::string const& priority)
+{
+    char const* err_pos = nullptr;
+    check(gnutls_priority_set_direct(session, priority.c_str(), &err_pos),
+          "gnutls_priority_set_direct");
+}
+
+} // namespace bench
+
+#endif // BENCH_UTIL_HPP
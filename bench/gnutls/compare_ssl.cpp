@@ -0,0 +1,408 @@
+//
+// compare_ssl.cpp
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2020 Paul-Louis Ageneau (paul-louis at ageneau dot org)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Side-by-side comparison of gnutls::stream and ssl::stream (OpenSSL)
+//
+// The same workloads, templated over the backend, run over local socket pairs on a single
+// thread with TLS 1.3, AES-128-GCM and an ECDSA P-256 certificate:
+//   echo       round trips of --echo-size byte messages
+//   bulk       one-way transfer of --bulk-size byte writes
+//   handshake  full handshakes, --concurrency in flight
+//
+// Allocations count calls to operator new, so they reflect the wrappers and Asio, not the
+// internal allocations of GnuTLS or OpenSSL. A line with backend "ratio" comparing the
+// main metric follows each workload.
+//
+// Options:
+//   --workloads=echo,bulk,handshake
+//   --echo-size=BYTES    (default: 64)
+//   --bulk-size=BYTES    (default: 65536)
+//   --concurrency=N      (default: 4)
+//   --duration=SECONDS   (default: 1)
+//   --output=FILE        (append results to FILE)
+
+#include <boost/asio.hpp>
+#include <boost/asio/gnutls.hpp>
+#include <boost/asio/ssl.hpp>
+
+#include "../bench_util.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <vector>
+
+namespace {
+
+std::atomic<std::size_t> allocation_count{0};
+
+} // namespace
+
+// Not inlined, so that the compiler does not see free() paired with operator new
+BOOST_NOINLINE void* operator new(std::size_t size)
+{
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+BOOST_NOINLINE void operator delete(void* p) noexcept { std::free(p); }
+BOOST_NOINLINE void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+namespace {
+
+using namespace boost::asio;
+using error_code = boost::system::error_code;
+using socket_type = local::stream_protocol::socket;
+
+// ---------- Backends ----------
+
+struct gnutls_backend
+{
+    static constexpr char const* name = "gnutls";
+
+    using context = gnutls::context;
+    using stream = gnutls::stream<socket_type>;
+
+    static constexpr gnutls::stream_base::handshake_type client = gnutls::stream_base::client;
+    static constexpr gnutls::stream_base::handshake_type server = gnutls::stream_base::server;
+
+    static std::unique_ptr<context> make_server_context(bench::credentials const& creds)
+    {
+        auto ctx = std::make_unique<context>(context::tls_server);
+        ctx->use_certificate(buffer(creds.certificate), context::pem);
+        ctx->use_private_key(buffer(creds.private_key), context::pem);
+        return ctx;
+    }
+
+    static std::unique_ptr<context> make_client_context()
+    {
+        auto ctx = std::make_unique<context>(context::tls_client);
+        ctx->set_verify_mode(gnutls::verify_none);
+        return ctx;
+    }
+
+    static void configure(stream& s)
+    {
+        bench::set_priority(s.native_handle(), bench::priority_string("1.3", "AES-128-GCM"));
+    }
+};
+
+struct openssl_backend
+{
+    static constexpr char const* name = "openssl";
+
+    using context = ssl::context;
+    using stream = ssl::stream<socket_type>;
+
+    static constexpr ssl::stream_base::handshake_type client = ssl::stream_base::client;
+    static constexpr ssl::stream_base::handshake_type server = ssl::stream_base::server;
+
+    static void restrict(context& ctx)
+    {
+        SSL_CTX_set_min_proto_version(ctx.native_handle(), TLS1_3_VERSION);
+        SSL_CTX_set_max_proto_version(ctx.native_handle(), TLS1_3_VERSION);
+        SSL_CTX_set_ciphersuites(ctx.native_handle(), "TLS_AES_128_GCM_SHA256");
+    }
+
+    static std::unique_ptr<context> make_server_context(bench::credentials const& creds)
+    {
+        auto ctx = std::make_unique<context>(context::tls_server);
+        ctx->use_certificate(buffer(creds.certificate), context::pem);
+        ctx->use_private_key(buffer(creds.private_key), context::pem);
+        restrict(*ctx);
+        return ctx;
+    }
+
+    static std::unique_ptr<context> make_client_context()
+    {
+        auto ctx = std::make_unique<context>(context::tls_client);
+        ctx->set_verify_mode(ssl::verify_none);
+        restrict(*ctx);
+        return ctx;
+    }
+
+    static void configure(stream&) {}
+};
+
+// ---------- Workloads ----------
+
+struct measurement
+{
+    std::size_t operations = 0;
+    std::size_t bytes = 0;
+    std::size_t allocations = 0;
+    double seconds = 0;
+    std::vector<double> latencies; // microseconds
+
+    double percentile(double p)
+    {
+        if (latencies.empty()) return 0;
+        std::sort(latencies.begin(), latencies.end());
+        return latencies[std::size_t(p * double(latencies.size() - 1))];
+    }
+};
+
+template <typename Backend> class workload
+{
+public:
+    using stream = typename Backend::stream;
+
+    workload(bench::credentials const& creds, double duration)
+        : m_server_ctx(Backend::make_server_context(creds))
+        , m_client_ctx(Backend::make_client_context())
+        , m_duration(duration)
+    {}
+
+    measurement echo(std::size_t size)
+    {
+        auto pair = connect();
+        std::vector<char> request(size, 'x'), response(size), echoed(size);
+
+        measurement m;
+        start(m);
+        std::function<void()> round_trip;
+        std::function<void()> serve;
+        auto sent = bench::clock::now();
+
+        serve = [&]() {
+            async_read(*pair.second, buffer(echoed), [&](error_code ec, std::size_t) {
+                if (ec) return;
+                async_write(*pair.second, buffer(echoed), [&](error_code ec, std::size_t) {
+                    if (!ec) serve();
+                });
+            });
+        };
+
+        round_trip = [&]() {
+            sent = bench::clock::now();
+            async_write(*pair.first, buffer(request), [&](error_code ec, std::size_t) {
+                if (ec) return;
+                async_read(*pair.first, buffer(response), [&](error_code ec, std::size_t) {
+                    if (ec) return;
+                    record(m, sent, size);
+                    if (bench::seconds_since(m_start) < m_duration)
+                        round_trip();
+                    else
+                        pair.second->next_layer().close();
+                });
+            });
+        };
+
+        serve();
+        round_trip();
+        m_ioc.run();
+        m_ioc.restart();
+        return stop(m);
+    }
+
+    measurement bulk(std::size_t size)
+    {
+        auto pair = connect();
+        std::vector<char> data(size, 'x'), received(64 * 1024);
+
+        measurement m;
+        start(m);
+        std::function<void()> send;
+        std::function<void()> receive;
+
+        send = [&]() {
+            async_write(*pair.first, buffer(data), [&](error_code ec, std::size_t) {
+                if (ec) return;
+                ++m.operations;
+                if (bench::seconds_since(m_start) < m_duration)
+                    send();
+                else
+                    pair.first->next_layer().shutdown(socket_base::shutdown_send, ec);
+            });
+        };
+
+        receive = [&]() {
+            pair.second->async_read_some(buffer(received), [&](error_code ec, std::size_t n) {
+                m.bytes += n;
+                if (!ec) receive();
+            });
+        };
+
+        send();
+        receive();
+        m_ioc.run();
+        m_ioc.restart();
+        return stop(m);
+    }
+
+    measurement handshake(unsigned int concurrency)
+    {
+        measurement m;
+        start(m);
+        for (unsigned int i = 0; i < concurrency; ++i)
+            start_handshake(m);
+        m_ioc.run();
+        m_ioc.restart();
+        return stop(m);
+    }
+
+private:
+    using stream_pair = std::pair<std::unique_ptr<stream>, std::unique_ptr<stream>>;
+
+    stream_pair make_pair()
+    {
+        stream_pair pair(std::make_unique<stream>(m_ioc, *m_client_ctx),
+                         std::make_unique<stream>(m_ioc, *m_server_ctx));
+        local::connect_pair(pair.first->next_layer(), pair.second->next_layer());
+        Backend::configure(*pair.first);
+        Backend::configure(*pair.second);
+        return pair;
+    }
+
+    stream_pair connect()
+    {
+        auto pair = make_pair();
+        error_code first_error;
+        auto on_handshake = [&first_error]() {
+            return [&first_error](error_code const& ec) {
+                if (ec) first_error = ec;
+            };
+        };
+        pair.first->async_handshake(Backend::client, on_handshake());
+        pair.second->async_handshake(Backend::server, on_handshake());
+        m_ioc.run();
+        m_ioc.restart();
+        if (first_error) throw boost::system::system_error(first_error, "handshake failed");
+        return pair;
+    }
+
+    void start_handshake(measurement& m)
+    {
+        auto pair = std::make_shared<stream_pair>(make_pair());
+        auto pending = std::make_shared<int>(2);
+        auto const begin = bench::clock::now();
+        auto handler = [this, &m, pair, pending, begin](error_code const& ec) {
+            if (--*pending > 0) return;
+            if (!ec) record(m, begin, 0);
+            if (bench::seconds_since(m_start) < m_duration) start_handshake(m);
+        };
+        pair->first->async_handshake(Backend::client, decltype(handler)(handler));
+        pair->second->async_handshake(Backend::server, std::move(handler));
+    }
+
+    void start(measurement& m)
+    {
+        m_start = bench::clock::now();
+        m.allocations = allocation_count.load(std::memory_order_relaxed);
+    }
+
+    measurement& stop(measurement& m)
+    {
+        m.seconds = bench::seconds_since(m_start);
+        m.allocations = allocation_count.load(std::memory_order_relaxed) - m.allocations;
+        return m;
+    }
+
+    static void record(measurement& m, bench::clock::time_point begin, std::size_t bytes)
+    {
+        using us = std::chrono::duration<double, std::micro>;
+        m.latencies.push_back(us(bench::clock::now() - begin).count());
+        ++m.operations;
+        m.bytes += bytes;
+    }
+
+    io_context m_ioc;
+    std::unique_ptr<typename Backend::context> m_server_ctx;
+    std::unique_ptr<typename Backend::context> m_client_ctx;
+    double m_duration;
+    bench::clock::time_point m_start;
+};
+
+// Runs a workload and returns the value of the compared metric
+template <typename Backend>
+double run(std::string const& name,
+           bench::credentials const& creds,
+           bench::options const& opts,
+           char const*& metric)
+{
+    workload<Backend> w(creds, opts.get("duration", 1.0));
+    bench::result r("compare_ssl");
+    r.add("backend", Backend::name).add("workload", name);
+
+    double value = 0;
+    if (name == "echo")
+    {
+        auto m = w.echo(std::size_t(opts.get("echo-size", 64L)));
+        metric = "round_trips_per_sec";
+        value = double(m.operations) / m.seconds;
+        r.add("round_trips_per_sec", value)
+            .add("p50_us", m.percentile(0.50))
+            .add("p99_us", m.percentile(0.99))
+            .add("allocs_per_round_trip", double(m.allocations) / double(m.operations));
+    }
+    else if (name == "bulk")
+    {
+        auto m = w.bulk(std::size_t(opts.get("bulk-size", 65536L)));
+        metric = "mb_per_sec";
+        value = double(m.bytes) / (1024 * 1024) / m.seconds;
+        r.add("mb_per_sec", value)
+            .add("allocs_per_mb", double(m.allocations) * 1024 * 1024 / double(m.bytes));
+    }
+    else if (name == "handshake")
+    {
+        auto m = w.handshake(static_cast<unsigned int>(opts.get("concurrency", 4L)));
+        metric = "handshakes_per_sec";
+        value = double(m.operations) / m.seconds;
+        r.add("handshakes_per_sec", value)
+            .add("p50_us", m.percentile(0.50))
+            .add("p99_us", m.percentile(0.99))
+            .add("allocs_per_handshake", double(m.allocations) / double(m.operations));
+    }
+    else
+    {
+        throw std::invalid_argument("unknown workload: " + name);
+    }
+
+    r.write(opts);
+    return value;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        bench::options opts(argc, argv);
+        auto const creds = bench::generate_credentials(bench::key_type::ecdsa_p256);
+
+        for (auto const& name : opts.get_list("workloads", "echo,bulk,handshake"))
+        {
+            char const* metric = "";
+            double const gnutls_value = run<gnutls_backend>(name, creds, opts, metric);
+            double const openssl_value = run<openssl_backend>(name, creds, opts, metric);
+
+            bench::result("compare_ssl")
+                .add("backend", "ratio")
+                .add("workload", name)
+                .add("metric", metric)
+                .add("gnutls", gnutls_value)
+                .add("openssl", openssl_value)
+                .add("ratio", gnutls_value / openssl_value)
+                .write(opts);
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
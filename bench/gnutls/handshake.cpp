@@ -0,0 +1,376 @@
+//
+// handshake.cpp
+// ~~~~~~~~~~~~~
+//
+// Copyright (c) 2020 Paul-Louis Ageneau (paul-louis at ageneau dot org)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Handshakes per second of gnutls::stream
+//
+// Each handshake runs between a fresh pair of connected local sockets, which avoids exhausting
+// ephemeral ports with TCP. One io_context is run by T threads, and T * concurrency handshakes
+// are kept in flight for --duration seconds. Latency is measured from the start of a handshake
+// to the completion of both sides, CPU time covers both the client and the server.
+//
+// Modes:
+//   full     full handshake with a certificate
+//   resumed  session resumption with a session ticket obtained by a first full handshake
+//   psk      pre-shared key with (EC)DHE, no certificate
+//
+// Options:
+//   --modes=full,resumed,psk
+//   --keys=rsa2048,ecdsa-p256,ed25519
+//   --tls=1.2,1.3
+//   --max-threads=N      (default: hardware concurrency, thread counts are powers of two)
+//   --concurrency=N      (handshakes in flight per thread, default: 4)
+//   --duration=SECONDS   (default: 1)
+//   --output=FILE        (append results to FILE)
+
+#include <boost/asio.hpp>
+#include <boost/asio/gnutls.hpp>
+
+#include "../bench_util.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using namespace boost::asio;
+using error_code = boost::system::error_code;
+using tls_stream = gnutls::stream<local::stream_protocol::socket>;
+
+enum class mode
+{
+    full,
+    resumed,
+    psk
+};
+
+mode parse_mode(std::string const& name)
+{
+    if (name == "full") return mode::full;
+    if (name == "resumed") return mode::resumed;
+    if (name == "psk") return mode::psk;
+    throw std::invalid_argument("unknown mode: " + name);
+}
+
+char const psk_username[] = "bench";
+unsigned char const psk_key[] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+                                 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+
+int psk_server_func(gnutls_session_t, char const* username, gnutls_datum_t* key)
+{
+    if (std::strcmp(username, psk_username) != 0) return -1;
+
+    key->data = static_cast<unsigned char*>(gnutls_malloc(sizeof(psk_key)));
+    if (!key->data) return -1;
+    std::memcpy(key->data, psk_key, sizeof(psk_key));
+    key->size = sizeof(psk_key);
+    return 0;
+}
+
+// Session-level state shared by all handshakes of a configuration
+class session_setup
+{
+public:
+    session_setup(mode m, std::string const& tls_version)
+        : m_mode(m)
+        , m_priority(bench::priority_string(tls_version, ""))
+    {
+        if (m_mode == mode::psk)
+        {
+            m_priority += ":-KX-ALL:+ECDHE-PSK:+DHE-PSK";
+
+            bench::check(gnutls_psk_allocate_server_credentials(&m_psk_server),
+                         "gnutls_psk_allocate_server_credentials");
+            gnutls_psk_set_server_credentials_function(m_psk_server, psk_server_func);
+
+            bench::check(gnutls_psk_allocate_client_credentials(&m_psk_client),
+                         "gnutls_psk_allocate_client_credentials");
+            gnutls_datum_t key = {const_cast<unsigned char*>(psk_key), sizeof(psk_key)};
+            bench::check(gnutls_psk_set_client_credentials(
+                             m_psk_client, psk_username, &key, GNUTLS_PSK_KEY_RAW),
+                         "gnutls_psk_set_client_credentials");
+        }
+
+        bench::check(gnutls_session_ticket_key_generate(&m_ticket_key),
+                     "gnutls_session_ticket_key_generate");
+    }
+
+    ~session_setup()
+    {
+        if (m_psk_server) gnutls_psk_free_server_credentials(m_psk_server);
+        if (m_psk_client) gnutls_psk_free_client_credentials(m_psk_client);
+        gnutls_free(m_ticket_key.data);
+    }
+
+    session_setup(session_setup const&) = delete;
+    session_setup& operator=(session_setup const&) = delete;
+
+    void configure(tls_stream& client, tls_stream& server) const
+    {
+        bench::set_priority(client.native_handle(), m_priority);
+        bench::set_priority(server.native_handle(), m_priority);
+
+        bench::check(gnutls_session_ticket_enable_server(server.native_handle(), &m_ticket_key),
+                     "gnutls_session_ticket_enable_server");
+
+        if (m_mode == mode::psk)
+        {
+            bench::check(
+                gnutls_credentials_set(client.native_handle(), GNUTLS_CRD_PSK, m_psk_client),
+                "gnutls_credentials_set");
+            bench::check(
+                gnutls_credentials_set(server.native_handle(), GNUTLS_CRD_PSK, m_psk_server),
+                "gnutls_credentials_set");
+        }
+
+        if (m_mode == mode::resumed && !m_session_data.empty())
+        {
+            bench::check(gnutls_session_set_data(client.native_handle(),
+                                                 m_session_data.data(),
+                                                 m_session_data.size()),
+                         "gnutls_session_set_data");
+        }
+    }
+
+    void set_session_data(gnutls_session_t session)
+    {
+        gnutls_datum_t data;
+        bench::check(gnutls_session_get_data2(session, &data), "gnutls_session_get_data2");
+        m_session_data.assign(data.data, data.data + data.size);
+        gnutls_free(data.data);
+    }
+
+private:
+    mode m_mode;
+    std::string m_priority;
+    gnutls_datum_t m_ticket_key = {nullptr, 0};
+    gnutls_psk_server_credentials_t m_psk_server = nullptr;
+    gnutls_psk_client_credentials_t m_psk_client = nullptr;
+    std::vector<unsigned char> m_session_data;
+};
+
+struct handshake_pair
+{
+    handshake_pair(io_context& ioc, gnutls::context& client_ctx, gnutls::context& server_ctx)
+        : client(ioc, client_ctx)
+        , server(ioc, server_ctx)
+    {
+        local::connect_pair(client.next_layer(), server.next_layer());
+    }
+
+    tls_stream client;
+    tls_stream server;
+    bench::clock::time_point start;
+    std::atomic<int> pending{2};
+    std::atomic<bool> failed{false};
+};
+
+class handshake_test
+{
+public:
+    handshake_test(mode m,
+                   std::string const& tls_version,
+                   unsigned int threads,
+                   unsigned int concurrency,
+                   double duration,
+                   gnutls::context& client_ctx,
+                   gnutls::context& server_ctx)
+        : m_mode(m)
+        , m_threads(threads)
+        , m_concurrency(concurrency)
+        , m_duration(duration)
+        , m_client_ctx(client_ctx)
+        , m_server_ctx(server_ctx)
+        , m_setup(m, tls_version)
+    {}
+
+    bench::result run()
+    {
+        if (m_mode == mode::resumed) prime_session();
+
+        m_start = bench::clock::now();
+        double const cpu_start = bench::process_cpu_time();
+        for (unsigned int i = 0; i < m_threads * m_concurrency; ++i)
+            start_pair();
+
+        std::vector<std::thread> threads;
+        for (unsigned int i = 1; i < m_threads; ++i)
+            threads.emplace_back([this]() { m_ioc.run(); });
+        m_ioc.run();
+        for (auto& t : threads)
+            t.join();
+
+        double const seconds = bench::seconds_since(m_start);
+        double const cpu = bench::process_cpu_time() - cpu_start;
+
+        std::sort(m_latencies.begin(), m_latencies.end());
+        auto percentile = [this](double p) {
+            if (m_latencies.empty()) return 0.0;
+            auto i = std::size_t(p * double(m_latencies.size() - 1));
+            return m_latencies[i];
+        };
+
+        std::size_t const count = m_latencies.size();
+        bench::result r("handshake");
+        r.add("transport", "unix")
+            .add("threads", m_threads)
+            .add("concurrency", m_concurrency)
+            .add("seconds", seconds)
+            .add("handshakes", count)
+            .add("failures", m_failures.load())
+            .add("resumed", m_resumed.load())
+            .add("handshakes_per_sec", double(count) / seconds)
+            .add("p50_us", percentile(0.50))
+            .add("p99_us", percentile(0.99))
+            .add("p999_us", percentile(0.999))
+            .add("cpu_us_per_handshake", count > 0 ? cpu * 1e6 / double(count) : 0.0);
+        return r;
+    }
+
+private:
+    // Run a full handshake then exchange data so TLS 1.3 tickets are received
+    void prime_session()
+    {
+        handshake_pair pair(m_ioc, m_client_ctx, m_server_ctx);
+        m_setup.configure(pair.client, pair.server);
+
+        error_code ec;
+        auto on_handshake = [&ec]() {
+            return [&ec](error_code const& e) {
+                if (e) ec = e;
+            };
+        };
+        pair.client.async_handshake(gnutls::stream_base::client, on_handshake());
+        pair.server.async_handshake(gnutls::stream_base::server, on_handshake());
+        m_ioc.run();
+        m_ioc.restart();
+        if (ec) throw boost::system::system_error(ec, "priming handshake failed");
+
+        char byte = 0;
+        pair.server.write_some(buffer(&byte, 1));
+        pair.client.async_read_some(buffer(&byte, 1), [&ec](error_code const& e, std::size_t) {
+            if (e) ec = e;
+        });
+        m_ioc.run();
+        m_ioc.restart();
+        if (ec) throw boost::system::system_error(ec, "priming read failed");
+
+        m_setup.set_session_data(pair.client.native_handle());
+    }
+
+    void start_pair()
+    {
+        auto pair = std::make_shared<handshake_pair>(m_ioc, m_client_ctx, m_server_ctx);
+        m_setup.configure(pair->client, pair->server);
+
+        auto handler = [this, pair](error_code const& ec) { on_handshake(pair, ec); };
+        pair->start = bench::clock::now();
+        pair->client.async_handshake(gnutls::stream_base::client, decltype(handler)(handler));
+        pair->server.async_handshake(gnutls::stream_base::server, std::move(handler));
+    }
+
+    void on_handshake(std::shared_ptr<handshake_pair> const& pair, error_code const& ec)
+    {
+        if (ec) pair->failed = true;
+        if (--pair->pending > 0) return;
+
+        if (pair->failed)
+        {
+            ++m_failures;
+        }
+        else
+        {
+            using us = std::chrono::duration<double, std::micro>;
+            double const latency = us(bench::clock::now() - pair->start).count();
+            if (gnutls_session_is_resumed(pair->client.native_handle())) ++m_resumed;
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_latencies.push_back(latency);
+        }
+
+        if (bench::seconds_since(m_start) < m_duration) start_pair();
+    }
+
+    mode m_mode;
+    unsigned int m_threads;
+    unsigned int m_concurrency;
+    double m_duration;
+    gnutls::context& m_client_ctx;
+    gnutls::context& m_server_ctx;
+    session_setup m_setup;
+
+    io_context m_ioc;
+    bench::clock::time_point m_start;
+    std::mutex m_mutex;
+    std::vector<double> m_latencies;
+    std::atomic<std::size_t> m_failures{0};
+    std::atomic<std::size_t> m_resumed{0};
+};
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        bench::options opts(argc, argv);
+
+        unsigned int const max_threads = static_cast<unsigned int>(
+            opts.get("max-threads", long(std::max(1u, std::thread::hardware_concurrency()))));
+        auto const concurrency = static_cast<unsigned int>(opts.get("concurrency", 4L));
+        double const duration = opts.get("duration", 1.0);
+
+        for (auto const& mode_name : opts.get_list("modes", "full,resumed,psk"))
+        {
+            mode const m = parse_mode(mode_name);
+
+            // The key type is irrelevant with PSK
+            auto keys = opts.get_list("keys", "rsa2048,ecdsa-p256,ed25519");
+            if (m == mode::psk) keys.resize(1);
+
+            for (auto const& key_name : keys)
+            {
+                auto const key = bench::parse_key_type(key_name);
+                auto const creds = bench::generate_credentials(key);
+
+                gnutls::context server_ctx(gnutls::context::tls_server);
+                server_ctx.use_certificate(buffer(creds.certificate), gnutls::context::pem);
+                server_ctx.use_private_key(buffer(creds.private_key), gnutls::context::pem);
+
+                gnutls::context client_ctx(gnutls::context::tls_client);
+                client_ctx.set_verify_mode(gnutls::verify_none);
+
+                for (auto const& tls_version : opts.get_list("tls", "1.2,1.3"))
+                    for (unsigned int threads = 1; threads <= max_threads; threads *= 2)
+                    {
+                        handshake_test test(
+                            m, tls_version, threads, concurrency, duration, client_ctx, server_ctx);
+                        test.run()
+                            .add("mode", mode_name)
+                            .add("key", m == mode::psk ? "none" : key_name)
+                            .add("tls", tls_version)
+                            .write(opts);
+                    }
+            }
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,288 @@
+//
+// throughput.cpp
+// ~~~~~~~~~~~~~~
+//
+// Copyright (c) 2020 Paul-Louis Ageneau (paul-louis at ageneau dot org)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Loopback throughput of gnutls::stream over TCP and over an in-memory pipe
+//
+// Each thread count T runs T client/server pairs on one io_context run by T threads. Clients
+// write fixed-size buffers for --duration seconds then shut down, servers count the bytes they
+// decrypt. One JSON line is printed per configuration. The memory transport has no system
+// calls on the data path, so it measures the record layer alone.
+//
+// Options:
+//   --transports=tcp,memory
+//   --tls=1.2,1.3
+//   --ciphers=AES-128-GCM,CHACHA20-POLY1305
+//   --sizes=64,256,1024,4096,16384,65536,262144,1048576
+//   --max-threads=N      (default: hardware concurrency, thread counts are powers of two)
+//   --duration=SECONDS   (default: 1)
+//   --output=FILE        (append results to FILE)
+
+#include <boost/asio.hpp>
+#include <boost/asio/gnutls.hpp>
+
+#include "../bench_util.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using namespace boost::asio;
+using error_code = boost::system::error_code;
+struct config
+{
+    std::string transport;
+    std::string tls_version;
+    std::string cipher;
+    std::size_t write_size;
+    unsigned int threads;
+    double duration;
+};
+
+// Number of records sent under the current write keys, from the record sequence number. Unlike
+// a count derived from the write size, this follows what the record layer actually produced.
+std::uint64_t records_sent(gnutls_session_t session)
+{
+    unsigned char seq[8];
+    bench::check(gnutls_record_get_state(session, 0, nullptr, nullptr, nullptr, seq),
+                 "gnutls_record_get_state");
+    std::uint64_t n = 0;
+    for (unsigned char b : seq)
+        n = (n << 8) | b;
+    return n;
+}
+
+void connect_transport(ip::tcp::socket& client, ip::tcp::socket& server)
+{
+    ip::tcp::acceptor acceptor(client.get_executor(),
+                               ip::tcp::endpoint(ip::address_v4::loopback(), 0));
+    client.connect(acceptor.local_endpoint());
+    acceptor.accept(server);
+    client.set_option(ip::tcp::no_delay(true));
+    server.set_option(ip::tcp::no_delay(true));
+}
+
+void connect_transport(gnutls::memory_pipe& client, gnutls::memory_pipe& server)
+{
+    gnutls::connect_pair(client, server);
+}
+
+template <typename Socket> struct connection
+{
+    using tls_stream = gnutls::stream<Socket>;
+
+    connection(io_context& ioc, gnutls::context& client_ctx, gnutls::context& server_ctx)
+        : client(ioc, client_ctx)
+        , server(ioc, server_ctx)
+    {}
+
+    tls_stream client;
+    tls_stream server;
+
+    std::vector<char> write_buffer;
+    std::vector<char> read_buffer;
+
+    std::size_t writes = 0;
+    std::uint64_t first_record = 0;
+    std::uint64_t records = 0;
+    std::size_t bytes_received = 0;
+    bench::clock::time_point end;
+};
+
+template <typename Socket> class throughput_test
+{
+public:
+    throughput_test(config const& cfg, gnutls::context& client_ctx, gnutls::context& server_ctx)
+        : m_cfg(cfg)
+    {
+        auto const priority = bench::priority_string(cfg.tls_version, cfg.cipher);
+        for (unsigned int i = 0; i < cfg.threads; ++i)
+        {
+            auto conn = std::make_unique<connection_type>(m_ioc, client_ctx, server_ctx);
+            connect_transport(conn->client.next_layer(), conn->server.next_layer());
+
+            bench::set_priority(conn->client.native_handle(), priority);
+            bench::set_priority(conn->server.native_handle(), priority);
+
+            conn->write_buffer.assign(cfg.write_size, 'x');
+            conn->read_buffer.resize(std::max(cfg.write_size, std::size_t(64 * 1024)));
+            m_connections.push_back(std::move(conn));
+        }
+    }
+
+    bench::result run()
+    {
+        handshake();
+
+        m_ioc.restart();
+        m_start = bench::clock::now();
+        for (auto& conn : m_connections)
+        {
+            conn->first_record = records_sent(conn->client.native_handle());
+            start_write(*conn);
+            start_read(*conn);
+        }
+
+        std::vector<std::thread> threads;
+        for (unsigned int i = 1; i < m_cfg.threads; ++i)
+            threads.emplace_back([this]() { m_ioc.run(); });
+        m_ioc.run();
+        for (auto& t : threads)
+            t.join();
+
+        std::size_t bytes = 0, writes = 0;
+        std::uint64_t records = 0;
+        auto end = m_start;
+        for (auto const& conn : m_connections)
+        {
+            bytes += conn->bytes_received;
+            writes += conn->writes;
+            records += conn->records;
+            end = std::max(end, conn->end);
+        }
+
+        double const seconds = std::chrono::duration<double>(end - m_start).count();
+        auto& session = m_connections.front()->client;
+        bench::result r("throughput");
+        r.add("transport", m_cfg.transport)
+            .add("tls", m_cfg.tls_version)
+            .add("cipher", gnutls_cipher_get_name(gnutls_cipher_get(session.native_handle())))
+            .add("write_size", m_cfg.write_size)
+            .add("threads", m_cfg.threads)
+            .add("seconds", seconds)
+            .add("bytes", bytes)
+            .add("mb_per_sec", double(bytes) / (1024 * 1024) / seconds)
+            .add("writes_per_sec", double(writes) / seconds)
+            .add("records_per_sec", double(records) / seconds);
+        return r;
+    }
+
+private:
+    using connection_type = connection<Socket>;
+
+    void handshake()
+    {
+        std::size_t pending = m_connections.size() * 2;
+        error_code first_error;
+        auto on_handshake = [&]() {
+            return [&](error_code const& ec) {
+                if (ec && !first_error) first_error = ec;
+                --pending;
+            };
+        };
+
+        for (auto& conn : m_connections)
+        {
+            conn->client.async_handshake(gnutls::stream_base::client, on_handshake());
+            conn->server.async_handshake(gnutls::stream_base::server, on_handshake());
+        }
+
+        m_ioc.run();
+        if (first_error || pending > 0)
+            throw boost::system::system_error(first_error, "handshake failed");
+    }
+
+    void start_write(connection_type& conn)
+    {
+        async_write(conn.client, buffer(conn.write_buffer), [this, &conn](error_code ec, size_t) {
+            if (ec) return;
+
+            ++conn.writes;
+            conn.records = records_sent(conn.client.native_handle()) - conn.first_record;
+
+            if (bench::seconds_since(m_start) < m_cfg.duration)
+                start_write(conn);
+            else
+                conn.client.next_layer().shutdown(socket_base::shutdown_send, ec);
+        });
+    }
+
+    void start_read(connection_type& conn)
+    {
+        conn.server.async_read_some(buffer(conn.read_buffer),
+                                    [this, &conn](error_code ec, std::size_t bytes) {
+                                        conn.bytes_received += bytes;
+                                        if (!ec)
+                                            start_read(conn);
+                                        else
+                                            conn.end = bench::clock::now();
+                                    });
+    }
+
+    config m_cfg;
+    io_context m_ioc;
+    std::vector<std::unique_ptr<connection_type>> m_connections;
+    bench::clock::time_point m_start;
+};
+
+// Runs every configuration over one transport
+template <typename Socket>
+void run(std::string const& transport,
+         gnutls::context& client_ctx,
+         gnutls::context& server_ctx,
+         bench::options const& opts)
+{
+    unsigned int const max_threads = static_cast<unsigned int>(
+        opts.get("max-threads", long(std::max(1u, std::thread::hardware_concurrency()))));
+    double const duration = opts.get("duration", 1.0);
+
+    for (auto const& tls_version : opts.get_list("tls", "1.2,1.3"))
+        for (auto const& cipher : opts.get_list("ciphers", "AES-128-GCM,CHACHA20-POLY1305"))
+            for (auto const& size :
+                 opts.get_list("sizes", "64,256,1024,4096,16384,65536,262144,1048576"))
+                for (unsigned int threads = 1; threads <= max_threads; threads *= 2)
+                {
+                    config cfg{transport, tls_version, cipher, std::stoul(size), threads, duration};
+                    throughput_test<Socket> test(cfg, client_ctx, server_ctx);
+                    test.run().write(opts);
+                }
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        bench::options opts(argc, argv);
+
+        auto const creds = bench::generate_credentials(bench::key_type::ecdsa_p256);
+
+        gnutls::context server_ctx(gnutls::context::tls_server);
+        server_ctx.use_certificate(buffer(creds.certificate), gnutls::context::pem);
+        server_ctx.use_private_key(buffer(creds.private_key), gnutls::context::pem);
+
+        gnutls::context client_ctx(gnutls::context::tls_client);
+        client_ctx.set_verify_mode(gnutls::verify_none);
+
+        for (auto const& transport : opts.get_list("transports", "tcp,memory"))
+        {
+            if (transport == "tcp")
+                run<ip::tcp::socket>(transport, client_ctx, server_ctx, opts);
+            else if (transport == "memory")
+                run<gnutls::memory_pipe>(transport, client_ctx, server_ctx, opts);
+            else
+                throw std::invalid_argument("unknown transport: " + transport);
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -13,9 +13,17 @@
 
 #include <boost/asio/gnutls/context.hpp>
 #include <boost/asio/gnutls/context_base.hpp>
+#include <boost/asio/gnutls/datagram_stream.hpp>
+#include <boost/asio/gnutls/dtls_server.hpp>
+#include <boost/asio/gnutls/engine.hpp>
 #include <boost/asio/gnutls/error.hpp>
+#include <boost/asio/gnutls/handshake_trace.hpp>
 #include <boost/asio/gnutls/host_name_verification.hpp>
+#include <boost/asio/gnutls/memory_pipe.hpp>
+#include <boost/asio/gnutls/metrics.hpp>
+#include <boost/asio/gnutls/quic_handshake.hpp>
 #include <boost/asio/gnutls/rfc2818_verification.hpp>
+#include <boost/asio/gnutls/session.hpp>
 #include <boost/asio/gnutls/stream.hpp>
 #include <boost/asio/gnutls/stream_base.hpp>
 #include <boost/asio/gnutls/verify_context.hpp>
@@ -13,6 +13,7 @@
 
 #include "context_base.hpp"
 #include "error.hpp"
+#include "metrics.hpp"
 #include "verify_context.hpp"
 
 #include <boost/asio.hpp>
@@ -329,6 +330,9 @@ public:
 
     // -----------------------------------
 
+    // Aggregated counters of all streams using this context
+    context_metrics metrics() const { return m_impl->metrics.snapshot(); }
+
 private:
     struct impl
     {
@@ -362,6 +366,8 @@ private:
         std::function<bool(bool preverified, verify_context& ctx)> verify_callback;
         std::function<std::string(std::size_t max_len, password_purpose purpose)> password_callback;
         std::function<bool(stream_base& s, std::string name)> server_name_callback;
+
+        detail::metrics_registry metrics;
     };
 
     std::shared_ptr<impl> m_impl;
@@ -0,0 +1,833 @@
+//
+// gnutls/datagram_stream.hpp
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2020 Paul-Louis Ageneau (paul-louis at ageneau dot org)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef BOOST_ASIO_GNUTLS_DATAGRAM_STREAM_HPP
+#define BOOST_ASIO_GNUTLS_DATAGRAM_STREAM_HPP
+
+#include "context.hpp"
+#include "error.hpp"
+#include "probes.hpp"
+#include "session.hpp"
+#include "stream.hpp"
+#include "stream_base.hpp"
+
+#include <boost/asio.hpp>
+
+#ifndef BOOST_NO_EXCEPTIONS
+#include <boost/system/system_error.hpp>
+#include <boost/throw_exception.hpp>
+#endif
+
+#include <gnutls/dtls.h>
+#include <gnutls/gnutls.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace boost {
+namespace asio {
+namespace gnutls {
+
+// DTLS over a connected datagram socket, like boost::asio::ip::udp::socket. Each send
+// transmits one record and each receive returns one record, so datagram boundaries are kept
+// and a lost datagram does not delay the following ones. Handshake messages are retransmitted
+// on the executor of the socket, following the timeouts set with set_timeouts().
+//
+// The next layer is put in non-blocking mode by every operation. As with stream, handshakes
+// and transferred bytes are counted in the context metrics.
+template <typename NextLayer> class datagram_stream : public stream_base
+{
+public:
+    using next_layer_type = NextLayer;
+    using lowest_layer_type =
+        typename std::remove_reference<next_layer_type>::type::lowest_layer_type;
+    using executor_type = typename std::remove_reference<next_layer_type>::type::executor_type;
+
+    template <typename Arg>
+    datagram_stream(Arg&& arg, context& ctx)
+        : stream_base(ctx)
+        , m_next_layer(std::forward<Arg>(arg))
+    {
+        ensure_impl(m_context_impl->is_server() ? server : client);
+    }
+
+    datagram_stream(datagram_stream&& other)
+        : stream_base(std::move(other))
+        , m_next_layer(std::move(other.m_next_layer))
+        , m_mtu(other.m_mtu)
+        , m_retransmission_timeout(other.m_retransmission_timeout)
+        , m_total_timeout(other.m_total_timeout)
+        , m_impl(std::move(other.m_impl))
+    {
+        m_impl->owner = this;
+    }
+
+    datagram_stream(datagram_stream const& other) = delete;
+    ~datagram_stream()
+    {
+        if (m_impl)
+        {
+            m_impl->abort();
+            m_impl->owner = nullptr;
+        }
+    }
+
+    executor_type get_executor() { return m_next_layer.get_executor(); }
+    const lowest_layer_type& lowest_layer() const { return m_next_layer.lowest_layer(); }
+    lowest_layer_type& lowest_layer() { return m_next_layer.lowest_layer(); }
+    const next_layer_type& next_layer() const { return m_next_layer; }
+    next_layer_type& next_layer() { return m_next_layer; }
+
+    native_handle_type native_handle() { return m_impl->session; }
+
+#ifndef BOOST_NO_EXCEPTIONS
+    void set_host_name(std::string const& name)
+    {
+        error_code ec;
+        set_host_name(name, ec);
+        if (ec) boost::throw_exception(boost::system::system_error(ec));
+    }
+#endif
+
+    error_code set_host_name(std::string const& name, error_code& ec)
+    {
+        int ret =
+            gnutls_server_name_set(m_impl->session, GNUTLS_NAME_DNS, name.c_str(), name.size());
+        return ec = ret == GNUTLS_E_SUCCESS ? error_code()
+                                            : error_code(ret, error::get_ssl_category());
+    }
+
+    // ---------- Path MTU ----------
+
+    // Maximum size of the datagrams sent, including the record overhead
+    void set_mtu(unsigned int mtu)
+    {
+        m_mtu = mtu;
+        gnutls_dtls_set_mtu(m_impl->session, mtu);
+    }
+
+    unsigned int mtu() const { return gnutls_dtls_get_mtu(m_impl->session); }
+
+    // Largest message accepted by send() with the negotiated cipher suite
+    std::size_t max_message_size() const { return gnutls_dtls_get_data_mtu(m_impl->session); }
+
+    // ------------------------------
+
+    // Handshake messages are retransmitted after retransmission, doubled after each attempt,
+    // and the handshake fails with timed_out after total
+    template <typename Rep1, typename Period1, typename Rep2, typename Period2>
+    void set_timeouts(std::chrono::duration<Rep1, Period1> retransmission,
+                      std::chrono::duration<Rep2, Period2> total)
+    {
+        using std::chrono::duration_cast;
+        using std::chrono::milliseconds;
+        m_retransmission_timeout = unsigned(duration_cast<milliseconds>(retransmission).count());
+        m_total_timeout = unsigned(duration_cast<milliseconds>(total).count());
+        gnutls_dtls_set_timeouts(m_impl->session, m_retransmission_timeout, m_total_timeout);
+    }
+
+    template <typename HandshakeHandler>
+    BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(HandshakeHandler, void(error_code))
+    async_handshake(handshake_type type, HandshakeHandler&& handler)
+    {
+        return boost::asio::async_initiate<HandshakeHandler, void(error_code)>(
+            initiate_async_handshake{this}, handler, type);
+    }
+
+    template <typename ShutdownHandler>
+    BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(ShutdownHandler, void(error_code))
+    async_shutdown(ShutdownHandler&& handler)
+    {
+        return boost::asio::async_initiate<ShutdownHandler, void(error_code)>(
+            initiate_async_shutdown{this}, handler);
+    }
+
+    template <typename ConstBufferSequence, typename WriteHandler>
+    BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(WriteHandler, void(error_code, std::size_t))
+    async_send(const ConstBufferSequence& buffers, WriteHandler&& handler)
+    {
+        return boost::asio::async_initiate<WriteHandler, void(error_code, std::size_t)>(
+            initiate_async_send{this}, handler, buffers);
+    }
+
+    template <typename MutableBufferSequence, typename ReadHandler>
+    BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(ReadHandler, void(error_code, std::size_t))
+    async_receive(const MutableBufferSequence& buffers, ReadHandler&& handler)
+    {
+        return boost::asio::async_initiate<ReadHandler, void(error_code, std::size_t)>(
+            initiate_async_receive{this}, handler, buffers);
+    }
+
+#ifndef BOOST_NO_EXCEPTIONS
+    void handshake(handshake_type type)
+    {
+        error_code ec;
+        handshake(type, ec);
+        if (ec) boost::throw_exception(boost::system::system_error(ec));
+    }
+#endif
+
+    error_code handshake(handshake_type type, error_code& ec)
+    {
+        if (m_impl->handshake_handler || m_impl->is_handshake_done)
+            return ec = boost::asio::error::operation_not_supported;
+
+        m_next_layer.non_blocking(true, ec);
+        if (ec) return ec;
+
+        ensure_impl(type);
+        m_impl->handshake_started();
+        gnutls_session_t session = m_impl->session;
+        int ret;
+        while ((ret = m_impl->call([session]() { return gnutls_handshake(session); })) ==
+               GNUTLS_E_AGAIN)
+        {
+            // Wait for the peer until the next retransmission is due
+            auto const timeout = std::chrono::milliseconds(gnutls_dtls_get_timeout(session));
+            wait(layer_type::wait_read, std::chrono::steady_clock::now() + timeout, ec);
+            if (ec == boost::asio::error::timed_out)
+                ec.clear();
+            else if (ec)
+                break;
+        }
+
+        if (!ec) ec = m_impl->to_error(ret);
+        if (!ec) m_impl->is_handshake_done = true;
+        m_impl->handshake_finished(ec);
+        return ec;
+    }
+
+#ifndef BOOST_NO_EXCEPTIONS
+    void shutdown()
+    {
+        error_code ec;
+        shutdown(ec);
+        if (ec) boost::throw_exception(boost::system::system_error(ec));
+    }
+#endif
+
+    // Send close_notify, without waiting for the one of the peer which may be lost
+    error_code shutdown(error_code& ec)
+    {
+        m_next_layer.non_blocking(true, ec);
+        if (ec) return ec;
+
+        int ret;
+        auto op = [this]() { return gnutls_bye(m_impl->session, GNUTLS_SHUT_WR); };
+        while ((ret = m_impl->call(op)) == GNUTLS_E_AGAIN && !wait(layer_type::wait_write, {}, ec))
+            ;
+
+        if (!ec) ec = m_impl->to_error(ret);
+        if (!ec) m_impl->is_handshake_done = false;
+        return ec;
+    }
+
+#ifndef BOOST_NO_EXCEPTIONS
+    template <typename ConstBufferSequence> std::size_t send(const ConstBufferSequence& buffers)
+    {
+        error_code ec;
+        std::size_t bytes_sent = send(buffers, ec);
+        if (ec) boost::throw_exception(boost::system::system_error(ec));
+        return bytes_sent;
+    }
+#endif
+
+    // Fails with message_size if the message does not fit in a datagram, see max_message_size()
+    template <typename ConstBufferSequence>
+    std::size_t send(const ConstBufferSequence& buffers, error_code& ec)
+    {
+        if (m_impl->send_handler || !m_impl->is_handshake_done)
+        {
+            ec = boost::asio::error::operation_not_supported;
+            return 0;
+        }
+
+        m_next_layer.non_blocking(true, ec);
+        if (ec) return 0;
+
+        m_impl->prepare_send(buffers);
+        std::size_t bytes_sent = 0;
+        while (m_impl->try_send(ec, bytes_sent) && !wait(layer_type::wait_write, {}, ec))
+            ;
+        return bytes_sent;
+    }
+
+#ifndef BOOST_NO_EXCEPTIONS
+    template <typename MutableBufferSequence>
+    std::size_t receive(const MutableBufferSequence& buffers)
+    {
+        error_code ec;
+        std::size_t bytes_received = receive(buffers, ec);
+        if (ec) boost::throw_exception(boost::system::system_error(ec));
+        return bytes_received;
+    }
+#endif
+
+    // Fails with eof once the peer has sent close_notify
+    template <typename MutableBufferSequence>
+    std::size_t receive(const MutableBufferSequence& buffers, error_code& ec)
+    {
+        if (m_impl->receive_handler || !m_impl->is_handshake_done)
+        {
+            ec = boost::asio::error::operation_not_supported;
+            return 0;
+        }
+
+        m_next_layer.non_blocking(true, ec);
+        if (ec) return 0;
+
+        m_impl->prepare_receive(buffers);
+        std::size_t bytes_received = 0;
+        while (m_impl->try_receive(ec, bytes_received) && !wait(layer_type::wait_read, {}, ec))
+            ;
+        return bytes_received;
+    }
+
+private:
+    using layer_type = typename std::remove_reference<next_layer_type>::type;
+
+    // Initiation function objects for async_initiate
+    class initiate_async_handshake
+    {
+    public:
+        executor_type get_executor() const { return self->get_executor(); }
+
+        template <typename HandshakeHandler>
+        void operator()(HandshakeHandler&& handler, handshake_type type) const
+        {
+            // If you get an error on the following line it means that your handler does
+            // not meet the documented type requirements for a HandshakeHandler.
+            BOOST_ASIO_HANDSHAKE_HANDLER_CHECK(HandshakeHandler, handler) type_check;
+
+            auto& im = self->m_impl;
+            if (im->handshake_handler || im->is_handshake_done)
+                return self->post_completion(
+                    std::forward<HandshakeHandler>(handler),
+                    error_code(boost::asio::error::operation_not_supported));
+
+            error_code ec;
+            self->m_next_layer.non_blocking(true, ec);
+            if (ec) return self->post_completion(std::forward<HandshakeHandler>(handler), ec);
+
+            self->ensure_impl(type);
+            im->handshake_started();
+            im->handshake_handler.emplace(
+                std::forward<HandshakeHandler>(handler), self->get_executor());
+            im->run();
+        }
+
+        datagram_stream* self;
+    };
+
+    class initiate_async_shutdown
+    {
+    public:
+        executor_type get_executor() const { return self->get_executor(); }
+
+        template <typename ShutdownHandler> void operator()(ShutdownHandler&& handler) const
+        {
+            // If you get an error on the following line it means that your handler does
+            // not meet the documented type requirements for a ShutdownHandler.
+            BOOST_ASIO_SHUTDOWN_HANDLER_CHECK(ShutdownHandler, handler) type_check;
+
+            auto& im = self->m_impl;
+            if (im->shutdown_handler || !im->is_handshake_done)
+                return self->post_completion(
+                    std::forward<ShutdownHandler>(handler),
+                    error_code(boost::asio::error::operation_not_supported));
+
+            error_code ec;
+            self->m_next_layer.non_blocking(true, ec);
+            if (ec) return self->post_completion(std::forward<ShutdownHandler>(handler), ec);
+
+            im->shutdown_handler.emplace(
+                std::forward<ShutdownHandler>(handler), self->get_executor());
+            im->run();
+        }
+
+        datagram_stream* self;
+    };
+
+    class initiate_async_send
+    {
+    public:
+        executor_type get_executor() const { return self->get_executor(); }
+
+        template <typename WriteHandler, typename ConstBufferSequence>
+        void operator()(WriteHandler&& handler, const ConstBufferSequence& buffers) const
+        {
+            // If you get an error on the following line it means that your handler does
+            // not meet the documented type requirements for a WriteHandler.
+            BOOST_ASIO_WRITE_HANDLER_CHECK(WriteHandler, handler) type_check;
+
+            auto& im = self->m_impl;
+            if (im->send_handler || !im->is_handshake_done)
+            {
+                error_code const ec = boost::asio::error::operation_not_supported;
+                return self->post_completion(
+                    std::forward<WriteHandler>(handler), ec, std::size_t(0));
+            }
+
+            error_code ec;
+            self->m_next_layer.non_blocking(true, ec);
+            if (ec)
+                return self->post_completion(
+                    std::forward<WriteHandler>(handler), ec, std::size_t(0));
+
+            im->prepare_send(buffers);
+            im->send_handler.emplace(std::forward<WriteHandler>(handler), self->get_executor());
+            im->run();
+        }
+
+        datagram_stream* self;
+    };
+
+    class initiate_async_receive
+    {
+    public:
+        executor_type get_executor() const { return self->get_executor(); }
+
+        template <typename ReadHandler, typename MutableBufferSequence>
+        void operator()(ReadHandler&& handler, const MutableBufferSequence& buffers) const
+        {
+            // If you get an error on the following line it means that your handler does
+            // not meet the documented type requirements for a ReadHandler.
+            BOOST_ASIO_READ_HANDLER_CHECK(ReadHandler, handler) type_check;
+
+            auto& im = self->m_impl;
+            if (im->receive_handler || !im->is_handshake_done)
+            {
+                error_code const ec = boost::asio::error::operation_not_supported;
+                return self->post_completion(
+                    std::forward<ReadHandler>(handler), ec, std::size_t(0));
+            }
+
+            error_code ec;
+            self->m_next_layer.non_blocking(true, ec);
+            if (ec)
+                return self->post_completion(
+                    std::forward<ReadHandler>(handler), ec, std::size_t(0));
+
+            im->prepare_receive(buffers);
+            im->receive_handler.emplace(std::forward<ReadHandler>(handler), self->get_executor());
+            im->run();
+        }
+
+        datagram_stream* self;
+    };
+
+    template <typename Handler, typename... Values>
+    void post_completion(Handler&& handler, Values&&... values)
+    {
+        detail::deliver(
+            get_executor(), false, std::forward<Handler>(handler), std::forward<Values>(values)...);
+    }
+
+    // Returns true with ec set on failure
+    bool wait(typename layer_type::wait_type type,
+              std::chrono::steady_clock::time_point deadline,
+              error_code& ec)
+    {
+        detail::wait_ready(
+            m_next_layer, type, deadline, ec, detail::has_native_socket<layer_type>());
+        return bool(ec);
+    }
+
+    struct impl : public detail::tls_session, public std::enable_shared_from_this<impl>
+    {
+        using clock = std::chrono::steady_clock;
+        using timer_type = boost::asio::
+            basic_waitable_timer<clock, boost::asio::wait_traits<clock>, executor_type>;
+
+        impl(datagram_stream* p, handshake_type t)
+            : tls_session(p, t, GNUTLS_DATAGRAM)
+            , timer(p->get_executor())
+        {
+            gnutls_transport_set_ptr(session, this);
+            gnutls_transport_set_push_function(session, push_func);
+            gnutls_transport_set_pull_function(session, pull_func);
+            gnutls_transport_set_pull_timeout_function(session, pull_timeout_func);
+        }
+
+        datagram_stream* parent() const { return static_cast<datagram_stream*>(owner); }
+
+        template <typename... Args, typename... Values>
+        void post(detail::handler_slot<executor_type, Args...>& handler, Values&&... values)
+        {
+            if (owner)
+                handler.complete(parent()->get_executor(), false, std::forward<Values>(values)...);
+        }
+
+        void abort()
+        {
+            error_code const ec = boost::asio::error::operation_aborted;
+            if (handshake_handler) post(handshake_handler, ec);
+            if (shutdown_handler) post(shutdown_handler, ec);
+            if (send_handler) post(send_handler, ec, std::size_t(0));
+            if (receive_handler) post(receive_handler, ec, std::size_t(0));
+            timer.cancel();
+        }
+
+        // Call a GnuTLS function again after an interruption or a warning alert. Other non-fatal
+        // errors, like GNUTLS_E_LARGE_PACKET, are reported since retrying would fail again.
+        template <typename Operation> int call(Operation op)
+        {
+            int ret;
+            do {
+                ret = op();
+            } while (ret == GNUTLS_E_INTERRUPTED || ret == GNUTLS_E_WARNING_ALERT_RECEIVED);
+            return ret;
+        }
+
+        error_code to_error(int ret) const
+        {
+            if (ret >= 0) return {};
+            switch (ret)
+            {
+            case GNUTLS_E_PREMATURE_TERMINATION: return error::stream_truncated;
+            case GNUTLS_E_TIMEDOUT: return boost::asio::error::timed_out;
+            case GNUTLS_E_LARGE_PACKET: return boost::asio::error::message_size;
+            default: return error_code(ret, error::get_ssl_category());
+            }
+        }
+
+        void handshake_started()
+        {
+            if (!owner || handshake_start != clock::time_point()) return;
+            handshake_start = clock::now();
+            parent()->m_context_impl->metrics.handshake_started();
+        }
+
+        void handshake_finished(error_code const& ec)
+        {
+            auto const start = std::exchange(handshake_start, clock::time_point());
+            if (!owner || start == clock::time_point()) return;
+            bool const resumed = !ec && gnutls_session_is_resumed(session) != 0;
+            parent()->m_context_impl->metrics.handshake_finished(ec, resumed, clock::now() - start);
+        }
+
+        // Messages made of several buffers are gathered, since a record is sent in one piece
+        template <typename ConstBufferSequence>
+        void prepare_send(const ConstBufferSequence& buffers)
+        {
+            auto const first = boost::asio::buffer_sequence_begin(buffers);
+            std::size_t const size = boost::asio::buffer_size(buffers);
+            if (first == boost::asio::buffer_sequence_end(buffers) ||
+                const_buffer(*first).size() == size)
+            {
+                send_data = size > 0 ? const_buffer(*first) : const_buffer();
+                return;
+            }
+
+            send_scratch.resize(size);
+            boost::asio::buffer_copy(boost::asio::buffer(send_scratch), buffers);
+            send_data = boost::asio::buffer(send_scratch);
+        }
+
+        template <typename MutableBufferSequence>
+        void prepare_receive(const MutableBufferSequence& buffers)
+        {
+            receive_buffers.clear();
+            for (auto b = buffer_sequence_begin(buffers), end(buffer_sequence_end(buffers));
+                 b != end;
+                 ++b)
+            {
+                auto r = *b; // operator -> might be deleted
+                if (r.size() > 0) receive_buffers.push_back(r);
+            }
+        }
+
+        // Returns true if GnuTLS would block, otherwise the send is complete
+        bool try_send(error_code& ec, std::size_t& bytes_sent)
+        {
+            int ret = call([this]() {
+                return gnutls_record_send(session, send_data.data(), send_data.size());
+            });
+            if (ret == GNUTLS_E_AGAIN) return true;
+
+            ec = to_error(ret);
+            bytes_sent = ret > 0 ? std::size_t(ret) : 0;
+            if (bytes_sent > 0 && owner)
+                parent()->m_context_impl->metrics.bytes_written(bytes_sent);
+            BOOST_ASIO_GNUTLS_PROBE3(send__some, session, bytes_sent, ec.value());
+            return false;
+        }
+
+        // Returns true if GnuTLS would block, otherwise the receive is complete. Records larger
+        // than a single buffer are received in scratch space, then scattered.
+        bool try_receive(error_code& ec, std::size_t& bytes_received)
+        {
+            bool const direct = receive_buffers.size() == 1;
+            if (!direct) receive_scratch.resize(max_record_size);
+            mutable_buffer const target = direct ? receive_buffers.front()
+                                                 : boost::asio::buffer(receive_scratch);
+
+            int ret = call([this, &target]() {
+                return gnutls_record_recv(session, target.data(), target.size());
+            });
+            if (ret == GNUTLS_E_AGAIN) return true;
+
+            ec = to_error(ret);
+            bytes_received = ret > 0 ? std::size_t(ret) : 0;
+            if (ret == 0 && target.size() > 0) ec = boost::asio::error::eof;
+            if (!direct && bytes_received > 0)
+                bytes_received = boost::asio::buffer_copy(
+                    receive_buffers, boost::asio::buffer(receive_scratch.data(), bytes_received));
+            if (bytes_received > 0 && owner)
+                parent()->m_context_impl->metrics.bytes_read(bytes_received);
+            BOOST_ASIO_GNUTLS_PROBE3(recv__some, session, bytes_received, ec.value());
+            return false;
+        }
+
+        // Progress every pending operation, then wait for the readiness they are blocked on
+        void run()
+        {
+            if (!owner) return;
+            auto self = this->shared_from_this(); // completions may destroy the stream
+
+            want_read = want_write = false;
+
+            if (handshake_handler)
+            {
+                // Waiting for the peer, the timer retransmits, including flights which could not
+                // be sent. The direction reported by GnuTLS is the one of its last transport call.
+                int ret = call([this]() { return gnutls_handshake(session); });
+                if (ret == GNUTLS_E_AGAIN)
+                    want_read = true;
+                else
+                {
+                    error_code const ec = to_error(ret);
+                    is_handshake_done = !ec;
+                    timer.cancel();
+                    handshake_finished(ec);
+                    post(handshake_handler, ec);
+                }
+            }
+
+            if (shutdown_handler)
+            {
+                int ret = call([this]() { return gnutls_bye(session, GNUTLS_SHUT_WR); });
+                if (ret == GNUTLS_E_AGAIN)
+                    want_write = true;
+                else
+                {
+                    error_code const ec = to_error(ret);
+                    if (!ec) is_handshake_done = false;
+                    post(shutdown_handler, ec);
+                }
+            }
+
+            if (send_handler)
+            {
+                error_code ec;
+                std::size_t bytes_sent = 0;
+                if (try_send(ec, bytes_sent))
+                    want_write = true;
+                else
+                    post(send_handler, ec, bytes_sent);
+            }
+
+            if (receive_handler)
+            {
+                error_code ec;
+                std::size_t bytes_received = 0;
+                if (try_receive(ec, bytes_received))
+                    want_read = true;
+                else
+                    post(receive_handler, ec, bytes_received);
+            }
+
+            // A handshake which timed out leaves a wait for a datagram which may never come. It is
+            // abandoned rather than cancelled, as cancelling the socket would abort every other
+            // operation on it, and stays pending until a datagram arrives or the socket is closed.
+            if (is_reading && !want_read)
+            {
+                is_reading = false;
+                ++read_generation;
+            }
+
+            schedule();
+        }
+
+        void schedule()
+        {
+            if (!owner) return;
+            auto& next_layer = parent()->m_next_layer;
+
+            if (want_read && !std::exchange(is_reading, true))
+                next_layer.async_wait(layer_type::wait_read,
+                                      std::bind(&impl::handle_read_ready,
+                                                this->shared_from_this(),
+                                                read_generation));
+
+            if (want_write && !std::exchange(is_writing, true))
+                next_layer.async_wait(
+                    layer_type::wait_write,
+                    std::bind(&impl::handle_write_ready, this->shared_from_this()));
+
+            // Retransmit the last flight of the handshake if the peer does not answer in time
+            if (handshake_handler)
+            {
+                timer.expires_after(std::chrono::milliseconds(gnutls_dtls_get_timeout(session)));
+                timer.async_wait(std::bind(
+                    &impl::handle_timer, this->shared_from_this(), std::placeholders::_1));
+            }
+        }
+
+        // Errors of the next layer are reported by the following transport call. The completion
+        // of an abandoned read wait is ignored.
+        void handle_read_ready(unsigned int generation)
+        {
+            if (generation != read_generation) return;
+            is_reading = false;
+            run();
+        }
+
+        void handle_write_ready()
+        {
+            is_writing = false;
+            run();
+        }
+
+        void handle_timer(error_code const& ec)
+        {
+            if (ec != boost::asio::error::operation_aborted && handshake_handler) run();
+        }
+
+        static ssize_t pull_func(void* ptr, void* data, std::size_t size)
+        {
+            namespace error = boost::asio::error;
+
+            auto* im = static_cast<impl*>(ptr);
+            if (!im->owner)
+            {
+                gnutls_transport_set_errno(im->session, ECONNRESET);
+                return -1;
+            }
+
+            error_code ec;
+            std::size_t bytes_received =
+                im->parent()->m_next_layer.receive(boost::asio::buffer(data, size), 0, ec);
+            if (ec)
+            {
+                int const err =
+                    (ec == error::try_again || ec == error::would_block) ? EAGAIN : ECONNRESET;
+                BOOST_ASIO_GNUTLS_PROBE4(pull, im->session, size, -1, err);
+                gnutls_transport_set_errno(im->session, err);
+                return -1;
+            }
+
+            BOOST_ASIO_GNUTLS_PROBE4(pull, im->session, size, bytes_received, 0);
+            gnutls_transport_set_errno(im->session, 0);
+            return ssize_t(bytes_received);
+        }
+
+        static ssize_t push_func(void* ptr, const void* data, std::size_t len)
+        {
+            namespace error = boost::asio::error;
+
+            auto* im = static_cast<impl*>(ptr);
+            if (!im->owner)
+            {
+                gnutls_transport_set_errno(im->session, ECONNRESET);
+                return -1;
+            }
+
+            error_code ec;
+            std::size_t bytes_sent =
+                im->parent()->m_next_layer.send(boost::asio::buffer(data, len), 0, ec);
+            if (ec)
+            {
+                int err = ECONNRESET;
+                if (ec == error::try_again || ec == error::would_block)
+                    err = EAGAIN;
+                else if (ec == error::message_size)
+                    err = EMSGSIZE;
+                BOOST_ASIO_GNUTLS_PROBE4(push, im->session, len, -1, err);
+                gnutls_transport_set_errno(im->session, err);
+                return -1;
+            }
+
+            BOOST_ASIO_GNUTLS_PROBE4(push, im->session, len, bytes_sent, 0);
+            gnutls_transport_set_errno(im->session, 0);
+            return ssize_t(bytes_sent);
+        }
+
+        // Called by GnuTLS to know whether a datagram is waiting, waits are done by the caller
+        static int pull_timeout_func(gnutls_transport_ptr_t ptr, unsigned int)
+        {
+            auto* im = static_cast<impl*>(ptr);
+            if (!im->owner) return -1;
+
+            error_code ec;
+            std::size_t const available = im->parent()->m_next_layer.available(ec);
+            return ec ? -1 : available > 0 ? 1 : 0;
+        }
+
+        static constexpr std::size_t max_record_size = 16 * 1024;
+
+        bool is_handshake_done = false;
+        bool want_read = false;
+        bool want_write = false;
+        bool is_reading = false; // waiting for the next layer to be readable
+        bool is_writing = false; // waiting for the next layer to be writable
+        unsigned int read_generation = 0; // of the current read wait
+
+        clock::time_point handshake_start; // epoch if no handshake is in progress
+        timer_type timer;                  // retransmission of handshake messages
+
+        detail::handler_slot<executor_type, error_code const&> handshake_handler;
+        detail::handler_slot<executor_type, error_code const&> shutdown_handler;
+        detail::handler_slot<executor_type, error_code const&, std::size_t> send_handler;
+        detail::handler_slot<executor_type, error_code const&, std::size_t> receive_handler;
+
+        const_buffer send_data;
+        std::vector<char> send_scratch;
+        std::vector<mutable_buffer> receive_buffers;
+        std::vector<char> receive_scratch;
+    };
+
+    std::shared_ptr<impl> ensure_impl(handshake_type type)
+    {
+        if (!m_impl || m_impl->type != type)
+        {
+            if (auto old = std::exchange(m_impl, std::make_shared<impl>(this, type)))
+            {
+                old->abort();
+                old->owner = nullptr;
+            }
+
+            // Settings outlive the session
+            if (m_mtu > 0) gnutls_dtls_set_mtu(m_impl->session, m_mtu);
+            if (m_total_timeout > 0)
+                gnutls_dtls_set_timeouts(
+                    m_impl->session, m_retransmission_timeout, m_total_timeout);
+        }
+        return m_impl;
+    }
+
+    next_layer_type m_next_layer;
+    unsigned int m_mtu = 0;                    // GnuTLS default if zero
+    unsigned int m_retransmission_timeout = 0; // milliseconds
+    unsigned int m_total_timeout = 0;          // milliseconds, GnuTLS defaults if zero
+    std::shared_ptr<impl> m_impl;
+};
+
+} // namespace gnutls
+} // namespace asio
+} // namespace boost
+
+#endif
@@ -0,0 +1,339 @@
+//
+// gnutls/detail/handler_slot.hpp
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2020 Paul-Louis Ageneau (paul-louis at ageneau dot org)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef BOOST_ASIO_GNUTLS_DETAIL_HANDLER_SLOT_HPP
+#define BOOST_ASIO_GNUTLS_DETAIL_HANDLER_SLOT_HPP
+
+#include <boost/asio/associated_allocator.hpp>
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/execution.hpp>
+#include <boost/asio/execution_context.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/is_executor.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/prefer.hpp>
+#include <boost/asio/query.hpp>
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace boost {
+namespace asio {
+namespace gnutls {
+namespace detail {
+
+// Handler bound to its completion arguments, keeping its associated executor and allocator
+template <typename Handler, typename Tuple> struct completion_binder
+{
+    void operator()() { invoke(std::make_index_sequence<std::tuple_size<Tuple>::value>()); }
+
+    template <std::size_t... I> void invoke(std::index_sequence<I...>)
+    {
+        handler(std::get<I>(values)...);
+    }
+
+    Handler handler;
+    Tuple values;
+};
+
+// Deliver a completion to the executor associated with the handler, by default the I/O
+// executor, so that handlers bound to a strand do not go through the I/O executor first
+template <typename Executor, typename Handler, typename... Values>
+void deliver(Executor const& io_ex, bool dispatch, Handler&& handler, Values&&... values)
+{
+    using binder = completion_binder<typename std::decay<Handler>::type,
+                                     std::tuple<typename std::decay<Values>::type...>>;
+    auto ex = boost::asio::get_associated_executor(handler, io_ex);
+    binder bound{std::forward<Handler>(handler), std::make_tuple(std::forward<Values>(values)...)};
+    if (dispatch)
+        boost::asio::dispatch(ex, std::move(bound));
+    else
+        boost::asio::post(ex, std::move(bound));
+}
+
+// Outstanding work on an executor: a work guard for executors of the Networking TS model, a copy
+// of the executor preferring tracked work for the others, like any_io_executor, which is smaller
+template <typename Executor, typename = void> struct work_traits
+{
+    using type = executor_work_guard<Executor>;
+
+    static type make(Executor const& ex) { return type(ex); }
+};
+
+template <typename Executor>
+struct work_traits<Executor,
+                   typename std::enable_if<!is_executor<Executor>::value &&
+                                           execution::is_executor<Executor>::value>::type>
+{
+    using type = typename std::decay<typename prefer_result<
+        Executor const&,
+        execution::outstanding_work_t::tracked_t>::type>::type;
+
+    static type make(Executor const& ex)
+    {
+        return boost::asio::prefer(ex, execution::outstanding_work.tracked);
+    }
+};
+
+// Execution context of an executor, from either executor model
+template <typename Executor>
+auto executor_context(Executor const& ex, int)
+    -> decltype(&boost::asio::query(ex, execution::context))
+{
+    return &boost::asio::query(ex, execution::context);
+}
+
+template <typename Executor>
+auto executor_context(Executor const& ex, long) -> decltype(&ex.context())
+{
+    return &ex.context();
+}
+
+// Work on the executor associated with a handler, constructed only when it runs on another
+// execution context than the I/O executor, whose work is already tracked by the pending I/O.
+// Starting then finishing work would stop an io_context which has no other outstanding work.
+// Contexts are compared rather than executors, as a handler may be bound to a strand or to
+// another io_context, or wrapped in a polymorphic executor like the one of use_awaitable.
+template <typename Executor> class optional_work
+{
+public:
+    template <typename IoExecutor>
+    optional_work(Executor const& ex, IoExecutor const& io_ex)
+        : m_owns(static_cast<execution_context*>(executor_context(ex, 0)) !=
+                 static_cast<execution_context*>(executor_context(io_ex, 0)))
+    {
+        if (m_owns) new (&m_storage) work_type(work_traits<Executor>::make(ex));
+    }
+
+    optional_work(optional_work&& other) noexcept
+        : m_owns(other.m_owns)
+    {
+        if (m_owns) new (&m_storage) work_type(std::move(other.work()));
+    }
+
+    optional_work& operator=(optional_work const&) = delete;
+
+    ~optional_work()
+    {
+        if (m_owns) work().~work_type();
+    }
+
+private:
+    using work_type = typename work_traits<Executor>::type;
+
+    work_type& work() { return *static_cast<work_type*>(static_cast<void*>(&m_storage)); }
+
+    bool m_owns;
+    typename std::aligned_storage<sizeof(work_type), alignof(work_type)>::type m_storage;
+};
+
+// Handler of a pending operation. Like in Asio's own operations, outstanding work is tracked on
+// its associated executor when it does not run on the I/O execution context.
+template <typename Handler, typename Executor> struct tracked_handler
+{
+    template <typename H>
+    tracked_handler(H&& h, Executor const& io_ex)
+        : handler(std::forward<H>(h))
+        , work(boost::asio::get_associated_executor(handler, io_ex), io_ex)
+    {}
+
+    Handler handler;
+    optional_work<typename associated_executor<Handler, Executor>::type> work;
+};
+
+// Type-erased storage for the move-only handler of a pending operation, completed at most once.
+// Handlers up to inline_size bytes, like the ones of use_awaitable with the work tracked on
+// their executor or a lambda capturing a few pointers, are stored in place so that starting an
+// operation does not allocate, larger ones are allocated with the allocator associated with the
+// handler.
+template <typename Executor, typename... Args> class handler_slot
+{
+public:
+    static constexpr std::size_t inline_size = 16 * sizeof(void*);
+
+    handler_slot() = default;
+    handler_slot(std::nullptr_t) {}
+    handler_slot(handler_slot&& other) noexcept { move_from(other); }
+    handler_slot(handler_slot const&) = delete;
+    ~handler_slot() { reset(); }
+
+    handler_slot& operator=(handler_slot&& other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            move_from(other);
+        }
+        return *this;
+    }
+
+    handler_slot& operator=(std::nullptr_t)
+    {
+        reset();
+        return *this;
+    }
+
+    template <typename Handler> void emplace(Handler&& handler, Executor const& io_ex)
+    {
+        using ops = handler_ops<tracked_handler<typename std::decay<Handler>::type, Executor>>;
+        reset();
+        ops::construct(&m_storage, std::forward<Handler>(handler), io_ex);
+        m_ops = ops::get();
+    }
+
+    explicit operator bool() const { return m_ops != nullptr; }
+
+    // The slot is released before the handler is delivered, with post or with dispatch, so it
+    // may be reused by an operation started from the handler
+    void complete(Executor const& io_ex, bool dispatch, Args... args)
+    {
+        std::exchange(m_ops, nullptr)
+            ->complete(&m_storage, io_ex, dispatch, std::forward<Args>(args)...);
+    }
+
+private:
+    struct vtable
+    {
+        void (*complete)(void* storage, Executor const& io_ex, bool dispatch, Args... args);
+        void (*move)(void* from, void* to);
+        void (*destroy)(void* storage);
+    };
+
+    using storage_type =
+        typename std::aligned_storage<inline_size, alignof(std::max_align_t)>::type;
+
+    template <typename Tracked,
+              bool Inline = sizeof(Tracked) <= sizeof(storage_type) &&
+                            alignof(Tracked) <= alignof(storage_type) &&
+                            std::is_nothrow_move_constructible<Tracked>::value>
+    struct handler_ops
+    {
+        static Tracked& tracked(void* storage) { return *static_cast<Tracked*>(storage); }
+
+        template <typename H> static void construct(void* storage, H&& h, Executor const& io_ex)
+        {
+            new (storage) Tracked(std::forward<H>(h), io_ex);
+        }
+
+        static void complete(void* storage, Executor const& io_ex, bool dispatch, Args... args)
+        {
+            Tracked t(std::move(tracked(storage)));
+            destroy(storage);
+            deliver(io_ex, dispatch, std::move(t.handler), std::forward<Args>(args)...);
+        }
+
+        static void move(void* from, void* to)
+        {
+            new (to) Tracked(std::move(tracked(from)));
+            destroy(from);
+        }
+
+        static void destroy(void* storage) { tracked(storage).~Tracked(); }
+
+        static vtable const* get()
+        {
+            static vtable const v = {complete, move, destroy};
+            return &v;
+        }
+    };
+
+    // Larger handlers are allocated with their associated allocator
+    template <typename Tracked> struct handler_ops<Tracked, false>
+    {
+        using allocator_type =
+            typename std::allocator_traits<typename associated_allocator<decltype(
+                std::declval<Tracked&>().handler)>::type>::template rebind_alloc<Tracked>;
+        using traits = std::allocator_traits<allocator_type>;
+
+        static Tracked*& pointer(void* storage) { return *static_cast<Tracked**>(storage); }
+
+        template <typename H> static void construct(void* storage, H&& h, Executor const& io_ex)
+        {
+            allocator_type alloc(boost::asio::get_associated_allocator(h));
+            Tracked* p = traits::allocate(alloc, 1);
+            traits::construct(alloc, p, std::forward<H>(h), io_ex);
+            new (storage) Tracked*(p);
+        }
+
+        static void complete(void* storage, Executor const& io_ex, bool dispatch, Args... args)
+        {
+            Tracked t(std::move(*pointer(storage)));
+            destroy(storage);
+            deliver(io_ex, dispatch, std::move(t.handler), std::forward<Args>(args)...);
+        }
+
+        static void move(void* from, void* to) { new (to) Tracked*(pointer(from)); }
+
+        static void destroy(void* storage)
+        {
+            Tracked* p = pointer(storage);
+            allocator_type alloc(boost::asio::get_associated_allocator(p->handler));
+            traits::destroy(alloc, p);
+            traits::deallocate(alloc, p, 1);
+        }
+
+        static vtable const* get()
+        {
+            static vtable const v = {complete, move, destroy};
+            return &v;
+        }
+    };
+
+    void move_from(handler_slot& other)
+    {
+        if (other.m_ops) other.m_ops->move(&other.m_storage, &m_storage);
+        m_ops = std::exchange(other.m_ops, nullptr);
+    }
+
+    void reset()
+    {
+        if (auto ops = std::exchange(m_ops, nullptr)) ops->destroy(&m_storage);
+    }
+
+    vtable const* m_ops = nullptr;
+    storage_type m_storage;
+};
+
+} // namespace detail
+} // namespace gnutls
+
+template <typename Handler, typename Tuple, typename Executor>
+struct associated_executor<gnutls::detail::completion_binder<Handler, Tuple>, Executor>
+{
+    using type = typename associated_executor<Handler, Executor>::type;
+
+    static type get(gnutls::detail::completion_binder<Handler, Tuple> const& b,
+                    Executor const& ex = Executor()) noexcept
+    {
+        return associated_executor<Handler, Executor>::get(b.handler, ex);
+    }
+};
+
+template <typename Handler, typename Tuple, typename Allocator>
+struct associated_allocator<gnutls::detail::completion_binder<Handler, Tuple>, Allocator>
+{
+    using type = typename associated_allocator<Handler, Allocator>::type;
+
+    static type get(gnutls::detail::completion_binder<Handler, Tuple> const& b,
+                    Allocator const& a = Allocator()) noexcept
+    {
+        return associated_allocator<Handler, Allocator>::get(b.handler, a);
+    }
+};
+
+} // namespace asio
+} // namespace boost
+
+#endif
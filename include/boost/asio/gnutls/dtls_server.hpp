@@ -0,0 +1,651 @@
+//
+// gnutls/dtls_server.hpp
+// ~~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2020 Paul-Louis Ageneau (paul-louis at ageneau dot org)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef BOOST_ASIO_GNUTLS_DTLS_SERVER_HPP
+#define BOOST_ASIO_GNUTLS_DTLS_SERVER_HPP
+
+#include "context.hpp"
+#include "datagram_stream.hpp"
+#include "memory_pipe.hpp"
+#include "stream.hpp"
+
+#include <boost/asio.hpp>
+
+#ifndef BOOST_NO_EXCEPTIONS
+#include <boost/system/system_error.hpp>
+#include <boost/throw_exception.hpp>
+#endif
+
+#include <gnutls/dtls.h>
+#include <gnutls/gnutls.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Datagrams are read in batches with recvmmsg where available
+#if defined(__linux__)
+#include <sys/socket.h>
+#define BOOST_ASIO_GNUTLS_HAS_RECVMMSG 1
+#endif
+
+namespace boost {
+namespace asio {
+namespace gnutls {
+
+namespace detail {
+
+struct udp_endpoint_hash
+{
+    std::size_t operator()(boost::asio::ip::udp::endpoint const& e) const
+    {
+        std::size_t h = std::hash<unsigned short>()(e.port());
+        auto const* data = reinterpret_cast<unsigned char const*>(e.data());
+        for (std::size_t i = 0; i < e.size(); ++i)
+            h = h * 31 + data[i];
+        return h;
+    }
+};
+
+// Datagrams routed by a dtls_server to one of its peers
+struct dtls_peer_state
+{
+    bool read_ready()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return !datagrams.empty() || closed;
+    }
+
+    std::mutex mutex;
+    std::deque<std::vector<char>> datagrams;
+    bool closed = false;
+    memory_pipe_event<boost::asio::ip::udp::socket::executor_type> readable;
+};
+
+} // namespace detail
+
+// Server side of DTLS for many peers sharing one unconnected UDP socket, like an acceptor.
+// Hellos of unknown peers are answered with a HelloVerifyRequest carrying a cookie derived
+// from their address, as in RFC 6347, and nothing is allocated for them. A peer repeating its
+// hello with a valid cookie is accepted into the stream passed to async_accept(), then the
+// server routes its datagrams to it by source endpoint.
+//
+// Datagrams are read in batches of up to batch_size, with recvmmsg on Linux. Verified hellos
+// beyond max_backlog waiting for an accept are dropped, the peers will retransmit them.
+class dtls_server
+{
+    struct impl;
+
+public:
+    using error_code = boost::system::error_code;
+    using socket_type = boost::asio::ip::udp::socket;
+    using endpoint_type = boost::asio::ip::udp::endpoint;
+    using executor_type = socket_type::executor_type;
+
+    // Next layer of the streams accepted by a dtls_server: receives the datagrams routed to the
+    // peer and sends through the socket of the server
+    class peer_socket : public socket_base
+    {
+    public:
+        using executor_type = socket_type::executor_type;
+        using lowest_layer_type = peer_socket;
+
+        explicit peer_socket(io_context& ioc)
+            : m_executor(ioc.get_executor())
+        {}
+
+        explicit peer_socket(executor_type const& ex)
+            : m_executor(ex)
+        {}
+
+        peer_socket(peer_socket&& other) = default;
+        peer_socket(peer_socket const&) = delete;
+
+        ~peer_socket()
+        {
+            error_code ec;
+            close(ec);
+        }
+
+        executor_type get_executor() { return m_executor; }
+        const lowest_layer_type& lowest_layer() const { return *this; }
+        lowest_layer_type& lowest_layer() { return *this; }
+
+        bool is_open() const { return bool(m_state); }
+        endpoint_type remote_endpoint() const { return m_remote; }
+
+        error_code non_blocking(bool mode, error_code& ec)
+        {
+            m_non_blocking = mode;
+            return ec = {};
+        }
+
+        bool non_blocking() const { return m_non_blocking; }
+
+        // Size of the next datagram
+        std::size_t available(error_code& ec) const
+        {
+            if (!m_state)
+            {
+                ec = boost::asio::error::bad_descriptor;
+                return 0;
+            }
+
+            ec = {};
+            std::lock_guard<std::mutex> lock(m_state->mutex);
+            return m_state->datagrams.empty() ? 0 : m_state->datagrams.front().size();
+        }
+
+        // Datagrams larger than buffers are truncated, like with a socket
+        template <typename MutableBufferSequence>
+        std::size_t receive(const MutableBufferSequence& buffers, message_flags, error_code& ec)
+        {
+            for (;;)
+            {
+                if (!m_state)
+                {
+                    ec = boost::asio::error::bad_descriptor;
+                    return 0;
+                }
+
+                {
+                    std::unique_lock<std::mutex> lock(m_state->mutex);
+                    if (!m_state->datagrams.empty())
+                    {
+                        std::vector<char> datagram = std::move(m_state->datagrams.front());
+                        m_state->datagrams.pop_front();
+                        lock.unlock();
+                        ec = {};
+                        return boost::asio::buffer_copy(buffers, boost::asio::buffer(datagram));
+                    }
+                }
+
+                if (m_non_blocking)
+                {
+                    ec = boost::asio::error::would_block;
+                    return 0;
+                }
+
+                if (wait(wait_read, ec)) return 0;
+            }
+        }
+
+        // Peers send from their own threads while the server reads its socket, so they send
+        // on its descriptor without touching the socket object, like receive_batch reads it
+        template <typename ConstBufferSequence>
+        std::size_t send(const ConstBufferSequence& buffers, message_flags flags, error_code& ec)
+        {
+            namespace socket_ops = boost::asio::detail::socket_ops;
+            using bufs_type =
+                boost::asio::detail::buffer_sequence_adapter<boost::asio::const_buffer,
+                                                             ConstBufferSequence>;
+
+            auto const descriptor = m_state ? m_server->descriptor.load()
+                                            : boost::asio::detail::invalid_socket;
+            if (descriptor == boost::asio::detail::invalid_socket)
+            {
+                ec = boost::asio::error::bad_descriptor;
+                return 0;
+            }
+
+            bufs_type bufs(buffers);
+            return socket_ops::sync_sendto(descriptor,
+                                           m_non_blocking ? socket_ops::user_set_non_blocking : 0,
+                                           bufs.buffers(),
+                                           bufs.count(),
+                                           flags,
+                                           m_remote.data(),
+                                           m_remote.size(),
+                                           ec);
+        }
+
+        // Writability is the one of the server socket, which is shared by all peers
+        error_code wait(wait_type w, error_code& ec)
+        {
+            return wait(w, std::chrono::steady_clock::time_point(), ec);
+        }
+
+        // Fails with timed_out once the deadline has passed, an epoch deadline meaning none.
+        // Datagrams are routed by the server as it reads its socket, so a read wait only ends
+        // before the deadline while the io_context of the server runs on another thread.
+        error_code
+        wait(wait_type w, std::chrono::steady_clock::time_point deadline, error_code& ec)
+        {
+            if (!m_state) return ec = boost::asio::error::bad_descriptor;
+            if (w != wait_read)
+            {
+                ec = {};
+                detail::wait_ready(m_server->socket, w, deadline, ec, std::true_type());
+                return ec;
+            }
+
+            auto state = m_state;
+            auto ready = [state]() { return state->read_ready(); };
+            if (deadline == std::chrono::steady_clock::time_point())
+                state->readable.wait(ready);
+            else if (!state->readable.wait_until(deadline, ready))
+                return ec = boost::asio::error::timed_out;
+            return ec = {};
+        }
+
+        template <typename WaitHandler>
+        BOOST_ASIO_INITFN_RESULT_TYPE(WaitHandler, void(error_code))
+        async_wait(wait_type w, WaitHandler&& handler)
+        {
+            boost::asio::async_completion<WaitHandler, void(error_code)> init(handler);
+            auto& h = init.completion_handler;
+
+            // Delivered like a wait on a memory_pipe, to the executor associated with the handler
+            if (!m_state)
+                detail::deliver(
+                    m_executor, false, std::move(h), error_code(boost::asio::error::bad_descriptor));
+            else if (w == wait_read)
+            {
+                auto state = m_state;
+                state->readable.async_wait(
+                    std::move(h), m_executor, [state]() { return state->read_ready(); });
+            }
+            else
+                m_server->socket.async_wait(w, std::move(h));
+
+            return init.result.get();
+        }
+
+        // Complete pending asynchronous waits with operation_aborted
+        error_code cancel(error_code& ec)
+        {
+            if (!m_state) return ec = boost::asio::error::bad_descriptor;
+            m_state->readable.cancel();
+            return ec = {};
+        }
+
+        // The server stops routing datagrams of the peer, a new hello is handled as a new peer
+        error_code close(error_code& ec)
+        {
+            if (!m_state) return ec = {};
+
+            {
+                std::lock_guard<std::mutex> lock(m_state->mutex);
+                m_state->closed = true;
+            }
+            m_state->readable.cancel();
+            m_state.reset();
+            --m_server->open_peers;
+            m_server.reset();
+            return ec = {};
+        }
+
+    private:
+        friend struct impl;
+
+        void attach(std::shared_ptr<impl> server,
+                    endpoint_type const& remote,
+                    std::shared_ptr<detail::dtls_peer_state> state)
+        {
+            error_code ec;
+            close(ec);
+            m_server = std::move(server);
+            m_remote = remote;
+            m_state = std::move(state);
+        }
+
+        executor_type m_executor;
+        std::shared_ptr<impl> m_server;
+        std::shared_ptr<detail::dtls_peer_state> m_state;
+        endpoint_type m_remote;
+        bool m_non_blocking = false;
+    };
+
+    using stream_type = datagram_stream<peer_socket>;
+
+    static constexpr std::size_t batch_size = 32;
+    static constexpr std::size_t max_datagram_size = 2048; // larger datagrams are dropped
+    static constexpr std::size_t max_queued_datagrams = 64; // per peer, then dropped
+    static constexpr std::size_t max_backlog = 64; // verified peers waiting for an accept
+
+    // The socket must be open and bound, it is put in non-blocking mode
+    explicit dtls_server(socket_type socket)
+        : m_impl(std::make_shared<impl>(std::move(socket)))
+    {}
+
+    dtls_server(dtls_server&& other) = default;
+    dtls_server(dtls_server const&) = delete;
+
+    ~dtls_server()
+    {
+        if (m_impl)
+        {
+            error_code ec;
+            m_impl->close(ec);
+        }
+    }
+
+    executor_type get_executor() { return m_impl->socket.get_executor(); }
+    socket_type& socket() { return m_impl->socket; }
+    endpoint_type local_endpoint() const { return m_impl->socket.local_endpoint(); }
+
+    // Number of accepted peers which are still open, may be called from any thread
+    std::size_t peer_count() const { return m_impl->open_peers.load(std::memory_order_relaxed); }
+
+    // Accept the next peer which passed the cookie exchange into peer, whose context must be
+    // a server one. The handshake is then done by calling async_handshake() on peer. The
+    // synchronous operations of peer may be used instead while the io_context of the server
+    // runs on another thread, which routes the datagrams; the handshake then keeps to the
+    // DTLS timeouts.
+    template <typename AcceptHandler>
+    BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(AcceptHandler, void(error_code))
+    async_accept(stream_type& peer, AcceptHandler&& handler)
+    {
+        return boost::asio::async_initiate<AcceptHandler, void(error_code)>(
+            initiate_async_accept{this}, handler, &peer);
+    }
+
+#ifndef BOOST_NO_EXCEPTIONS
+    void close()
+    {
+        error_code ec;
+        close(ec);
+        if (ec) boost::throw_exception(boost::system::system_error(ec));
+    }
+#endif
+
+    // A pending accept fails with operation_aborted, and sends of accepted peers fail
+    error_code close(error_code& ec) { return m_impl->close(ec); }
+
+private:
+    class initiate_async_accept
+    {
+    public:
+        executor_type get_executor() const { return self->get_executor(); }
+
+        template <typename AcceptHandler>
+        void operator()(AcceptHandler&& handler, stream_type* peer) const
+        {
+            // If you get an error on the following line it means that your handler does
+            // not meet the documented type requirements for an AcceptHandler.
+            BOOST_ASIO_ACCEPT_HANDLER_CHECK(AcceptHandler, handler) type_check;
+
+            auto& im = self->m_impl;
+            error_code ec;
+            if (im->accept_handler)
+                ec = boost::asio::error::already_started;
+            else if (!im->socket.is_open())
+                ec = boost::asio::error::bad_descriptor;
+            if (ec)
+                return detail::deliver(
+                    self->get_executor(), false, std::forward<AcceptHandler>(handler), ec);
+
+            im->accept_peer = peer;
+            im->accept_handler.emplace(std::forward<AcceptHandler>(handler), self->get_executor());
+            if (!im->backlog.empty()) im->accept_next();
+            im->start();
+        }
+
+        dtls_server* self;
+    };
+
+    struct impl : public std::enable_shared_from_this<impl>
+    {
+        explicit impl(socket_type s)
+            : socket(std::move(s))
+            , descriptor(socket.native_handle())
+            , batch(batch_size * max_datagram_size)
+        {
+            socket.non_blocking(true);
+
+            int ret = gnutls_key_generate(&cookie_key, GNUTLS_COOKIE_KEY_SIZE);
+            if (ret != GNUTLS_E_SUCCESS)
+                throw std::runtime_error("gnutls_key_generate failed: " +
+                                         std::string(gnutls_strerror(ret)));
+        }
+
+        impl(impl const&) = delete;
+        ~impl() { gnutls_free(cookie_key.data); }
+
+        error_code close(error_code& ec)
+        {
+            descriptor = boost::asio::detail::invalid_socket;
+            socket.close(ec);
+            accept_peer = nullptr;
+            if (accept_handler)
+                accept_handler.complete(socket.get_executor(),
+                                        false,
+                                        error_code(boost::asio::error::operation_aborted));
+            return ec;
+        }
+
+        // Start reading once an accept is pending, then keep routing datagrams until closed
+        void start()
+        {
+            if (std::exchange(is_reading, true)) return;
+            socket.async_wait(socket_type::wait_read,
+                              std::bind(&impl::handle_read,
+                                        this->shared_from_this(),
+                                        std::placeholders::_1));
+        }
+
+        void handle_read(error_code const& ec)
+        {
+            is_reading = false;
+            if (ec || !socket.is_open()) return;
+
+            receive_batch();
+            start();
+        }
+
+#ifdef BOOST_ASIO_GNUTLS_HAS_RECVMMSG
+        void receive_batch()
+        {
+            mmsghdr messages[batch_size];
+            iovec iovecs[batch_size];
+            sockaddr_storage addresses[batch_size];
+            std::memset(messages, 0, sizeof(messages));
+            for (std::size_t i = 0; i < batch_size; ++i)
+            {
+                iovecs[i].iov_base = batch.data() + i * max_datagram_size;
+                iovecs[i].iov_len = max_datagram_size;
+                messages[i].msg_hdr.msg_iov = &iovecs[i];
+                messages[i].msg_hdr.msg_iovlen = 1;
+                messages[i].msg_hdr.msg_name = &addresses[i];
+                messages[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+            }
+
+            int const count =
+                ::recvmmsg(socket.native_handle(), messages, batch_size, MSG_DONTWAIT, nullptr);
+            for (int i = 0; i < count && socket.is_open(); ++i)
+            {
+                auto const& header = messages[i].msg_hdr;
+                if (header.msg_flags & MSG_TRUNC) continue;
+                if (header.msg_namelen > endpoint_type().capacity()) continue;
+
+                endpoint_type sender;
+                std::memcpy(sender.data(), header.msg_name, header.msg_namelen);
+                sender.resize(header.msg_namelen);
+                route(sender, static_cast<char*>(iovecs[i].iov_base), messages[i].msg_len);
+            }
+        }
+#else
+        void receive_batch()
+        {
+            for (std::size_t i = 0; i < batch_size && socket.is_open(); ++i)
+            {
+                endpoint_type sender;
+                error_code ec;
+                std::size_t const size =
+                    socket.receive_from(boost::asio::buffer(batch), sender, 0, ec);
+                if (ec == boost::asio::error::would_block || ec == boost::asio::error::try_again)
+                    break;
+                if (ec || size > max_datagram_size) continue;
+                route(sender, batch.data(), size);
+            }
+        }
+#endif
+
+        void route(endpoint_type sender, char* data, std::size_t size)
+        {
+            auto it = peers.find(sender);
+            if (it != peers.end())
+            {
+                auto peer = it->second.lock();
+                if (peer && deliver(*peer, data, size)) return;
+                peers.erase(it);
+            }
+
+            // Unknown peer, the cookie exchange is stateless
+            gnutls_dtls_prestate_st prestate;
+            std::memset(&prestate, 0, sizeof(prestate));
+            int ret = gnutls_dtls_cookie_verify(
+                &cookie_key, sender.data(), sender.size(), data, size, &prestate);
+            if (ret < 0)
+            {
+                // Only answer handshake records, so that the server does not reflect garbage
+                if (size > 0 && data[0] == 22)
+                {
+                    cookie_transport transport{this, &sender};
+                    gnutls_dtls_cookie_send(&cookie_key,
+                                            sender.data(),
+                                            sender.size(),
+                                            &prestate,
+                                            &transport,
+                                            cookie_push_func);
+                }
+                return;
+            }
+
+            // Verified peers wait in the backlog for an accept, a retransmitted hello replaces
+            // the previous one
+            auto pending = std::find_if(backlog.begin(),
+                                        backlog.end(),
+                                        [&sender](verified_peer const& p) {
+                                            return p.endpoint == sender;
+                                        });
+            if (pending == backlog.end())
+            {
+                if (backlog.size() >= max_backlog) return;
+                pending = backlog.emplace(backlog.end());
+                pending->endpoint = sender;
+            }
+            pending->prestate = prestate;
+            pending->hello.assign(data, data + size);
+
+            if (accept_handler) accept_next();
+        }
+
+        void accept_next()
+        {
+            verified_peer verified = std::move(backlog.front());
+            backlog.pop_front();
+
+            auto peer = std::make_shared<detail::dtls_peer_state>();
+            peer->datagrams.push_back(std::move(verified.hello));
+            if (peers.size() >= sweep_threshold) sweep();
+            peers.emplace(verified.endpoint, peer);
+
+            stream_type& stream = *std::exchange(accept_peer, nullptr);
+            stream.next_layer().attach(
+                this->shared_from_this(), verified.endpoint, std::move(peer));
+            ++open_peers;
+            gnutls_dtls_prestate_set(stream.native_handle(), &verified.prestate);
+            accept_handler.complete(socket.get_executor(), false, error_code());
+        }
+
+        // Returns false if the peer is closed
+        bool deliver(detail::dtls_peer_state& peer, char const* data, std::size_t size)
+        {
+            {
+                std::lock_guard<std::mutex> lock(peer.mutex);
+                if (peer.closed) return false;
+                if (peer.datagrams.size() >= max_queued_datagrams) return true;
+                peer.datagrams.emplace_back(data, data + size);
+            }
+            peer.readable.notify();
+            return true;
+        }
+
+        // Forget closed peers, the threshold grows with the number of live ones. Only called from
+        // the read loop, which owns the map of peers.
+        void sweep()
+        {
+            for (auto it = peers.begin(); it != peers.end();)
+            {
+                auto peer = it->second.lock();
+                bool closed = !peer;
+                if (peer)
+                {
+                    std::lock_guard<std::mutex> lock(peer->mutex);
+                    closed = peer->closed;
+                }
+                it = closed ? peers.erase(it) : std::next(it);
+            }
+            std::size_t const threshold = 2 * peers.size();
+            sweep_threshold = threshold > min_sweep_threshold ? threshold : min_sweep_threshold;
+        }
+
+        struct verified_peer
+        {
+            endpoint_type endpoint;
+            gnutls_dtls_prestate_st prestate;
+            std::vector<char> hello;
+        };
+
+        struct cookie_transport
+        {
+            impl* self;
+            endpoint_type const* peer;
+        };
+
+        static ssize_t cookie_push_func(gnutls_transport_ptr_t ptr, const void* data, size_t len)
+        {
+            auto* transport = static_cast<cookie_transport*>(ptr);
+            error_code ec;
+            std::size_t const sent = transport->self->socket.send_to(
+                boost::asio::buffer(data, len), *transport->peer, 0, ec);
+            return ec ? -1 : ssize_t(sent);
+        }
+
+        static constexpr std::size_t min_sweep_threshold = 64;
+
+        socket_type socket;
+        // Of the socket, used by the peers to send, invalid once closed
+        std::atomic<boost::asio::detail::socket_type> descriptor;
+        gnutls_datum_t cookie_key = {nullptr, 0};
+        std::vector<char> batch; // batch_size slots of max_datagram_size bytes
+        bool is_reading = false;
+
+        std::unordered_map<endpoint_type,
+                           std::weak_ptr<detail::dtls_peer_state>,
+                           detail::udp_endpoint_hash>
+            peers;
+        std::size_t sweep_threshold = min_sweep_threshold;
+        std::atomic<std::size_t> open_peers{0}; // accepted and not closed yet
+
+        std::deque<verified_peer> backlog;
+        stream_type* accept_peer = nullptr;
+        detail::handler_slot<executor_type, error_code const&> accept_handler;
+    };
+
+    std::shared_ptr<impl> m_impl;
+};
+
+} // namespace gnutls
+} // namespace asio
+} // namespace boost
+
+#endif
@@ -0,0 +1,324 @@
+//
+// gnutls/engine.hpp
+// ~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2020 Paul-Louis Ageneau (paul-louis at ageneau dot org)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef BOOST_ASIO_GNUTLS_ENGINE_HPP
+#define BOOST_ASIO_GNUTLS_ENGINE_HPP
+
+#include "context.hpp"
+#include "error.hpp"
+#include "probes.hpp"
+#include "session.hpp"
+#include "stream_base.hpp"
+
+#include <boost/asio/buffer.hpp>
+
+#ifndef BOOST_NO_EXCEPTIONS
+#include <boost/system/system_error.hpp>
+#include <boost/throw_exception.hpp>
+#endif
+
+#include <gnutls/gnutls.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace boost {
+namespace asio {
+namespace gnutls {
+
+// TLS session without any I/O object, like boost::asio::ssl::detail::engine: received
+// ciphertext is fed with put_input(), ciphertext to send is taken with get_output() or
+// output()/consume_output(), and each operation returns what the caller must do next. This
+// allows driving many sessions from a custom event loop or batching their transport calls.
+//
+// Handshakes and transferred bytes are counted in the context metrics, but handshake tracing
+// and probes of operations are only available on stream.
+class engine : public stream_base
+{
+public:
+    enum want
+    {
+        want_input_and_retry = -2,  // call put_input() with more ciphertext, then retry
+        want_output_and_retry = -1, // send the pending output, then retry
+        want_nothing = 0,           // the operation is complete
+        want_output = 1             // the operation is complete, send the pending output
+    };
+
+    // Maximum amount of ciphertext buffered by put_input()
+    static constexpr std::size_t max_input_size = 64 * 1024;
+
+    explicit engine(context& ctx)
+        : stream_base(ctx)
+    {
+        make_session(m_context_impl->is_server() ? server : client);
+    }
+
+    engine(engine&& other)
+        : stream_base(std::move(other))
+        , m_session(std::move(other.m_session))
+        , m_input(std::move(other.m_input))
+        , m_input_pos(std::exchange(other.m_input_pos, 0))
+        , m_input_eof(other.m_input_eof)
+        , m_output(std::move(other.m_output))
+        , m_output_pos(std::exchange(other.m_output_pos, 0))
+        , m_handshake_start(other.m_handshake_start)
+    {
+        if (m_session) m_session->owner = this;
+    }
+
+    engine(engine const& other) = delete;
+
+    native_handle_type native_handle() { return m_session->session; }
+
+#ifndef BOOST_NO_EXCEPTIONS
+    void set_host_name(std::string const& name)
+    {
+        error_code ec;
+        set_host_name(name, ec);
+        if (ec) boost::throw_exception(boost::system::system_error(ec));
+    }
+#endif
+
+    error_code set_host_name(std::string const& name, error_code& ec)
+    {
+        int ret = gnutls_server_name_set(
+            m_session->session, GNUTLS_NAME_DNS, name.c_str(), name.size());
+        return ec = ret == GNUTLS_E_SUCCESS ? error_code()
+                                            : error_code(ret, error::get_ssl_category());
+    }
+
+    want handshake(handshake_type type, error_code& ec)
+    {
+        if (m_session->type != type) make_session(type);
+
+        auto& metrics = m_context_impl->metrics;
+        if (m_handshake_start == clock::time_point())
+        {
+            m_handshake_start = clock::now();
+            metrics.handshake_started();
+        }
+
+        gnutls_session_t session = m_session->session;
+        want w = perform([session]() { return gnutls_handshake(session); }, ec, nullptr);
+        if (w == want_input_and_retry || w == want_output_and_retry) return w;
+
+        auto const start = std::exchange(m_handshake_start, clock::time_point());
+        bool const resumed = !ec && gnutls_session_is_resumed(session) != 0;
+        metrics.handshake_finished(ec, resumed, clock::now() - start);
+        return w;
+    }
+
+    want shutdown(error_code& ec)
+    {
+        gnutls_session_t session = m_session->session;
+        auto op = [session]() { return gnutls_bye(session, GNUTLS_SHUT_RDWR); };
+        return perform(op, ec, nullptr);
+    }
+
+    want write(const_buffer const& data, error_code& ec, std::size_t& bytes_transferred)
+    {
+        bytes_transferred = 0;
+        if (data.size() == 0)
+        {
+            ec.clear();
+            return want_nothing;
+        }
+
+        gnutls_session_t session = m_session->session;
+        want w = perform(
+            [session, &data]() { return gnutls_record_send(session, data.data(), data.size()); },
+            ec,
+            &bytes_transferred);
+        if (bytes_transferred > 0) m_context_impl->metrics.bytes_written(bytes_transferred);
+        return w;
+    }
+
+    // Fails with eof once the peer has closed the session with close_notify. A request of the
+    // peer to renegotiate fails with GNUTLS_E_REHANDSHAKE, call handshake() to accept it.
+    want read(mutable_buffer const& data, error_code& ec, std::size_t& bytes_transferred)
+    {
+        bytes_transferred = 0;
+        if (data.size() == 0)
+        {
+            ec.clear();
+            return want_nothing;
+        }
+
+        gnutls_session_t session = m_session->session;
+        want w = perform(
+            [session, &data]() { return gnutls_record_recv(session, data.data(), data.size()); },
+            ec,
+            &bytes_transferred);
+        if (!ec && bytes_transferred == 0 && w != want_input_and_retry &&
+            w != want_output_and_retry)
+            ec = boost::asio::error::eof;
+        if (bytes_transferred > 0) m_context_impl->metrics.bytes_read(bytes_transferred);
+        return w;
+    }
+
+    // Copy pending output into data, returns the part of data which was filled
+    mutable_buffer get_output(mutable_buffer const& data)
+    {
+        const_buffer pending = output();
+        std::size_t const length = std::min(data.size(), pending.size());
+        if (length > 0) std::memcpy(data.data(), pending.data(), length);
+        consume_output(length);
+        return mutable_buffer(data.data(), length);
+    }
+
+    // Pending output, valid until the next call to a non-const member function
+    const_buffer output() const
+    {
+        return const_buffer(m_output.data() + m_output_pos, m_output.size() - m_output_pos);
+    }
+
+    void consume_output(std::size_t length)
+    {
+        m_output_pos += std::min(length, m_output.size() - m_output_pos);
+        if (m_output_pos == m_output.size())
+        {
+            m_output.clear();
+            m_output_pos = 0;
+        }
+    }
+
+    // Buffer received ciphertext, returns the part of data which did not fit
+    const_buffer put_input(const_buffer const& data)
+    {
+        if (m_input_pos > 0)
+        {
+            m_input.erase(m_input.begin(), m_input.begin() + m_input_pos);
+            m_input_pos = 0;
+        }
+
+        std::size_t const room =
+            m_input.size() < max_input_size ? max_input_size - m_input.size() : 0;
+        std::size_t const length = std::min(data.size(), room);
+        auto const* begin = static_cast<char const*>(data.data());
+        m_input.insert(m_input.end(), begin, begin + length);
+        return data + length;
+    }
+
+    // Signal that the transport was closed, once the buffered input is consumed operations
+    // fail with stream_truncated, or eof for read() if close_notify was received
+    void put_eof() { m_input_eof = true; }
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    void make_session(handshake_type type)
+    {
+        auto session = std::make_unique<detail::tls_session>(this, type);
+        gnutls_transport_set_ptr(session->session, session.get());
+        gnutls_transport_set_push_function(session->session, push_func);
+        gnutls_transport_set_pull_function(session->session, pull_func);
+        m_session = std::move(session);
+    }
+
+    // Run a GnuTLS function until it completes or needs more input, and tell the caller what
+    // to do next from the pending output
+    template <typename Operation>
+    want perform(Operation op, error_code& ec, std::size_t* bytes_transferred)
+    {
+        int ret;
+        do {
+            ret = op();
+        } while (ret < 0 && ret != GNUTLS_E_AGAIN && ret != GNUTLS_E_REHANDSHAKE &&
+                 !gnutls_error_is_fatal(ret));
+
+        bool const has_output = m_output.size() > m_output_pos;
+        if (ret == GNUTLS_E_AGAIN)
+        {
+            ec.clear();
+            return has_output ? want_output_and_retry : want_input_and_retry;
+        }
+
+        if (ret == GNUTLS_E_PREMATURE_TERMINATION)
+            ec = error::stream_truncated;
+        else if (ret < 0)
+            ec = error_code(ret, error::get_ssl_category());
+        else
+        {
+            ec.clear();
+            if (bytes_transferred) *bytes_transferred = std::size_t(ret);
+        }
+
+        return has_output ? want_output : want_nothing;
+    }
+
+    static ssize_t pull_func(void* ptr, void* data, std::size_t size)
+    {
+        auto* s = static_cast<detail::tls_session*>(ptr);
+        auto* e = static_cast<engine*>(s->owner);
+        if (!e)
+        {
+            gnutls_transport_set_errno(s->session, ECONNRESET);
+            return -1;
+        }
+
+        std::size_t const available = e->m_input.size() - e->m_input_pos;
+        if (available == 0 && !e->m_input_eof)
+        {
+            BOOST_ASIO_GNUTLS_PROBE4(pull, s->session, size, -1, EAGAIN);
+            gnutls_transport_set_errno(s->session, EAGAIN);
+            return -1;
+        }
+
+        std::size_t const length = std::min(size, available);
+        if (length > 0) std::memcpy(data, e->m_input.data() + e->m_input_pos, length);
+        e->m_input_pos += length;
+
+        BOOST_ASIO_GNUTLS_PROBE4(pull, s->session, size, length, 0);
+        gnutls_transport_set_errno(s->session, 0);
+        return ssize_t(length);
+    }
+
+    static ssize_t push_func(void* ptr, const void* data, std::size_t len)
+    {
+        auto* s = static_cast<detail::tls_session*>(ptr);
+        auto* e = static_cast<engine*>(s->owner);
+        if (!e)
+        {
+            gnutls_transport_set_errno(s->session, ECONNRESET);
+            return -1;
+        }
+
+        auto const* begin = static_cast<char const*>(data);
+        e->m_output.insert(e->m_output.end(), begin, begin + len);
+
+        BOOST_ASIO_GNUTLS_PROBE4(push, s->session, len, len, 0);
+        gnutls_transport_set_errno(s->session, 0);
+        return ssize_t(len);
+    }
+
+    std::unique_ptr<detail::tls_session> m_session;
+
+    std::vector<char> m_input;
+    std::size_t m_input_pos = 0;
+    bool m_input_eof = false;
+
+    std::vector<char> m_output;
+    std::size_t m_output_pos = 0;
+
+    clock::time_point m_handshake_start; // epoch if no handshake is in progress
+};
+
+} // namespace gnutls
+} // namespace asio
+} // namespace boost
+
+#endif
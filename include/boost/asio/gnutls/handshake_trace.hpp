@@ -0,0 +1,64 @@
+//
+// gnutls/handshake_trace.hpp
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2020 Paul-Louis Ageneau (paul-louis at ageneau dot org)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef BOOST_ASIO_GNUTLS_HANDSHAKE_TRACE_HPP
+#define BOOST_ASIO_GNUTLS_HANDSHAKE_TRACE_HPP
+
+#include <boost/system/error_code.hpp>
+
+#include <gnutls/gnutls.h>
+
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+namespace boost {
+namespace asio {
+namespace gnutls {
+
+// Timeline of a handshake, recorded when tracing is enabled on the stream
+struct handshake_trace
+{
+    using clock = std::chrono::steady_clock;
+
+    // A handshake message seen by GnuTLS. For an incoming message, the pre event is recorded
+    // before it is parsed and the post event after it has been processed. For an outgoing
+    // message, the events surround its generation. The difference between the two is the time
+    // spent on the message itself, signatures and key exchange included.
+    struct event
+    {
+        gnutls_handshake_description_t message;
+        bool incoming;
+        bool post;
+        clock::duration offset; // since the start of the handshake
+
+        char const* name() const { return gnutls_handshake_description_get_name(message); }
+    };
+
+    clock::time_point start;
+    clock::duration total{};      // from start to completion
+    clock::duration processing{}; // time spent in GnuTLS, excluding transport calls
+    std::size_t read_waits = 0;   // times the handshake had to wait for incoming data
+    std::size_t write_waits = 0;  // times the handshake had to wait to send data
+    boost::system::error_code result;
+
+    // Messages of the handshake only, post-handshake messages like TLS 1.3 session tickets are
+    // not recorded
+    std::vector<event> events;
+
+    // Time spent waiting on the peer and on the network
+    clock::duration waiting() const { return total - processing; }
+};
+
+} // namespace gnutls
+} // namespace asio
+} // namespace boost
+
+#endif
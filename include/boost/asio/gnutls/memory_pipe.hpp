@@ -0,0 +1,631 @@
+//
+// gnutls/memory_pipe.hpp
+// ~~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2020 Paul-Louis Ageneau (paul-louis at ageneau dot org)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef BOOST_ASIO_GNUTLS_MEMORY_PIPE_HPP
+#define BOOST_ASIO_GNUTLS_MEMORY_PIPE_HPP
+
+#include "detail/handler_slot.hpp"
+
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/socket_base.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/system/system_error.hpp>
+#include <boost/throw_exception.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace boost {
+namespace asio {
+namespace gnutls {
+
+namespace detail {
+
+// Fixed-capacity byte ring with a single producer and a single consumer. Positions only grow,
+// the capacity is a power of two so they wrap with a mask.
+class spsc_byte_ring
+{
+public:
+    explicit spsc_byte_ring(std::size_t capacity)
+        : m_capacity(round_up(capacity))
+        , m_data(new char[m_capacity])
+    {}
+
+    spsc_byte_ring(spsc_byte_ring const&) = delete;
+    spsc_byte_ring& operator=(spsc_byte_ring const&) = delete;
+
+    // Consumer side
+    std::size_t readable() const
+    {
+        return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_relaxed);
+    }
+
+    // Producer side
+    std::size_t writable() const
+    {
+        return m_capacity -
+               (m_tail.load(std::memory_order_relaxed) - m_head.load(std::memory_order_acquire));
+    }
+
+    template <typename MutableBufferSequence> std::size_t read(const MutableBufferSequence& buffers)
+    {
+        std::size_t head = m_head.load(std::memory_order_relaxed);
+        std::size_t available = m_tail.load(std::memory_order_acquire) - head;
+        std::size_t total = 0;
+        for (auto b = buffer_sequence_begin(buffers), end(buffer_sequence_end(buffers));
+             b != end && available > 0;
+             ++b)
+        {
+            mutable_buffer r = *b;
+            std::size_t const n = std::min(r.size(), available);
+            std::size_t const offset = head & (m_capacity - 1);
+            std::size_t const first = std::min(n, m_capacity - offset);
+            std::memcpy(r.data(), m_data.get() + offset, first);
+            std::memcpy(static_cast<char*>(r.data()) + first, m_data.get(), n - first);
+            head += n;
+            available -= n;
+            total += n;
+        }
+        m_head.store(head, std::memory_order_release);
+        return total;
+    }
+
+    template <typename ConstBufferSequence> std::size_t write(const ConstBufferSequence& buffers)
+    {
+        std::size_t tail = m_tail.load(std::memory_order_relaxed);
+        std::size_t space = m_capacity - (tail - m_head.load(std::memory_order_acquire));
+        std::size_t total = 0;
+        for (auto b = buffer_sequence_begin(buffers), end(buffer_sequence_end(buffers));
+             b != end && space > 0;
+             ++b)
+        {
+            const_buffer r = *b;
+            std::size_t const n = std::min(r.size(), space);
+            std::size_t const offset = tail & (m_capacity - 1);
+            std::size_t const first = std::min(n, m_capacity - offset);
+            std::memcpy(m_data.get() + offset, r.data(), first);
+            std::memcpy(m_data.get(), static_cast<char const*>(r.data()) + first, n - first);
+            tail += n;
+            space -= n;
+            total += n;
+        }
+        m_tail.store(tail, std::memory_order_release);
+        return total;
+    }
+
+private:
+    static std::size_t round_up(std::size_t capacity)
+    {
+        std::size_t c = 1;
+        while (c < capacity)
+            c <<= 1;
+        return c;
+    }
+
+    std::size_t const m_capacity;
+    std::unique_ptr<char[]> m_data;
+
+    // Keep the consumer and producer positions on separate cache lines
+    alignas(64) std::atomic<std::size_t> m_head{0};
+    alignas(64) std::atomic<std::size_t> m_tail{0};
+};
+
+// Readiness notification between the two ends of a pipe. The side changing the state only
+// takes the mutex when someone is waiting, which it learns from the armed flag. Like a wait on a
+// socket, a pending asynchronous wait keeps the I/O executor busy, and it completes like the
+// operations of a stream, posted to the executor associated with its handler.
+template <typename Executor> class memory_pipe_event
+{
+public:
+    // Must be called after the state has changed
+    void notify(boost::system::error_code const& ec = {})
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!m_armed.load(std::memory_order_relaxed)) return;
+
+        std::vector<pending_wait> waits;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_armed.store(false, std::memory_order_relaxed);
+            waits.swap(m_waits);
+            m_cv.notify_all();
+        }
+        for (auto& w : waits)
+            w.handler.complete(w.io_executor, false, ec);
+
+        // Give the storage back so that the next wait does not allocate
+        waits.clear();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_waits.empty()) m_waits.swap(waits);
+    }
+
+    template <typename Handler, typename Predicate>
+    void async_wait(Handler&& handler, Executor const& io_ex, Predicate ready)
+    {
+        pending_wait w(io_ex);
+        w.handler.emplace(std::forward<Handler>(handler), io_ex);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_waits.push_back(std::move(w));
+            m_armed.store(true, std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (ready()) notify();
+    }
+
+    template <typename Predicate> void wait(Predicate ready)
+    {
+        while (!ready())
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_armed.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (ready()) break;
+            m_cv.wait(lock);
+        }
+    }
+
+    // Returns false if the deadline passed before ready() became true
+    template <typename Predicate>
+    bool wait_until(std::chrono::steady_clock::time_point deadline, Predicate ready)
+    {
+        while (!ready())
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_armed.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (ready()) break;
+            if (m_cv.wait_until(lock, deadline) == std::cv_status::timeout) return ready();
+        }
+        return true;
+    }
+
+    void cancel()
+    {
+        std::vector<pending_wait> waits;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            waits.swap(m_waits);
+        }
+        for (auto& w : waits)
+            w.handler.complete(w.io_executor, false, boost::asio::error::operation_aborted);
+    }
+
+private:
+    struct pending_wait
+    {
+        explicit pending_wait(Executor const& ex)
+            : io_executor(ex)
+            , io_work(work_traits<Executor>::make(ex))
+        {}
+
+        Executor io_executor;
+        typename work_traits<Executor>::type io_work;
+        handler_slot<Executor, boost::system::error_code const&> handler;
+    };
+
+    std::atomic<bool> m_armed{false};
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::vector<pending_wait> m_waits;
+};
+
+// Data flowing from one end of a pipe to the other
+struct memory_pipe_channel
+{
+    explicit memory_pipe_channel(std::size_t capacity)
+        : ring(capacity)
+    {}
+
+    bool read_ready() const
+    {
+        return ring.readable() > 0 || write_closed.load(std::memory_order_acquire) ||
+               read_closed.load(std::memory_order_acquire);
+    }
+
+    bool write_ready() const
+    {
+        return ring.writable() > 0 || write_closed.load(std::memory_order_acquire) ||
+               read_closed.load(std::memory_order_acquire);
+    }
+
+    spsc_byte_ring ring;
+    std::atomic<bool> write_closed{false}; // the writer is done, reads return eof once drained
+    std::atomic<bool> read_closed{false};  // the reader is gone, writes fail
+    memory_pipe_event<io_context::executor_type> readable; // signalled by the writer
+    memory_pipe_event<io_context::executor_type> writable; // signalled by the reader
+};
+
+struct memory_pipe_state
+{
+    explicit memory_pipe_state(std::size_t capacity)
+        : first(capacity)
+        , second(capacity)
+    {}
+
+    memory_pipe_channel first;  // written by the first end
+    memory_pipe_channel second; // written by the second end
+};
+
+} // namespace detail
+
+// In-memory duplex transport, usable as the next layer of a stream.
+// The two ends of a pipe are created with connect_pair() and exchange bytes through lock-free
+// ring buffers, with no system call on the data path. Each end supports one reading and one
+// writing thread at a time, like a socket used without a strand.
+class memory_pipe : public socket_base
+{
+public:
+    using error_code = boost::system::error_code;
+    using executor_type = io_context::executor_type;
+    using lowest_layer_type = memory_pipe;
+
+    static constexpr std::size_t default_capacity = 256 * 1024;
+
+    explicit memory_pipe(io_context& ioc)
+        : m_executor(ioc.get_executor())
+    {}
+
+    explicit memory_pipe(executor_type const& ex)
+        : m_executor(ex)
+    {}
+
+    memory_pipe(memory_pipe&& other) noexcept
+        : m_executor(other.m_executor)
+        , m_state(std::move(other.m_state))
+        , m_first(other.m_first)
+        , m_non_blocking(other.m_non_blocking)
+    {}
+
+    memory_pipe& operator=(memory_pipe&& other) noexcept
+    {
+        if (this != &other)
+        {
+            error_code ec;
+            close(ec);
+            m_executor = other.m_executor;
+            m_state = std::move(other.m_state);
+            m_first = other.m_first;
+            m_non_blocking = other.m_non_blocking;
+        }
+        return *this;
+    }
+
+    memory_pipe(memory_pipe const&) = delete;
+    memory_pipe& operator=(memory_pipe const&) = delete;
+
+    ~memory_pipe()
+    {
+        error_code ec;
+        close(ec);
+    }
+
+    executor_type get_executor() { return m_executor; }
+    io_context& get_io_context() { return m_executor.context(); }
+    const lowest_layer_type& lowest_layer() const { return *this; }
+    lowest_layer_type& lowest_layer() { return *this; }
+
+    bool is_open() const { return bool(m_state); }
+
+#ifndef BOOST_NO_EXCEPTIONS
+    void non_blocking(bool mode)
+    {
+        error_code ec;
+        non_blocking(mode, ec);
+        if (ec) boost::throw_exception(boost::system::system_error(ec));
+    }
+#endif
+
+    error_code non_blocking(bool mode, error_code& ec)
+    {
+        m_non_blocking = mode;
+        return ec = {};
+    }
+
+    bool non_blocking() const { return m_non_blocking; }
+
+#ifndef BOOST_NO_EXCEPTIONS
+    template <typename MutableBufferSequence>
+    std::size_t read_some(const MutableBufferSequence& buffers)
+    {
+        error_code ec;
+        std::size_t bytes_read = read_some(buffers, ec);
+        if (ec) boost::throw_exception(boost::system::system_error(ec));
+        return bytes_read;
+    }
+#endif
+
+    template <typename MutableBufferSequence>
+    std::size_t read_some(const MutableBufferSequence& buffers, error_code& ec)
+    {
+        if (!m_state)
+        {
+            ec = boost::asio::error::bad_descriptor;
+            return 0;
+        }
+
+        auto& channel = receive_channel();
+        if (buffer_size(buffers) == 0)
+        {
+            ec = {};
+            return 0;
+        }
+
+        for (;;)
+        {
+            // Check the flags before reading so that data written before closing is not lost
+            bool const closed = channel.write_closed.load(std::memory_order_acquire) ||
+                                channel.read_closed.load(std::memory_order_acquire);
+
+            std::size_t const bytes_read = channel.ring.read(buffers);
+            if (bytes_read > 0)
+            {
+                channel.writable.notify();
+                ec = {};
+                return bytes_read;
+            }
+
+            if (closed)
+            {
+                ec = boost::asio::error::eof;
+                return 0;
+            }
+
+            if (m_non_blocking)
+            {
+                ec = boost::asio::error::would_block;
+                return 0;
+            }
+
+            channel.readable.wait([&channel]() { return channel.read_ready(); });
+        }
+    }
+
+#ifndef BOOST_NO_EXCEPTIONS
+    template <typename ConstBufferSequence>
+    std::size_t write_some(const ConstBufferSequence& buffers)
+    {
+        error_code ec;
+        std::size_t bytes_written = write_some(buffers, ec);
+        if (ec) boost::throw_exception(boost::system::system_error(ec));
+        return bytes_written;
+    }
+#endif
+
+    template <typename ConstBufferSequence>
+    std::size_t write_some(const ConstBufferSequence& buffers, error_code& ec)
+    {
+        if (!m_state)
+        {
+            ec = boost::asio::error::bad_descriptor;
+            return 0;
+        }
+
+        auto& channel = send_channel();
+        for (;;)
+        {
+            if (channel.write_closed.load(std::memory_order_acquire) ||
+                channel.read_closed.load(std::memory_order_acquire))
+            {
+                ec = boost::asio::error::broken_pipe;
+                return 0;
+            }
+
+            if (buffer_size(buffers) == 0)
+            {
+                ec = {};
+                return 0;
+            }
+
+            std::size_t const bytes_written = channel.ring.write(buffers);
+            if (bytes_written > 0)
+            {
+                channel.readable.notify();
+                ec = {};
+                return bytes_written;
+            }
+
+            if (m_non_blocking)
+            {
+                ec = boost::asio::error::would_block;
+                return 0;
+            }
+
+            channel.writable.wait([&channel]() { return channel.write_ready(); });
+        }
+    }
+
+#ifndef BOOST_NO_EXCEPTIONS
+    void wait(wait_type w)
+    {
+        error_code ec;
+        wait(w, ec);
+        if (ec) boost::throw_exception(boost::system::system_error(ec));
+    }
+#endif
+
+    error_code wait(wait_type w, error_code& ec)
+    {
+        if (!m_state) return ec = boost::asio::error::bad_descriptor;
+
+        ec = {};
+        switch (w)
+        {
+        case wait_read:
+        {
+            auto& channel = receive_channel();
+            channel.readable.wait([&channel]() { return channel.read_ready(); });
+            break;
+        }
+        case wait_write:
+        {
+            auto& channel = send_channel();
+            channel.writable.wait([&channel]() { return channel.write_ready(); });
+            break;
+        }
+        default:
+            ec = boost::asio::error::operation_not_supported;
+            break;
+        }
+        return ec;
+    }
+
+    template <typename WaitHandler>
+    BOOST_ASIO_INITFN_RESULT_TYPE(WaitHandler, void(error_code))
+    async_wait(wait_type w, WaitHandler&& handler)
+    {
+        boost::asio::async_completion<WaitHandler, void(error_code)> init(handler);
+        auto& h = init.completion_handler;
+
+        if (!m_state)
+            detail::deliver(
+                m_executor, false, std::move(h), error_code(boost::asio::error::bad_descriptor));
+        else if (w == wait_read)
+        {
+            auto& channel = receive_channel();
+            channel.readable.async_wait(
+                std::move(h), m_executor, [&channel]() { return channel.read_ready(); });
+        }
+        else if (w == wait_write)
+        {
+            auto& channel = send_channel();
+            channel.writable.async_wait(
+                std::move(h), m_executor, [&channel]() { return channel.write_ready(); });
+        }
+        else
+            detail::deliver(m_executor,
+                            false,
+                            std::move(h),
+                            error_code(boost::asio::error::operation_not_supported));
+
+        return init.result.get();
+    }
+
+#ifndef BOOST_NO_EXCEPTIONS
+    void shutdown(shutdown_type what)
+    {
+        error_code ec;
+        shutdown(what, ec);
+        if (ec) boost::throw_exception(boost::system::system_error(ec));
+    }
+#endif
+
+    error_code shutdown(shutdown_type what, error_code& ec)
+    {
+        if (!m_state) return ec = boost::asio::error::bad_descriptor;
+
+        if (what == shutdown_send || what == shutdown_both)
+        {
+            auto& channel = send_channel();
+            channel.write_closed.store(true, std::memory_order_release);
+            channel.readable.notify();
+        }
+        if (what == shutdown_receive || what == shutdown_both)
+        {
+            auto& channel = receive_channel();
+            channel.read_closed.store(true, std::memory_order_release);
+            channel.writable.notify();
+            channel.readable.notify();
+        }
+        return ec = {};
+    }
+
+#ifndef BOOST_NO_EXCEPTIONS
+    void cancel()
+    {
+        error_code ec;
+        cancel(ec);
+        if (ec) boost::throw_exception(boost::system::system_error(ec));
+    }
+#endif
+
+    // Complete pending asynchronous waits with operation_aborted
+    error_code cancel(error_code& ec)
+    {
+        if (!m_state) return ec = boost::asio::error::bad_descriptor;
+
+        receive_channel().readable.cancel();
+        send_channel().writable.cancel();
+        return ec = {};
+    }
+
+#ifndef BOOST_NO_EXCEPTIONS
+    void close()
+    {
+        error_code ec;
+        close(ec);
+        if (ec) boost::throw_exception(boost::system::system_error(ec));
+    }
+#endif
+
+    // The peer reads the remaining data then eof, and its writes fail
+    error_code close(error_code& ec)
+    {
+        if (!m_state) return ec = {};
+
+        cancel(ec);
+        shutdown(shutdown_both, ec);
+        m_state.reset();
+        return ec = {};
+    }
+
+private:
+    friend void connect_pair(memory_pipe& first, memory_pipe& second, std::size_t capacity);
+
+    detail::memory_pipe_channel& send_channel()
+    {
+        return m_first ? m_state->first : m_state->second;
+    }
+
+    detail::memory_pipe_channel& receive_channel()
+    {
+        return m_first ? m_state->second : m_state->first;
+    }
+
+    executor_type m_executor;
+    std::shared_ptr<detail::memory_pipe_state> m_state;
+    bool m_first = true;
+    bool m_non_blocking = false;
+};
+
+// Connect two ends, each one buffering up to capacity bytes sent to the other
+inline void connect_pair(memory_pipe& first,
+                         memory_pipe& second,
+                         std::size_t capacity = memory_pipe::default_capacity)
+{
+    boost::system::error_code ec;
+    first.close(ec);
+    second.close(ec);
+
+    auto state = std::make_shared<detail::memory_pipe_state>(capacity);
+    first.m_state = state;
+    first.m_first = true;
+    second.m_state = std::move(state);
+    second.m_first = false;
+}
+
+} // namespace gnutls
+
+} // namespace asio
+} // namespace boost
+
+#endif
@@ -0,0 +1,293 @@
+//
+// gnutls/metrics.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2020 Paul-Louis Ageneau (paul-louis at ageneau dot org)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef BOOST_ASIO_GNUTLS_METRICS_HPP
+#define BOOST_ASIO_GNUTLS_METRICS_HPP
+
+#include <boost/system/error_code.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace boost {
+namespace asio {
+namespace gnutls {
+
+// Log2 histogram of durations in microseconds.
+// Bucket 0 counts durations below 1us, bucket i counts durations in [2^(i-1), 2^i) us,
+// and the last bucket also counts everything above its upper bound.
+struct latency_histogram
+{
+    static constexpr std::size_t bucket_count = 32;
+
+    static std::size_t bucket_index(std::uint64_t us)
+    {
+        std::size_t i = 0;
+        while (us > 0 && i < bucket_count - 1)
+        {
+            us >>= 1;
+            ++i;
+        }
+        return i;
+    }
+
+    // Upper bound (exclusive) of bucket i in microseconds
+    static std::uint64_t bucket_bound(std::size_t i) { return std::uint64_t(1) << i; }
+
+    std::array<std::uint64_t, bucket_count> buckets = {};
+    std::uint64_t count = 0;
+    std::uint64_t sum_us = 0;
+};
+
+// Snapshot of the counters aggregated over all streams of a context
+struct context_metrics
+{
+    std::uint64_t handshakes_started = 0;
+    std::uint64_t handshakes_completed = 0;
+    std::uint64_t handshakes_failed = 0;
+    std::uint64_t handshakes_resumed = 0;
+
+    // Failed handshakes by error code
+    std::map<boost::system::error_code, std::uint64_t> handshake_failures;
+
+    // Application data
+    std::uint64_t bytes_read = 0;
+    std::uint64_t bytes_written = 0;
+
+    latency_histogram handshake_latency;
+};
+
+namespace detail {
+
+// Counters owned by a single thread: the owner is the only writer, so updates are plain
+// relaxed load/store pairs and never contend with other threads. Readers merging the shards
+// only perform relaxed loads. Shards start on a cache line and fill whole ones, so they never
+// share one with a neighbouring allocation (make_shared honours the alignment from C++17 on).
+struct alignas(64) metrics_shard
+{
+    using counter = std::atomic<std::uint64_t>;
+
+    static void add(counter& c, std::uint64_t n)
+    {
+        c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static std::uint64_t get(counter const& c) { return c.load(std::memory_order_relaxed); }
+
+    counter handshakes_started{0};
+    counter handshakes_completed{0};
+    counter handshakes_failed{0};
+    counter handshakes_resumed{0};
+    counter bytes_read{0};
+    counter bytes_written{0};
+
+    std::array<counter, latency_histogram::bucket_count> latency_buckets = {};
+    counter latency_count{0};
+    counter latency_sum_us{0};
+
+    // Failures are off the hot path, the mutex is only contended while merging
+    mutable std::mutex failures_mutex;
+    std::map<boost::system::error_code, std::uint64_t> failures;
+
+    // Add the counters to a snapshot
+    void merge_into(context_metrics& m) const
+    {
+        m.handshakes_started += get(handshakes_started);
+        m.handshakes_completed += get(handshakes_completed);
+        m.handshakes_failed += get(handshakes_failed);
+        m.handshakes_resumed += get(handshakes_resumed);
+        m.bytes_read += get(bytes_read);
+        m.bytes_written += get(bytes_written);
+
+        for (std::size_t i = 0; i < latency_histogram::bucket_count; ++i)
+            m.handshake_latency.buckets[i] += get(latency_buckets[i]);
+        m.handshake_latency.count += get(latency_count);
+        m.handshake_latency.sum_us += get(latency_sum_us);
+
+        std::lock_guard<std::mutex> lock(failures_mutex);
+        for (auto const& f : failures)
+            m.handshake_failures[f.first] += f.second;
+    }
+};
+
+// Shards of a registry, shared with the threads owning one so that a thread exiting after the
+// registry is destroyed finds it gone
+struct metrics_shards
+{
+    std::mutex mutex;
+    std::vector<std::shared_ptr<metrics_shard>> live;
+    context_metrics retired; // counters of the shards of exited threads
+};
+
+// Shards of the calling thread, one per registry it recorded into. When the thread exits, each
+// shard is folded into the retired counters of its registry and removed, so that registries of
+// servers creating threads per task do not grow with every thread.
+class metrics_shard_cache
+{
+public:
+    static metrics_shard_cache& local()
+    {
+        static thread_local metrics_shard_cache cache;
+        return cache;
+    }
+
+    metrics_shard_cache() = default;
+    metrics_shard_cache(metrics_shard_cache const&) = delete;
+    metrics_shard_cache& operator=(metrics_shard_cache const&) = delete;
+
+    ~metrics_shard_cache()
+    {
+        for (auto& e : m_entries)
+            if (auto shards = e.shards.lock()) retire(*shards, e.shard);
+    }
+
+    metrics_shard* find(std::uint64_t id) const
+    {
+        for (auto const& e : m_entries)
+            if (e.id == id) return e.shard.get();
+        return nullptr;
+    }
+
+    // Slow path: first access from this thread, drop shards of destroyed registries
+    metrics_shard& add(std::uint64_t id, std::shared_ptr<metrics_shards> const& shards)
+    {
+        m_entries.erase(std::remove_if(m_entries.begin(),
+                                       m_entries.end(),
+                                       [](entry const& e) { return e.shards.expired(); }),
+                        m_entries.end());
+
+        auto shard = std::make_shared<metrics_shard>();
+        {
+            std::lock_guard<std::mutex> lock(shards->mutex);
+            shards->live.push_back(shard);
+        }
+        m_entries.push_back(entry{id, shards, shard});
+        return *shard;
+    }
+
+private:
+    struct entry
+    {
+        std::uint64_t id;
+        std::weak_ptr<metrics_shards> shards;
+        std::shared_ptr<metrics_shard> shard;
+    };
+
+    static void retire(metrics_shards& shards, std::shared_ptr<metrics_shard> const& shard)
+    {
+        std::lock_guard<std::mutex> lock(shards.mutex);
+        shard->merge_into(shards.retired);
+        shards.live.erase(std::remove(shards.live.begin(), shards.live.end(), shard),
+                          shards.live.end());
+    }
+
+    std::vector<entry> m_entries;
+};
+
+class metrics_registry
+{
+public:
+    metrics_registry()
+        : m_id(next_id())
+        , m_shards(std::make_shared<metrics_shards>())
+    {}
+    metrics_registry(metrics_registry const&) = delete;
+    metrics_registry& operator=(metrics_registry const&) = delete;
+
+    void handshake_started()
+    {
+        auto& shard = local_shard();
+        metrics_shard::add(shard.handshakes_started, 1);
+    }
+
+    void handshake_finished(boost::system::error_code const& ec,
+                            bool resumed,
+                            std::chrono::steady_clock::duration elapsed)
+    {
+        auto& shard = local_shard();
+        if (ec)
+        {
+            metrics_shard::add(shard.handshakes_failed, 1);
+            std::lock_guard<std::mutex> lock(shard.failures_mutex);
+            ++shard.failures[ec];
+            return;
+        }
+
+        metrics_shard::add(shard.handshakes_completed, 1);
+        if (resumed) metrics_shard::add(shard.handshakes_resumed, 1);
+
+        using std::chrono::microseconds;
+        auto const count = std::chrono::duration_cast<microseconds>(elapsed).count();
+        auto const us = std::uint64_t(std::max(count, microseconds::rep(0)));
+        metrics_shard::add(shard.latency_buckets[latency_histogram::bucket_index(us)], 1);
+        metrics_shard::add(shard.latency_count, 1);
+        metrics_shard::add(shard.latency_sum_us, us);
+    }
+
+    void bytes_read(std::size_t n)
+    {
+        if (n > 0) metrics_shard::add(local_shard().bytes_read, n);
+    }
+
+    void bytes_written(std::size_t n)
+    {
+        if (n > 0) metrics_shard::add(local_shard().bytes_written, n);
+    }
+
+    context_metrics snapshot() const
+    {
+        std::lock_guard<std::mutex> lock(m_shards->mutex);
+        context_metrics m = m_shards->retired;
+        for (auto const& shard : m_shards->live)
+            shard->merge_into(m);
+        return m;
+    }
+
+    // Number of threads which recorded into the registry and have not exited
+    std::size_t shard_count() const
+    {
+        std::lock_guard<std::mutex> lock(m_shards->mutex);
+        return m_shards->live.size();
+    }
+
+private:
+    static std::uint64_t next_id()
+    {
+        static std::atomic<std::uint64_t> counter(0);
+        return ++counter;
+    }
+
+    // Find the shard of the calling thread, the lookup only touches thread-local data
+    metrics_shard& local_shard()
+    {
+        auto& cache = metrics_shard_cache::local();
+        if (metrics_shard* shard = cache.find(m_id)) return *shard;
+        return cache.add(m_id, m_shards);
+    }
+
+    std::uint64_t const m_id;
+    std::shared_ptr<metrics_shards> const m_shards;
+};
+
+} // namespace detail
+} // namespace gnutls
+} // namespace asio
+} // namespace boost
+
+#endif
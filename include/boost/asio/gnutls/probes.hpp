@@ -0,0 +1,48 @@
+//
+// gnutls/probes.hpp
+// ~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2020 Paul-Louis Ageneau (paul-louis at ageneau dot org)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef BOOST_ASIO_GNUTLS_PROBES_HPP
+#define BOOST_ASIO_GNUTLS_PROBES_HPP
+
+// Static tracing probes (USDT) for perf, bpftrace or SystemTap, under the provider
+// "boost_asio_gnutls". They are disabled by default and compile to nothing, define
+// BOOST_ASIO_GNUTLS_ENABLE_SDT to enable them (requires <sys/sdt.h> from SystemTap).
+//
+// Probes, the first argument is always the gnutls_session_t:
+//   handshake__start(session)
+//   handshake__step(session, gnutls_ret)
+//   handshake__done(session, error_value)
+//   recv__some(session, bytes, error_value)
+//   send__some(session, bytes, error_value)
+//   pull(session, size, ret, errno)
+//   push(session, size, ret, errno)
+//   verify(session, status, gnutls_ret)
+
+#if defined(BOOST_ASIO_GNUTLS_ENABLE_SDT)
+
+#include <sys/sdt.h>
+
+#define BOOST_ASIO_GNUTLS_PROBE1(name, a1) DTRACE_PROBE1(boost_asio_gnutls, name, a1)
+#define BOOST_ASIO_GNUTLS_PROBE2(name, a1, a2) DTRACE_PROBE2(boost_asio_gnutls, name, a1, a2)
+#define BOOST_ASIO_GNUTLS_PROBE3(name, a1, a2, a3)                                               \
+    DTRACE_PROBE3(boost_asio_gnutls, name, a1, a2, a3)
+#define BOOST_ASIO_GNUTLS_PROBE4(name, a1, a2, a3, a4)                                           \
+    DTRACE_PROBE4(boost_asio_gnutls, name, a1, a2, a3, a4)
+
+#else
+
+#define BOOST_ASIO_GNUTLS_PROBE1(name, a1) ((void)0)
+#define BOOST_ASIO_GNUTLS_PROBE2(name, a1, a2) ((void)0)
+#define BOOST_ASIO_GNUTLS_PROBE3(name, a1, a2, a3) ((void)0)
+#define BOOST_ASIO_GNUTLS_PROBE4(name, a1, a2, a3, a4) ((void)0)
+
+#endif
+
+#endif
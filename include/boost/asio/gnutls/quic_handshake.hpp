@@ -0,0 +1,397 @@
+//
+// gnutls/quic_handshake.hpp
+// ~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2020 Paul-Louis Ageneau (paul-louis at ageneau dot org)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef BOOST_ASIO_GNUTLS_QUIC_HANDSHAKE_HPP
+#define BOOST_ASIO_GNUTLS_QUIC_HANDSHAKE_HPP
+
+#include "context.hpp"
+#include "error.hpp"
+#include "session.hpp"
+#include "stream_base.hpp"
+
+#include <boost/asio/buffer.hpp>
+
+#ifndef BOOST_NO_EXCEPTIONS
+#include <boost/system/system_error.hpp>
+#include <boost/throw_exception.hpp>
+#endif
+
+#include <gnutls/gnutls.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace boost {
+namespace asio {
+namespace gnutls {
+
+// TLS 1.3 handshake for a QUIC stack, as specified by RFC 9001. No record is exchanged:
+// handshake messages are carried by the caller in CRYPTO frames at the encryption level they
+// belong to, received ones are fed with put_input() and the ones to send are taken with
+// output()/consume_output(). Traffic secrets are passed to the secret callback as soon as they
+// are installed, for the caller to derive the packet protection keys.
+//
+// The context credentials, verification settings and server name callback apply as for stream.
+class quic_handshake : public stream_base
+{
+public:
+    // Same values as gnutls_record_encryption_level_t
+    enum level
+    {
+        initial_level = GNUTLS_ENCRYPTION_LEVEL_INITIAL,
+        early_level = GNUTLS_ENCRYPTION_LEVEL_EARLY,
+        handshake_level = GNUTLS_ENCRYPTION_LEVEL_HANDSHAKE,
+        application_level = GNUTLS_ENCRYPTION_LEVEL_APPLICATION
+    };
+
+    enum want
+    {
+        want_input_and_retry = -2,  // call put_input() with more CRYPTO data, then retry
+        want_output_and_retry = -1, // send the pending output, then retry
+        want_nothing = 0,           // the handshake is complete
+        want_output = 1             // the handshake is complete, send the pending output
+    };
+
+    // Called with the secrets installed for a level, either of which may be empty. The secrets
+    // are only valid during the call, and the cipher suite is known from native_handle().
+    using secret_callback =
+        std::function<void(level, const_buffer read_secret, const_buffer write_secret)>;
+
+    // Codepoint of the quic_transport_parameters extension
+    static constexpr unsigned int transport_parameters_extension = 57;
+
+    explicit quic_handshake(context& ctx)
+        : stream_base(ctx)
+    {
+        make_session(m_context_impl->is_server() ? server : client);
+    }
+
+    quic_handshake(quic_handshake&& other)
+        : stream_base(std::move(other))
+        , m_session(std::move(other.m_session))
+        , m_secret_callback(std::move(other.m_secret_callback))
+        , m_transport_parameters(std::move(other.m_transport_parameters))
+        , m_peer_transport_parameters(std::move(other.m_peer_transport_parameters))
+        , m_has_peer_transport_parameters(other.m_has_peer_transport_parameters)
+        , m_output(std::move(other.m_output))
+        , m_output_pos(other.m_output_pos)
+        , m_alert(other.m_alert)
+        , m_established(other.m_established)
+        , m_handshake_start(other.m_handshake_start)
+    {
+        if (m_session) m_session->owner = this;
+    }
+
+    quic_handshake(quic_handshake const& other) = delete;
+
+    native_handle_type native_handle() { return m_session->session; }
+
+#ifndef BOOST_NO_EXCEPTIONS
+    void set_host_name(std::string const& name)
+    {
+        error_code ec;
+        set_host_name(name, ec);
+        if (ec) boost::throw_exception(boost::system::system_error(ec));
+    }
+#endif
+
+    error_code set_host_name(std::string const& name, error_code& ec)
+    {
+        int ret = gnutls_server_name_set(
+            m_session->session, GNUTLS_NAME_DNS, name.c_str(), name.size());
+        return ec = ret == GNUTLS_E_SUCCESS ? error_code()
+                                            : error_code(ret, error::get_ssl_category());
+    }
+
+    void set_secret_callback(secret_callback callback) { m_secret_callback = std::move(callback); }
+
+    // Encoded QUIC transport parameters sent to the peer, set before the handshake
+    void set_transport_parameters(const_buffer const& parameters)
+    {
+        auto const* begin = static_cast<unsigned char const*>(parameters.data());
+        m_transport_parameters.assign(begin, begin + parameters.size());
+    }
+
+    // Encoded QUIC transport parameters received from the peer, empty until they are received.
+    // The handshake fails with a missing_extension alert if the peer sends none.
+    const_buffer peer_transport_parameters() const
+    {
+        return boost::asio::buffer(m_peer_transport_parameters);
+    }
+
+    // Alert to send in a CONNECTION_CLOSE frame once the handshake failed, 0 if none
+    int alert() const { return m_alert; }
+
+    want handshake(handshake_type type, error_code& ec)
+    {
+        if (m_session->type != type) make_session(type);
+
+        // Calling gnutls_handshake() again would send a KeyUpdate, which QUIC forbids
+        if (m_established)
+        {
+            ec.clear();
+            return has_output() ? want_output : want_nothing;
+        }
+
+        auto& metrics = m_context_impl->metrics;
+        if (m_handshake_start == clock::time_point())
+        {
+            m_handshake_start = clock::now();
+            metrics.handshake_started();
+        }
+
+        int ret;
+        do {
+            ret = gnutls_handshake(m_session->session);
+        } while (ret < 0 && ret != GNUTLS_E_AGAIN && !gnutls_error_is_fatal(ret));
+
+        if (ret == GNUTLS_E_AGAIN)
+        {
+            ec.clear();
+            return has_output() ? want_output_and_retry : want_input_and_retry;
+        }
+
+        ec = ret < 0 ? error_code(ret, error::get_ssl_category()) : error_code();
+        m_established = !ec;
+        if (ret < 0 && m_alert == 0)
+        {
+            // GnuTLS does not send alerts on its own when a handshake fails
+            int alert_level;
+            m_alert = std::max(gnutls_error_to_alert(ret, &alert_level), 0);
+        }
+        auto const start = std::exchange(m_handshake_start, clock::time_point());
+        bool const resumed = !ec && gnutls_session_is_resumed(m_session->session) != 0;
+        metrics.handshake_finished(ec, resumed, clock::now() - start);
+        return has_output() ? want_output : want_nothing;
+    }
+
+    // Pass CRYPTO data received at a level, in order, then call handshake(). Data received
+    // after the handshake, like session tickets, is processed immediately.
+    error_code put_input(level l, const_buffer const& data, error_code& ec)
+    {
+        int ret = gnutls_handshake_write(
+            m_session->session, gnutls_record_encryption_level_t(l), data.data(), data.size());
+        return ec = ret == GNUTLS_E_SUCCESS ? error_code()
+                                            : error_code(ret, error::get_ssl_category());
+    }
+
+    // Pending CRYPTO data to send at a level, valid until the next call to a non-const member
+    // function
+    const_buffer output(level l) const
+    {
+        auto const& output = m_output[l];
+        return const_buffer(output.data() + m_output_pos[l], output.size() - m_output_pos[l]);
+    }
+
+    void consume_output(level l, std::size_t length)
+    {
+        auto& output = m_output[l];
+        auto& pos = m_output_pos[l];
+        pos += std::min(length, output.size() - pos);
+        if (pos == output.size())
+        {
+            output.clear();
+            pos = 0;
+        }
+    }
+
+private:
+    using clock = std::chrono::steady_clock;
+    static constexpr std::size_t level_count = application_level + 1;
+
+    void make_session(handshake_type type)
+    {
+        auto session = std::make_unique<detail::tls_session>(this, type);
+        gnutls_session_t s = session->session;
+
+        // QUIC requires TLS 1.3 without middlebox compatibility mode, so an empty legacy session
+        // ID and no ChangeCipherSpec
+        int ret = gnutls_priority_set_direct(
+            s, "NORMAL:-VERS-ALL:+VERS-TLS1.3:%DISABLE_TLS13_COMPAT_MODE", nullptr);
+        if (ret != GNUTLS_E_SUCCESS)
+            throw std::runtime_error("gnutls_priority_set_direct failed: " +
+                                     std::string(gnutls_strerror(ret)));
+
+        ret = gnutls_session_ext_register(s,
+                                          "quic_transport_parameters",
+                                          transport_parameters_extension,
+                                          GNUTLS_EXT_TLS,
+                                          recv_parameters_func,
+                                          send_parameters_func,
+                                          nullptr,
+                                          nullptr,
+                                          nullptr,
+                                          GNUTLS_EXT_FLAG_TLS | GNUTLS_EXT_FLAG_CLIENT_HELLO |
+                                              GNUTLS_EXT_FLAG_EE);
+        if (ret != GNUTLS_E_SUCCESS)
+            throw std::runtime_error("gnutls_session_ext_register failed: " +
+                                     std::string(gnutls_strerror(ret)));
+
+        // Both endpoints must send transport parameters, checked once the message carrying them
+        // is processed: the client hello on the server, encrypted extensions on the client,
+        // which GnuTLS only parses after the hooks of the message, so before the next one
+        if (type == server)
+            gnutls_handshake_set_hook_function(
+                s, GNUTLS_HANDSHAKE_CLIENT_HELLO, GNUTLS_HOOK_POST, check_parameters_func);
+        else
+            gnutls_handshake_set_hook_function(
+                s, GNUTLS_HANDSHAKE_FINISHED, GNUTLS_HOOK_PRE, check_parameters_func);
+
+        gnutls_handshake_set_read_function(s, read_func);
+        gnutls_handshake_set_secret_function(s, secret_func);
+        gnutls_alert_set_read_function(s, alert_func);
+
+        // Records are never used, any attempt to exchange one fails
+        gnutls_transport_set_ptr(s, session.get());
+        gnutls_transport_set_push_function(s, push_func);
+        gnutls_transport_set_pull_function(s, pull_func);
+
+        m_session = std::move(session);
+        m_peer_transport_parameters.clear();
+        m_has_peer_transport_parameters = false;
+        m_alert = 0;
+        m_established = false;
+    }
+
+    bool has_output() const
+    {
+        for (std::size_t i = 0; i < level_count; ++i)
+            if (m_output[i].size() > m_output_pos[i]) return true;
+        return false;
+    }
+
+    static quic_handshake* from(gnutls_session_t session)
+    {
+        return static_cast<quic_handshake*>(detail::tls_session::from(session)->owner);
+    }
+
+    static int read_func(gnutls_session_t session,
+                         gnutls_record_encryption_level_t l,
+                         gnutls_handshake_description_t type,
+                         const void* data,
+                         std::size_t size)
+    {
+        auto* h = from(session);
+        if (!h) return GNUTLS_E_INVALID_SESSION;
+
+        // QUIC has no ChangeCipherSpec, even in compatibility mode
+        if (type == GNUTLS_HANDSHAKE_CHANGE_CIPHER_SPEC) return 0;
+
+        auto const* begin = static_cast<char const*>(data);
+        auto& output = h->m_output[l];
+        output.insert(output.end(), begin, begin + size);
+        return 0;
+    }
+
+    static int secret_func(gnutls_session_t session,
+                           gnutls_record_encryption_level_t l,
+                           const void* read_secret,
+                           const void* write_secret,
+                           std::size_t size)
+    {
+        auto* h = from(session);
+        if (!h) return GNUTLS_E_INVALID_SESSION;
+
+        if (h->m_secret_callback)
+            h->m_secret_callback(level(l),
+                                 const_buffer(read_secret, read_secret ? size : 0),
+                                 const_buffer(write_secret, write_secret ? size : 0));
+        return 0;
+    }
+
+    static int alert_func(gnutls_session_t session,
+                          gnutls_record_encryption_level_t,
+                          gnutls_alert_level_t,
+                          gnutls_alert_description_t desc)
+    {
+        auto* h = from(session);
+        if (h) h->m_alert = int(desc);
+        return 0;
+    }
+
+    static int send_parameters_func(gnutls_session_t session, gnutls_buffer_t extdata)
+    {
+        auto* h = from(session);
+        if (!h) return GNUTLS_E_INVALID_SESSION;
+
+        auto const& parameters = h->m_transport_parameters;
+        if (parameters.empty()) return 0;
+        int ret = gnutls_buffer_append_data(extdata, parameters.data(), parameters.size());
+        return ret < 0 ? ret : int(parameters.size());
+    }
+
+    static int recv_parameters_func(gnutls_session_t session,
+                                    const unsigned char* data,
+                                    std::size_t size)
+    {
+        auto* h = from(session);
+        if (!h) return GNUTLS_E_INVALID_SESSION;
+
+        h->m_peer_transport_parameters.assign(data, data + size);
+        h->m_has_peer_transport_parameters = true;
+        return 0;
+    }
+
+    static int check_parameters_func(gnutls_session_t session,
+                                     unsigned int,
+                                     unsigned int,
+                                     unsigned int,
+                                     const gnutls_datum_t*)
+    {
+        auto* h = from(session);
+        if (!h) return GNUTLS_E_INVALID_SESSION;
+
+        return h->m_has_peer_transport_parameters ? 0 : GNUTLS_E_MISSING_EXTENSION;
+    }
+
+    static ssize_t pull_func(void* ptr, void*, std::size_t)
+    {
+        auto* s = static_cast<detail::tls_session*>(ptr);
+        gnutls_transport_set_errno(s->session, s->owner ? EAGAIN : ECONNRESET);
+        return -1;
+    }
+
+    static ssize_t push_func(void* ptr, const void*, std::size_t)
+    {
+        auto* s = static_cast<detail::tls_session*>(ptr);
+        gnutls_transport_set_errno(s->session, ECONNRESET);
+        return -1;
+    }
+
+    std::unique_ptr<detail::tls_session> m_session;
+    secret_callback m_secret_callback;
+
+    std::vector<unsigned char> m_transport_parameters;
+    std::vector<unsigned char> m_peer_transport_parameters;
+    bool m_has_peer_transport_parameters = false;
+
+    std::array<std::vector<char>, level_count> m_output;
+    std::array<std::size_t, level_count> m_output_pos = {};
+
+    int m_alert = 0;
+    bool m_established = false;
+
+    clock::time_point m_handshake_start; // epoch if no handshake is in progress
+};
+
+} // namespace gnutls
+} // namespace asio
+} // namespace boost
+
+#endif
@@ -0,0 +1,201 @@
+//
+// gnutls/session.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2020 Paul-Louis Ageneau (paul-louis at ageneau dot org)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef BOOST_ASIO_GNUTLS_SESSION_HPP
+#define BOOST_ASIO_GNUTLS_SESSION_HPP
+
+#include "context.hpp"
+#include "probes.hpp"
+#include "stream_base.hpp"
+#include "verify_context.hpp"
+
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+namespace boost {
+namespace asio {
+namespace gnutls {
+namespace detail {
+
+// A GnuTLS session configured from the context and verify settings of its owner, shared by
+// stream and engine. The owner is reset to null once it is destroyed or moved from, and the
+// session pointer always points to the tls_session base of the derived object.
+class tls_session
+{
+public:
+    using handshake_type = stream_base::handshake_type;
+
+    // Extra flags are passed to gnutls_init, like GNUTLS_DATAGRAM for DTLS
+    tls_session(stream_base* owner, handshake_type t, unsigned int extra_flags = 0)
+        : type(t)
+        , owner(owner)
+    {
+        unsigned int const flags = type == stream_base::client ? GNUTLS_CLIENT : GNUTLS_SERVER;
+        int ret = gnutls_init(&session, flags | extra_flags | GNUTLS_NONBLOCK);
+        if (ret != GNUTLS_E_SUCCESS)
+            throw std::runtime_error("gnutls_init failed: " + std::string(gnutls_strerror(ret)));
+
+        gnutls_session_set_ptr(session, this);
+        gnutls_handshake_set_post_client_hello_function(session, post_client_hello_func);
+
+        auto context_impl = owner->m_context_impl;
+        auto const opts = context_impl->opts;
+        auto const tls_version = owner->m_tls_version;
+
+        std::ostringstream priority;
+        priority << "NORMAL";
+        if (opts & context::default_workarounds) priority << ":%COMPAT";
+        if (tls_version > 0 && tls_version < 10 && !(opts & context::no_sslv3))
+            priority << ":+VERS-SSL3.0";
+        if (tls_version >= 10)
+            priority << ":-VERS-TLS-ALL:+VERS-TLS" << (tls_version / 10) << '.'
+                     << (tls_version % 10);
+
+        char const* err_pos = nullptr;
+        ret = gnutls_priority_set_direct(session, priority.str().c_str(), &err_pos);
+        if (ret != GNUTLS_E_SUCCESS)
+        {
+            gnutls_deinit(session);
+            throw std::runtime_error("gnutls_priority_set_direct failed for \"" +
+                                     priority.str() + "\": " + std::string(gnutls_strerror(ret)));
+        }
+
+        // Set on the session rather than on the shared credentials, since streams over
+        // different next layers may share a context, like both ends of a TLS-in-TLS tunnel
+        gnutls_session_set_verify_function(session, verify_func);
+        ret = gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, context_impl->cred);
+        if (ret != GNUTLS_E_SUCCESS)
+        {
+            gnutls_deinit(session);
+            throw std::runtime_error("gnutls_credentials_set failed: " +
+                                     std::string(gnutls_strerror(ret)));
+        }
+    }
+
+    tls_session(tls_session const&) = delete;
+    tls_session& operator=(tls_session const&) = delete;
+    ~tls_session() { gnutls_deinit(session); }
+
+    static tls_session* from(gnutls_session_t session)
+    {
+        return static_cast<tls_session*>(gnutls_session_get_ptr(session));
+    }
+
+    std::string get_server_name() const
+    {
+        char buf[256];
+        size_t len = sizeof(buf);
+        unsigned int type = GNUTLS_NAME_DNS;
+        int ret = gnutls_server_name_get(session, buf, &len, &type, 0);
+        return ret == GNUTLS_E_SUCCESS ? std::string(buf, len) : "";
+    }
+
+    const handshake_type type;
+    stream_base* owner;
+
+    gnutls_session_t session;
+
+private:
+    // Single exit point, so that the probe sees every verification, failed early or not
+    static int verify_func(gnutls_session_t session)
+    {
+        unsigned int status = 0;
+        int ret = verify_peer(session, status);
+        BOOST_ASIO_GNUTLS_PROBE3(verify, session, status, ret);
+        return ret;
+    }
+
+    static int verify_peer(gnutls_session_t session, unsigned int& status)
+    {
+        auto* s = from(session);
+        if (!s->owner) return GNUTLS_E_INVALID_SESSION;
+        auto context_impl = s->owner->m_context_impl;
+
+        auto verify = s->owner->m_verify >= 0 ? s->owner->m_verify : context_impl->verify;
+        auto verify_callback = s->owner->m_verify_callback ? s->owner->m_verify_callback
+                                                           : context_impl->verify_callback;
+
+        if (!(verify & context::verify_peer)) return GNUTLS_E_SUCCESS; // no verification requested
+
+        if (gnutls_certificate_type_get(session) != GNUTLS_CRT_X509)
+            return GNUTLS_E_NO_CERTIFICATE_FOUND;
+
+        unsigned int count = 0;
+        gnutls_datum_t const* array = gnutls_certificate_get_peers(session, &count);
+        if (!array || count == 0) return GNUTLS_E_NO_CERTIFICATE_FOUND;
+
+        gnutls_x509_crt_t cert;
+        gnutls_x509_crt_init(&cert);
+        int ret = gnutls_x509_crt_import(cert, &array[0], GNUTLS_X509_FMT_DER);
+        if (ret != GNUTLS_E_SUCCESS)
+        {
+            gnutls_x509_crt_deinit(cert);
+            return ret;
+        }
+
+        bool verified = false;
+        ret = gnutls_certificate_verify_peers2(session, &status);
+        if (ret == GNUTLS_E_SUCCESS && !(status & GNUTLS_CERT_INVALID)) verified = true;
+
+        if (verify_callback)
+        {
+            verify_context ctx(cert);
+            verified = verify_callback(verified, ctx);
+        }
+
+        gnutls_x509_crt_deinit(cert);
+
+        return verified ? GNUTLS_E_SUCCESS : GNUTLS_E_CERTIFICATE_ERROR;
+    }
+
+    static int post_client_hello_func(gnutls_session_t session)
+    {
+        auto* s = from(session);
+        if (!s->owner) return GNUTLS_E_INVALID_SESSION;
+        auto context_impl = s->owner->m_context_impl;
+
+        auto& callback = context_impl->server_name_callback;
+        if (!callback) return GNUTLS_E_SUCCESS;
+
+        if (!callback(*s->owner, s->get_server_name())) return GNUTLS_E_UNRECOGNIZED_NAME;
+
+        // context may have been switched
+        context_impl = s->owner->m_context_impl;
+
+        // set credentials now
+        int ret = gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, context_impl->cred);
+        if (ret != GNUTLS_E_SUCCESS) return ret;
+
+        // set certificate request
+        auto const verify = context_impl->verify;
+        gnutls_certificate_request_t req = GNUTLS_CERT_IGNORE;
+        if (verify & context::verify_peer)
+        {
+            if (verify & context::verify_fail_if_no_peer_cert)
+                req = GNUTLS_CERT_REQUIRE;
+            else
+                req = GNUTLS_CERT_REQUEST;
+        }
+        gnutls_certificate_server_set_request(session, req);
+
+        return GNUTLS_E_SUCCESS;
+    }
+};
+
+} // namespace detail
+} // namespace gnutls
+} // namespace asio
+} // namespace boost
+
+#endif
@@ -12,6 +12,10 @@
 #define BOOST_ASIO_GNUTLS_STREAM_HPP
 
 #include "context.hpp"
+#include "detail/handler_slot.hpp"
+#include "handshake_trace.hpp"
+#include "probes.hpp"
+#include "session.hpp"
 #include "stream_base.hpp"
 
 #include <boost/asio.hpp>
@@ -21,19 +25,200 @@
 #endif
 
 #include <gnutls/gnutls.h>
-#include <gnutls/x509.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <climits>
 #include <cstddef>
-#include <list>
-#include <sstream>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <type_traits>
 #include <utility>
+#include <vector>
 
 namespace boost {
 namespace asio {
 namespace gnutls {
 
+namespace detail {
+
+template <typename...> struct make_void
+{
+    using type = void;
+};
+
+// Next layers exposing readiness waits and a non-blocking mode, like sockets, are driven by
+// waiting for readiness then calling read_some/write_some. Any other async stream, including
+// another TLS stream, is driven through async_read_some/async_write_some and internal
+// ciphertext buffers.
+template <typename T, typename = void> struct is_reactive_layer : std::false_type
+{};
+
+template <typename T>
+struct is_reactive_layer<
+    T,
+    typename make_void<decltype(T::wait_read),
+                       decltype(T::wait_write),
+                       decltype(std::declval<T&>().non_blocking(
+                           true, std::declval<boost::system::error_code&>()))>::type>
+    : std::true_type
+{};
+
+// Next layers with a native socket handle wait for readiness with poll(), which takes a timeout
+template <typename T, typename = void> struct has_native_socket : std::false_type
+{};
+
+template <typename T>
+struct has_native_socket<
+    T,
+    typename make_void<decltype(boost::asio::detail::socket_ops::poll_read(
+        std::declval<T&>().native_handle(), 0, 0, std::declval<boost::system::error_code&>()))>::
+        type> : std::true_type
+{};
+
+// Next layers taking a deadline in their own synchronous waits, like the peers of a dtls_server
+template <typename T, typename = void> struct has_deadline_wait : std::false_type
+{};
+
+template <typename T>
+struct has_deadline_wait<
+    T,
+    typename make_void<decltype(std::declval<T&>().wait(
+        T::wait_read,
+        std::chrono::steady_clock::time_point(),
+        std::declval<boost::system::error_code&>()))>::type> : std::true_type
+{};
+
+// Wait until the next layer is ready in the given direction, or fail with timed_out once the
+// deadline has passed. An epoch deadline means no deadline.
+template <typename NextLayer, typename WaitType>
+void wait_ready(NextLayer& next_layer,
+                WaitType type,
+                std::chrono::steady_clock::time_point deadline,
+                boost::system::error_code& ec,
+                std::true_type)
+{
+    namespace socket_ops = boost::asio::detail::socket_ops;
+
+    int msec = -1;
+    if (deadline != std::chrono::steady_clock::time_point())
+    {
+        auto const remaining = deadline - std::chrono::steady_clock::now();
+        if (remaining <= remaining.zero())
+        {
+            ec = boost::asio::error::timed_out;
+            return;
+        }
+        auto const rounded = std::chrono::duration_cast<std::chrono::milliseconds>(remaining) +
+                             std::chrono::milliseconds(1);
+        msec = int(std::min<std::chrono::milliseconds::rep>(rounded.count(), INT_MAX));
+    }
+
+    int const ret = type == NextLayer::wait_read
+                        ? socket_ops::poll_read(next_layer.native_handle(), 0, msec, ec)
+                        : socket_ops::poll_write(next_layer.native_handle(), 0, msec, ec);
+    if (ret == 0)
+        ec = boost::asio::error::timed_out;
+    else if (ec == boost::asio::error::interrupted)
+        ec.clear(); // the caller retries
+}
+
+template <typename NextLayer, typename WaitType>
+void wait_until(NextLayer& next_layer,
+                WaitType type,
+                std::chrono::steady_clock::time_point deadline,
+                boost::system::error_code& ec,
+                std::true_type)
+{
+    next_layer.wait(type, deadline, ec);
+}
+
+template <typename NextLayer, typename WaitType>
+void wait_until(NextLayer& next_layer,
+                WaitType type,
+                std::chrono::steady_clock::time_point,
+                boost::system::error_code& ec,
+                std::false_type)
+{
+    next_layer.wait(type, ec);
+}
+
+// Other next layers, like memory_pipe, only check the deadline before waiting, unless they
+// take one
+template <typename NextLayer, typename WaitType>
+void wait_ready(NextLayer& next_layer,
+                WaitType type,
+                std::chrono::steady_clock::time_point deadline,
+                boost::system::error_code& ec,
+                std::false_type)
+{
+    if (deadline != std::chrono::steady_clock::time_point() &&
+        std::chrono::steady_clock::now() >= deadline)
+        ec = boost::asio::error::timed_out;
+    else
+        wait_until(next_layer, type, deadline, ec, has_deadline_wait<NextLayer>());
+}
+
+// Completion handler of a buffered handshake, forwarding the associated executor and allocator
+template <typename Handler> struct buffered_handshake_handler
+{
+    void operator()(boost::system::error_code const& ec) { handler(ec, std::size_t(0)); }
+
+    Handler handler;
+};
+
+// Completion handler of a flush, run as a write of no bytes, forwarding the associated executor
+// and allocator
+template <typename Handler> struct flush_write_handler
+{
+    void operator()(boost::system::error_code const& ec, std::size_t) { handler(ec); }
+
+    Handler handler;
+};
+
+// Direction the last transport call of this thread would have blocked on, 0 for reading and 1
+// for writing, as gnutls_record_get_direction is unreliable when two threads share a session
+inline int& blocked_direction()
+{
+    static thread_local int direction = 0;
+    return direction;
+}
+
+// Immediate completions nested on this thread in a direction, 0 for reads and 1 for writes, so
+// that a reader and a writer completing at once on two threads are bounded separately
+inline unsigned int& completion_depth(int direction)
+{
+    static thread_local unsigned int depth[2] = {};
+    return depth[direction];
+}
+
+// Message of a write queue, owning its data or keeping its owner alive until written
+struct queued_write
+{
+    queued_write* next = nullptr;
+    std::string payload;
+    std::shared_ptr<void const> owner;
+    boost::asio::const_buffer data;
+};
+
+} // namespace detail
+
+// Once the handshake is done, over a reactive next layer like a socket, one reader and one
+// writer may run at once on two threads, synchronously or asynchronously, without a strand, as
+// each direction has its own state and GnuTLS allows concurrent record reads and writes. A second
+// synchronous operation in the same direction fails with operation_not_supported. cancel_read()
+// is part of the reader and cancel_write() of the writer, so each must be serialized with the
+// operations of its own direction only. A renegotiation requested by the peer, which TLS 1.2
+// allows, runs the handshake within a read, so the reader and the writer must not overlap with
+// peers that renegotiate. The handshake and shutdown must not overlap other operations. Like an
+// asynchronous operation, a blocking timeout leaves a reactive next layer in non-blocking mode.
+// The write queue counts as the writer, see queue_write().
 template <typename NextLayer> class stream : public stream_base
 {
 public:
@@ -47,7 +232,6 @@ public:
     stream(Arg&& arg, context& ctx)
         : stream_base(ctx)
         , m_next_layer(std::forward<Arg>(arg))
-        , m_tls_version(ctx.m_impl->tls_version())
     {
         ensure_impl(ctx.m_impl->is_server() ? server : client);
     }
@@ -55,12 +239,17 @@ public:
     stream(stream&& other)
         : stream_base(std::move(other))
         , m_next_layer(std::move(other.m_next_layer))
-        , m_verify(std::move(other.m_verify))
-        , m_verify_callback(std::move(other.m_verify_callback))
-        , m_tls_version(other.m_tls_version)
+        , m_handshake_tracing(other.m_handshake_tracing)
+        , m_immediate_completion(other.m_immediate_completion)
+        , m_blocking_timeout(other.m_blocking_timeout)
+        , m_dynamic_record_sizing(other.m_dynamic_record_sizing)
+        , m_cork_limit(other.m_cork_limit)
+        , m_explicit_flush(other.m_explicit_flush)
+        , m_coalescing_threshold(other.m_coalescing_threshold)
+        , m_coalescing_delay(other.m_coalescing_delay)
         , m_impl(std::move(other.m_impl))
     {
-        m_impl->parent = this;
+        m_impl->owner = this;
     }
 
     stream(stream const& other) = delete;
@@ -69,7 +258,7 @@ public:
         if (m_impl)
         {
             m_impl->abort();
-            m_impl->parent = nullptr;
+            m_impl->owner = nullptr;
         }
     }
 
@@ -82,218 +271,65 @@ public:
 
     native_handle_type native_handle() { return m_impl->session; }
 
-#ifndef BOOST_NO_EXCEPTIONS
-    void set_verify_mode(verify_mode v)
-    {
-        error_code ec;
-        set_verify_mode(v, ec);
-    }
-#endif
-
-    // Warning: for clients only (verify_none or verify_peer)
-    error_code set_verify_mode(verify_mode v, error_code& ec)
-    {
-        m_verify = v;
-        return ec;
-    }
-
-#ifndef BOOST_NO_EXCEPTIONS
-    void set_verify_depth(int depth)
-    {
-        error_code ec;
-        set_verify_depth(depth, ec);
-    }
-#endif
-
-    // Warning: ignored
-    error_code set_verify_depth(int, error_code& ec) { return ec; }
-
-#ifndef BOOST_NO_EXCEPTIONS
-    template <typename VerifyCallback> void set_verify_callback(VerifyCallback callback)
-    {
-        error_code ec;
-        set_verify_callback(callback, ec);
-    }
-#endif
-
-    template <typename VerifyCallback>
-    error_code set_verify_callback(VerifyCallback callback, error_code& ec)
-    {
-        m_verify_callback = callback;
-        return ec;
-    }
-
     template <typename HandshakeHandler>
-    BOOST_ASIO_INITFN_RESULT_TYPE(HandshakeHandler, void(error_code))
+    BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(HandshakeHandler, void(error_code))
     async_handshake(handshake_type type, HandshakeHandler&& handler)
     {
-        // If you get an error on the following line it means that your handler does
-        // not meet the documented type requirements for a HandshakeHandler.
-        BOOST_ASIO_HANDSHAKE_HANDLER_CHECK(HandshakeHandler, handler) type_check;
-
-        async_callable<HandshakeHandler, error_code> callable(std::move(handler));
-
-        if (m_impl->handshake_handler || m_impl->is_handshake_done)
-        {
-            post(get_executor(), std::bind(callable, boost::asio::error::operation_not_supported));
-            return;
-        }
-
-        error_code ec;
-        m_next_layer.non_blocking(true, ec);
-        if (ec)
-        {
-            post(get_executor(), std::bind(callable, ec));
-            return;
-        }
-
-        ensure_impl(type);
-        m_impl->handshake_handler = std::bind(callable, std::placeholders::_1);
-        m_impl->handle_handshake();
-        return callable.get_completion_result();
+        return boost::asio::async_initiate<HandshakeHandler, void(error_code)>(
+            initiate_async_handshake(this), handler, type);
     }
 
     template <typename ConstBufferSequence, typename BufferedHandshakeHandler>
-    BOOST_ASIO_INITFN_RESULT_TYPE(BufferedHandshakeHandler, void(error_code, std::size_t))
+    BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(BufferedHandshakeHandler, void(error_code, std::size_t))
     async_handshake(handshake_type type,
                     const ConstBufferSequence& buffers,
                     BufferedHandshakeHandler&& handler)
     {
-        // If you get an error on the following line it means that your handler does
-        // not meet the documented type requirements for a BufferedHandshakeHandler.
-        BOOST_ASIO_BUFFERED_HANDSHAKE_HANDLER_CHECK(BufferedHandshakeHandler, handler) type_check;
-
-        async_callable<BufferedHandshakeHandler, error_code, std::size_t> callable(
-            std::move(handler));
-
-        async_handshake(type, std::bind(callable, std::placeholders::_1, std::size_t(0)));
-        return callable.get_completion_result();
+        return boost::asio::async_initiate<BufferedHandshakeHandler,
+                                           void(error_code, std::size_t)>(
+            initiate_async_buffered_handshake(this), handler, type);
     }
 
     template <typename ShutdownHandler>
-    BOOST_ASIO_INITFN_RESULT_TYPE(ShutdownHandler, void(error_code))
+    BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(ShutdownHandler, void(error_code))
     async_shutdown(ShutdownHandler&& handler)
     {
-        // If you get an error on the following line it means that your handler does
-        // not meet the documented type requirements for a ShutdownHandler.
-        BOOST_ASIO_SHUTDOWN_HANDLER_CHECK(ShutdownHandler, handler) type_check;
-
-        async_callable<ShutdownHandler, error_code> callable(std::move(handler));
-
-        if (m_impl->shutdown_handler || !m_impl->is_handshake_done)
-        {
-            post(get_executor(), std::bind(callable, boost::asio::error::operation_not_supported));
-            return;
-        }
-
-        error_code ec;
-        m_next_layer.non_blocking(true, ec);
-        if (ec)
-        {
-            post(get_executor(), std::bind(callable, ec));
-            return;
-        }
-
-        m_impl->abort();
-        m_impl->shutdown_handler = std::bind(callable, std::placeholders::_1);
-        m_impl->handle_shutdown();
-        return callable.get_completion_result();
+        return boost::asio::async_initiate<ShutdownHandler, void(error_code)>(
+            initiate_async_shutdown(this), handler);
     }
 
     template <typename MutableBufferSequence, typename ReadHandler>
-    BOOST_ASIO_INITFN_RESULT_TYPE(ReadHandler, void(error_code, std::size_t))
+    BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(ReadHandler, void(error_code, std::size_t))
     async_read_some(const MutableBufferSequence& buffers, ReadHandler&& handler)
     {
-        // If you get an error on the following line it means that your handler does
-        // not meet the documented type requirements for a ReadHandler.
-        BOOST_ASIO_READ_HANDLER_CHECK(ReadHandler, handler) type_check;
-
-        async_callable<ReadHandler, error_code, std::size_t> callable(std::move(handler));
-
-        if (m_impl->read_handler)
-        {
-            post(get_executor(),
-                 std::bind(callable, boost::asio::error::operation_not_supported, std::size_t(0)));
-            return;
-        }
-
-        error_code ec;
-        m_next_layer.non_blocking(true, ec);
-        if (ec)
-        {
-            post(get_executor(), std::bind(callable, ec, std::size_t(0)));
-            return;
-        }
-
-        std::size_t bytes_added = 0;
-        for (auto b = buffer_sequence_begin(buffers), end(buffer_sequence_end(buffers)); b != end;
-             ++b)
-        {
-            auto r = *b; // operator -> might be deleted
-            if (r.size() == 0) continue;
-            m_impl->read_buffers.push_back(r);
-            bytes_added += r.size();
-        }
-
-        if (bytes_added == 0)
-        {
-            // if we're reading 0 bytes, post handler immediately
-            post(get_executor(), std::bind(callable, error_code(), std::size_t(0)));
-            return;
-        }
-
-        m_impl->read_handler = std::bind(callable, std::placeholders::_1, std::placeholders::_2);
-        m_impl->bytes_read = 0;
-        m_impl->async_schedule();
-        return callable.get_completion_result();
+        return boost::asio::async_initiate<ReadHandler, void(error_code, std::size_t)>(
+            initiate_async_read_some(this), handler, buffers);
     }
 
     template <typename ConstBufferSequence, typename WriteHandler>
-    BOOST_ASIO_INITFN_RESULT_TYPE(WriteHandler, void(error_code, std::size_t))
+    BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(WriteHandler, void(error_code, std::size_t))
     async_write_some(const ConstBufferSequence& buffers, WriteHandler&& handler)
     {
-        // If you get an error on the following line it means that your handler does
-        // not meet the documented type requirements for a WriteHandler.
-        BOOST_ASIO_WRITE_HANDLER_CHECK(WriteHandler, handler) type_check;
-
-        async_callable<WriteHandler, error_code, std::size_t> callable(std::move(handler));
-
-        if (m_impl->write_handler)
-        {
-            post(get_executor(),
-                 std::bind(callable, boost::asio::error::operation_not_supported, std::size_t(0)));
-            return;
-        }
-
-        error_code ec;
-        m_next_layer.non_blocking(true, ec);
-        if (ec)
-        {
-            post(get_executor(), std::bind(callable, ec, std::size_t(0)));
-            return;
-        }
-
-        size_t bytes_added = 0;
-        for (auto b = buffer_sequence_begin(buffers), end(buffer_sequence_end(buffers)); b != end;
-             ++b)
-        {
-            auto r = *b; // operator -> might be deleted
-            if (r.size() == 0) continue;
-            m_impl->write_buffers.push_back(r);
-            bytes_added += r.size();
-        }
+        return boost::asio::async_initiate<WriteHandler, void(error_code, std::size_t)>(
+            initiate_async_write_some(this), handler, buffers);
+    }
 
-        if (bytes_added == 0)
-        {
-            // if we're writing 0 bytes, post handler immediately
-            post(get_executor(), std::bind<void>(callable, error_code(), std::size_t(0)));
-            return;
-        }
+    // Write all of the buffers, like boost::asio::async_write, but as a single operation which
+    // keeps the buffer sequence across partial sends
+    template <typename ConstBufferSequence, typename WriteHandler>
+    BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(WriteHandler, void(error_code, std::size_t))
+    async_write(const ConstBufferSequence& buffers, WriteHandler&& handler)
+    {
+        return boost::asio::async_initiate<WriteHandler, void(error_code, std::size_t)>(
+            initiate_async_write_some(this, true), handler, buffers);
+    }
 
-        m_impl->write_handler = std::bind(callable, std::placeholders::_1, std::placeholders::_2);
-        m_impl->bytes_written = 0;
-        m_impl->async_schedule();
-        return callable.get_completion_result();
+    template <typename FlushHandler>
+    BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(FlushHandler, void(error_code))
+    async_flush(FlushHandler&& handler)
+    {
+        return boost::asio::async_initiate<FlushHandler, void(error_code)>(
+            initiate_async_flush(this), handler);
     }
 
     void handshake(handshake_type type)
@@ -308,17 +344,31 @@ public:
         if (m_impl->is_handshake_done) return ec = boost::asio::error::operation_not_supported;
 
         ensure_impl(type);
+        blocking_scope blocking(this);
+        if (!blocking) return ec = boost::asio::error::operation_not_supported;
+
+        m_impl->handshake_started();
+        ec.clear();
         int ret;
         do {
-            ret = gnutls_handshake(m_impl->session);
-        } while (ret != GNUTLS_E_SUCCESS && !gnutls_error_is_fatal(ret));
+            ret = m_impl->call_handshake();
+        } while (ret != GNUTLS_E_SUCCESS && !gnutls_error_is_fatal(ret) &&
+                 blocking.retry(ret, ec));
 
-        if (ret == GNUTLS_E_PREMATURE_TERMINATION)
-            return ec = error::stream_truncated;
-        else if (ret != GNUTLS_E_SUCCESS)
-            return ec = error_code(ret, error::get_ssl_category());
+        // A timed out handshake is still in progress and may be resumed by another call
+        if (ec == boost::asio::error::timed_out) return ec;
 
-        m_impl->is_handshake_done = true;
+        if (!ec) // otherwise waiting for the next layer failed
+        {
+            if (ret == GNUTLS_E_PREMATURE_TERMINATION)
+                ec = error::stream_truncated;
+            else if (ret != GNUTLS_E_SUCCESS)
+                ec = error_code(ret, error::get_ssl_category());
+            else
+                m_impl->resume_held_queue();
+        }
+
+        m_impl->handshake_finished(ec);
         return ec;
     }
 
@@ -350,12 +400,22 @@ public:
 
     error_code shutdown(error_code& ec)
     {
+        // close_notify is not corked, held records must be sent before
+        if (!m_impl->write_handler && flush(ec)) return ec;
+
+        blocking_scope blocking(this);
+        if (!blocking) return ec = boost::asio::error::operation_not_supported;
+
+        ec.clear();
         int ret;
         do {
             ret = gnutls_bye(m_impl->session, GNUTLS_SHUT_RDWR);
-        } while (ret != GNUTLS_E_SUCCESS && !gnutls_error_is_fatal(ret));
+        } while (ret != GNUTLS_E_SUCCESS && !gnutls_error_is_fatal(ret) &&
+                 blocking.retry(ret, ec));
 
-        if (ret == GNUTLS_E_PREMATURE_TERMINATION)
+        if (ec)
+            return ec;
+        else if (ret == GNUTLS_E_PREMATURE_TERMINATION)
             return ec = error::stream_truncated;
         else if (ret != GNUTLS_E_SUCCESS)
             return ec = error_code(ret, error::get_ssl_category());
@@ -377,7 +437,8 @@ public:
     template <typename MutableBufferSequence>
     size_t read_some(const MutableBufferSequence& buffers, error_code& ec)
     {
-        if (m_impl->read_handler || !m_impl->is_handshake_done)
+        blocking_scope blocking(this, direction::read);
+        if (!blocking || m_impl->read_handler || !m_impl->is_handshake_done)
         {
             ec = boost::asio::error::operation_not_supported;
             return 0;
@@ -387,7 +448,10 @@ public:
                   buffer_sequence_end(buffers),
                   std::back_inserter(m_impl->read_buffers));
 
-        std::size_t bytes_read = m_impl->recv_some(ec);
+        std::size_t bytes_read;
+        do {
+            bytes_read = m_impl->recv_some(ec);
+        } while (ec == boost::asio::error::would_block && blocking.wait(ec));
         m_impl->read_buffers.clear();
         return bytes_read;
     }
@@ -406,7 +470,8 @@ public:
     template <typename ConstBufferSequence>
     std::size_t write_some(const ConstBufferSequence& buffers, error_code& ec)
     {
-        if (m_impl->write_handler || !m_impl->is_handshake_done)
+        blocking_scope blocking(this, direction::write);
+        if (!blocking || m_impl->write_handler || !m_impl->is_handshake_done)
         {
             ec = boost::asio::error::operation_not_supported;
             return 0;
@@ -416,11 +481,61 @@ public:
                   buffer_sequence_end(buffers),
                   std::back_inserter(m_impl->write_buffers));
 
-        std::size_t bytes_written = m_impl->send_some(ec);
+        std::size_t bytes_written;
+        do {
+            bytes_written = m_impl->send_some(ec);
+        } while (ec == boost::asio::error::would_block && blocking.wait(ec));
+
+        // Send the records accepted while corked, or leave them to the next operation if the
+        // deadline passes
+        error_code flush_ec;
+        while (!ec && !m_impl->is_holding && gnutls_record_check_corked(m_impl->session) > 0 &&
+               blocking.wait(flush_ec))
+            m_impl->send_corked(flush_ec);
+
         m_impl->write_buffers.clear();
         return bytes_written;
     }
 
+#ifndef BOOST_NO_EXCEPTIONS
+    void flush()
+    {
+        error_code ec;
+        flush(ec);
+        if (ec) boost::throw_exception(boost::system::system_error(ec));
+    }
+#endif
+
+    // Send the records held or left corked by previous writes
+    error_code flush(error_code& ec)
+    {
+        blocking_scope blocking(this, direction::write);
+        if (!blocking || m_impl->write_handler)
+            return ec = boost::asio::error::operation_not_supported;
+
+        ec.clear();
+        m_impl->is_holding = false;
+        while (gnutls_record_check_corked(m_impl->session) > 0)
+        {
+            m_impl->send_corked(ec);
+            if (ec != boost::asio::error::would_block || !blocking.wait(ec)) break;
+        }
+        return ec;
+    }
+
+    // ---------- Cancellation ----------
+
+    // Complete the pending read or write with boost::asio::error::operation_aborted and the bytes
+    // transferred so far, leaving the session usable. Records already accepted by GnuTLS are
+    // still sent, and a wait on the next layer stays pending for the next operation. Must be
+    // called from the executor of the stream, serialized with the operations in the same
+    // direction but not with those in the other one, and does nothing if no operation is pending.
+    void cancel_read() { m_impl->cancel(operation::read); }
+
+    void cancel_write() { m_impl->cancel(operation::write); }
+
+    // ----------------------------------
+
     // ---------- SNI extension ----------
 
 #ifndef BOOST_NO_EXCEPTIONS
@@ -442,36 +557,390 @@ public:
 
     // -----------------------------------
 
+    // ---------- Immediate completion ----------
+
+    // Deliver the completion of reads and writes with dispatch instead of post, so that an
+    // operation finishing within the initiating function, like a read served from plaintext
+    // already decrypted by GnuTLS, calls its handler before returning when running on the
+    // stream executor. Nesting is limited to max_completion_depth, then handlers are posted.
+    void set_immediate_completion(bool enabled) { m_immediate_completion = enabled; }
+
+    static constexpr unsigned int max_completion_depth = 16;
+
+    // ------------------------------------------
+
+    // ---------- Blocking timeout ----------
+
+    // Bound each following synchronous operation, which then fails with
+    // boost::asio::error::timed_out and may be called again, zero meaning no bound. A reactive
+    // next layer is switched to non-blocking mode for good, and synchronous operations wait for
+    // its readiness rather than spinning. Next layers without a native socket handle,
+    // like memory_pipe, only check the deadline before each wait.
+    template <typename Rep, typename Period>
+    void set_blocking_timeout(std::chrono::duration<Rep, Period> timeout)
+    {
+        using duration = std::chrono::steady_clock::duration;
+        m_blocking_timeout = std::chrono::duration_cast<duration>(timeout);
+
+        // The mode is switched here and not by each operation, as a reader and a writer may run
+        // at once
+        error_code ec;
+        if (m_blocking_timeout > duration::zero()) prepare_async(ec, is_reactive());
+    }
+
+    // --------------------------------------
+
+    // ---------- Dynamic record sizing ----------
+
+    // Send records of small_record_size bytes, which fit in a TCP segment and can be decrypted
+    // as soon as it arrives, until dynamic_record_threshold bytes were written, then records of
+    // the maximum size. Small records are used again after writing was idle for
+    // dynamic_record_idle_timeout, as the congestion window may have shrunk.
+    void set_dynamic_record_sizing(bool enabled) { m_dynamic_record_sizing = enabled; }
+
+    static constexpr std::size_t small_record_size = 1400;
+    static constexpr std::size_t dynamic_record_threshold = 128 * 1024;
+    static constexpr std::chrono::milliseconds dynamic_record_idle_timeout{1000};
+
+    // -------------------------------------------
+
+    // ---------- Write flushing ----------
+
+    // Send the corked records of a write each time limit bytes of plaintext are corked, 0 meaning
+    // no limit, so that a large write is neither copied into GnuTLS at once nor delayed until
+    // then. Only the part accepted before the next layer would block counts as written.
+    void set_cork_limit(std::size_t limit) { m_cork_limit = limit; }
+
+    static constexpr std::size_t default_cork_limit = 64 * 1024;
+
+    // Hold the records of writes until flush() or async_flush(), or until the cork limit is
+    // reached, so that small writes are coalesced into full records. Shutting down flushes.
+    void set_explicit_flush(bool enabled) { m_explicit_flush = enabled; }
+
+    // Hold the records of writes, as with explicit flush, until threshold bytes of plaintext are
+    // held or delay has passed since they started being held, so that many small writes share
+    // records and system calls. The delay runs on the executor of the stream, and if a write is
+    // sending when it passes, that write sends the held records instead. A threshold of zero
+    // disables coalescing.
+    template <typename Rep, typename Period>
+    void set_write_coalescing(std::size_t threshold, std::chrono::duration<Rep, Period> delay)
+    {
+        using duration = std::chrono::steady_clock::duration;
+        m_coalescing_threshold = threshold;
+        m_coalescing_delay = std::chrono::duration_cast<duration>(delay);
+    }
+
+    // ------------------------------------
+
+    // ---------- Write queue ----------
+
+    // Queue a message from any thread, without waiting for the writes queued before. Messages
+    // are written in order by the stream executor, as batches gathered from everything queued
+    // meanwhile and sent like async_write, so corked, held or coalesced as configured. Messages
+    // queued before the handshake are held until it is done, unless its type is not the default
+    // one of the context, which starts a new session and drops them. A write of the application
+    // still pending when the first message is queued is completed first, and the queue is
+    // handed the write direction before its handler runs; the application must not start
+    // writes of its own after that. queue_write may be called from any thread at any time,
+    // concurrently with reads, and needs no strand, even with an io_context run by several
+    // threads: the drain runs one batch at a time and takes over from the handshake and from
+    // the pending write under a lock. Once a write fails, the following messages are dropped
+    // and queue_error() returns the error.
+    void queue_write(std::string message)
+    {
+        std::unique_ptr<detail::queued_write> node(new detail::queued_write);
+        node->payload = std::move(message);
+        node->data = boost::asio::buffer(node->payload);
+        m_impl->enqueue(node.release());
+    }
+
+    // The data is not copied, owner is released once it is written or dropped, so that a
+    // message pushed to many streams may be shared
+    void queue_write(const_buffer data, std::shared_ptr<void const> owner)
+    {
+        std::unique_ptr<detail::queued_write> node(new detail::queued_write);
+        node->owner = std::move(owner);
+        node->data = data;
+        m_impl->enqueue(node.release());
+    }
+
+    // Error of the write which stopped the queue, may be called from any thread
+    error_code queue_error() const { return m_impl->get_queue_error(); }
+
+    // -----------------------------
+
+    // ---------- Handshake tracing ----------
+
+    // Record a timeline of each following handshake, see handshake_trace. Tracing installs its
+    // own handshake hook function on the session, replacing one set through native_handle(),
+    // and removes it once the handshake is done.
+    void set_handshake_tracing(bool enabled) { m_handshake_tracing = enabled; }
+
+    handshake_trace const& last_handshake_trace() const { return m_impl->trace; }
+
+    // ---------------------------------------
+
 private:
-    template <typename Handler, typename... Args> class async_callable
+    // Initiation function objects for async_initiate, the handler passed to operator() is the
+    // final completion handler and is stored without a wrapper
+    class initiate_async_handshake
     {
     public:
-        async_callable(Handler&& h)
-            : m_impl(std::make_shared<impl>(std::move(h)))
+        explicit initiate_async_handshake(stream* self)
+            : self(self)
         {}
 
-        void operator()(Args... args) const
+        executor_type get_executor() const { return self->get_executor(); }
+
+        template <typename HandshakeHandler>
+        void operator()(HandshakeHandler&& handler, handshake_type type) const
         {
-            m_impl->completion.completion_handler(std::forward<Args>(args)...);
+            // If you get an error on the following line it means that your handler does
+            // not meet the documented type requirements for a HandshakeHandler.
+            BOOST_ASIO_HANDSHAKE_HANDLER_CHECK(HandshakeHandler, handler) type_check;
+
+            auto& im = self->m_impl;
+            if (im->handshake_handler || im->is_handshake_done)
+                return self->post_completion(
+                    std::forward<HandshakeHandler>(handler),
+                    error_code(boost::asio::error::operation_not_supported));
+
+            error_code ec;
+            self->prepare_async(ec, is_reactive());
+            if (ec) return self->post_completion(std::forward<HandshakeHandler>(handler), ec);
+
+            self->ensure_impl(type);
+            im->handshake_handler.emplace(
+                std::forward<HandshakeHandler>(handler), self->get_executor());
+            im->handle_handshake();
         }
 
-        auto get_completion_result() { return m_impl->completion.result.get(); }
+    private:
+        stream* self;
+    };
+
+    class initiate_async_buffered_handshake
+    {
+    public:
+        explicit initiate_async_buffered_handshake(stream* self)
+            : self(self)
+        {}
+
+        executor_type get_executor() const { return self->get_executor(); }
+
+        template <typename BufferedHandshakeHandler>
+        void operator()(BufferedHandshakeHandler&& handler, handshake_type type) const
+        {
+            // If you get an error on the following line it means that your handler does
+            // not meet the documented type requirements for a BufferedHandshakeHandler.
+            BOOST_ASIO_BUFFERED_HANDSHAKE_HANDLER_CHECK(BufferedHandshakeHandler, handler)
+                type_check;
+
+            using wrapper = detail::buffered_handshake_handler<
+                typename std::decay<BufferedHandshakeHandler>::type>;
+            initiate_async_handshake{self}(
+                wrapper{std::forward<BufferedHandshakeHandler>(handler)}, type);
+        }
 
     private:
-        struct impl
+        stream* self;
+    };
+
+    class initiate_async_shutdown
+    {
+    public:
+        explicit initiate_async_shutdown(stream* self)
+            : self(self)
+        {}
+
+        executor_type get_executor() const { return self->get_executor(); }
+
+        template <typename ShutdownHandler> void operator()(ShutdownHandler&& handler) const
         {
-            impl(Handler&& h)
-                : handler(std::move(h))
-                , completion(handler)
-            {}
+            // If you get an error on the following line it means that your handler does
+            // not meet the documented type requirements for a ShutdownHandler.
+            BOOST_ASIO_SHUTDOWN_HANDLER_CHECK(ShutdownHandler, handler) type_check;
 
-            Handler handler;
-            boost::asio::async_completion<Handler, void(Args...)> completion;
-        };
+            auto& im = self->m_impl;
+            if (im->shutdown_handler || !im->is_handshake_done)
+                return self->post_completion(
+                    std::forward<ShutdownHandler>(handler),
+                    error_code(boost::asio::error::operation_not_supported));
+
+            error_code ec;
+            self->prepare_async(ec, is_reactive());
+            if (ec) return self->post_completion(std::forward<ShutdownHandler>(handler), ec);
+
+            im->abort();
+            im->shutdown_handler.emplace(
+                std::forward<ShutdownHandler>(handler), self->get_executor());
+            im->handle_shutdown();
+        }
+
+    private:
+        stream* self;
+    };
 
-        std::shared_ptr<impl> m_impl;
+    class initiate_async_read_some
+    {
+    public:
+        explicit initiate_async_read_some(stream* self)
+            : self(self)
+        {}
+
+        executor_type get_executor() const { return self->get_executor(); }
+
+        template <typename ReadHandler, typename MutableBufferSequence>
+        void operator()(ReadHandler&& handler, const MutableBufferSequence& buffers) const
+        {
+            // If you get an error on the following line it means that your handler does
+            // not meet the documented type requirements for a ReadHandler.
+            BOOST_ASIO_READ_HANDLER_CHECK(ReadHandler, handler) type_check;
+
+            auto& im = self->m_impl;
+            if (im->read_handler)
+            {
+                error_code const ec = boost::asio::error::operation_not_supported;
+                return self->post_completion(
+                    std::forward<ReadHandler>(handler), ec, std::size_t(0));
+            }
+
+            error_code ec;
+            self->prepare_async(ec, is_reactive());
+            if (ec)
+                return self->post_completion(
+                    std::forward<ReadHandler>(handler), ec, std::size_t(0));
+
+            std::size_t bytes_added = 0;
+            for (auto b = buffer_sequence_begin(buffers), end(buffer_sequence_end(buffers));
+                 b != end;
+                 ++b)
+            {
+                auto r = *b; // operator -> might be deleted
+                if (r.size() == 0) continue;
+                im->read_buffers.push_back(r);
+                bytes_added += r.size();
+            }
+
+            // if we're reading 0 bytes, post handler immediately
+            if (bytes_added == 0)
+                return self->post_completion(
+                    std::forward<ReadHandler>(handler), error_code(), std::size_t(0));
+
+            im->read_handler.emplace(std::forward<ReadHandler>(handler), self->get_executor());
+            im->bytes_read = 0;
+            im->async_schedule(direction::read);
+        }
+
+    private:
+        stream* self;
     };
 
+    class initiate_async_write_some
+    {
+    public:
+        // With all, the operation completes once every buffer is written
+        explicit initiate_async_write_some(stream* self, bool all = false)
+            : self(self)
+            , all(all)
+        {}
+
+        executor_type get_executor() const { return self->get_executor(); }
+
+        template <typename WriteHandler, typename ConstBufferSequence>
+        void operator()(WriteHandler&& handler, const ConstBufferSequence& buffers) const
+        {
+            // If you get an error on the following line it means that your handler does
+            // not meet the documented type requirements for a WriteHandler.
+            BOOST_ASIO_WRITE_HANDLER_CHECK(WriteHandler, handler) type_check;
+
+            auto& im = self->m_impl;
+            if (im->write_handler)
+            {
+                error_code const ec = boost::asio::error::operation_not_supported;
+                return self->post_completion(
+                    std::forward<WriteHandler>(handler), ec, std::size_t(0));
+            }
+
+            error_code ec;
+            self->prepare_async(ec, is_reactive());
+            if (ec)
+                return self->post_completion(
+                    std::forward<WriteHandler>(handler), ec, std::size_t(0));
+
+            size_t bytes_added = 0;
+            for (auto b = buffer_sequence_begin(buffers), end(buffer_sequence_end(buffers));
+                 b != end;
+                 ++b)
+            {
+                auto r = *b; // operator -> might be deleted
+                if (r.size() == 0) continue;
+                im->write_buffers.push_back(r);
+                bytes_added += r.size();
+            }
+
+            // if we're writing 0 bytes, post handler immediately
+            if (bytes_added == 0)
+                return self->post_completion(
+                    std::forward<WriteHandler>(handler), error_code(), std::size_t(0));
+
+            im->write_handler.emplace(std::forward<WriteHandler>(handler), self->get_executor());
+            im->bytes_written = 0;
+            im->is_writing_all = all;
+            im->async_schedule(direction::write);
+        }
+
+    private:
+        stream* self;
+        bool all;
+    };
+
+    // A flush is a write without buffers, so that it is ordered with the other writes
+    class initiate_async_flush
+    {
+    public:
+        explicit initiate_async_flush(stream* self)
+            : self(self)
+        {}
+
+        executor_type get_executor() const { return self->get_executor(); }
+
+        template <typename FlushHandler> void operator()(FlushHandler&& handler) const
+        {
+            auto& im = self->m_impl;
+            if (im->write_handler)
+                return self->post_completion(
+                    std::forward<FlushHandler>(handler),
+                    error_code(boost::asio::error::operation_not_supported));
+
+            error_code ec;
+            self->prepare_async(ec, is_reactive());
+            if (ec) return self->post_completion(std::forward<FlushHandler>(handler), ec);
+
+            im->is_holding = false;
+            if (gnutls_record_check_corked(im->session) == 0)
+                return self->post_completion(std::forward<FlushHandler>(handler), error_code());
+
+            using wrapper =
+                detail::flush_write_handler<typename std::decay<FlushHandler>::type>;
+            im->write_handler.emplace(
+                wrapper{std::forward<FlushHandler>(handler)}, self->get_executor());
+            im->bytes_written = 0;
+            im->is_writing_all = false;
+            im->async_schedule(direction::write);
+        }
+
+    private:
+        stream* self;
+    };
+
+    template <typename Handler, typename... Values>
+    void post_completion(Handler&& handler, Values&&... values)
+    {
+        detail::deliver(
+            get_executor(), false, std::forward<Handler>(handler), std::forward<Values>(values)...);
+    }
+
     enum class direction
     {
         none,
@@ -479,116 +948,455 @@ private:
         write
     };
 
-    next_layer_type m_next_layer;
-    verify_mode m_verify = -1;
-    std::function<bool(bool preverified, verify_context& ctx)> m_verify_callback;
-    unsigned int m_tls_version; // X*10 + Y => TLS X.Y, 0*10 + Z => SSL Z
+    enum class operation
+    {
+        handshake,
+        shutdown,
+        read,
+        write
+    };
+
+    using is_reactive =
+        detail::is_reactive_layer<typename std::remove_reference<next_layer_type>::type>;
 
-    struct impl : public std::enable_shared_from_this<impl>
+    // Ciphertext buffering for non-reactive next layers
+    static constexpr std::size_t input_buffer_size = 17 * 1024; // a maximum-size record
+    static constexpr std::size_t output_buffer_limit = 64 * 1024;
+
+    // Only set once, as a reader and a writer on two threads may both prepare
+    void prepare_async(error_code& ec, std::true_type)
     {
-        impl(stream* p, handshake_type t)
-            : type(t)
-            , parent(p)
+        ec.clear();
+        if (!m_next_layer.non_blocking()) m_next_layer.non_blocking(true, ec);
+    }
+    void prepare_async(error_code& ec, std::false_type) { ec.clear(); }
+
+    struct impl;
+
+    // Marks the transport calls of a synchronous operation as allowed to block. When GnuTLS
+    // would block on a reactive next layer in non-blocking mode, the operation waits for
+    // readiness until its deadline instead of spinning.
+    struct blocking_scope
+    {
+        using clock = std::chrono::steady_clock;
+
+        // Operations in one direction may run on another thread, a second operation in the same
+        // direction is refused. The handshake and shutdown take both directions.
+        explicit blocking_scope(stream* s, direction d = direction::none)
+            : s(s)
+            , im(s->m_impl)
+        {
+            bool const read_busy = d != direction::write && im->is_blocking_read.exchange(true);
+            reading = d != direction::write && !read_busy;
+            bool const write_busy = d != direction::read && im->is_blocking_write.exchange(true);
+            writing = d != direction::read && !write_busy;
+            if (read_busy || write_busy)
+            {
+                release();
+                return;
+            }
+
+            // With a deadline, no call to the next layer may block past it. The next layer is
+            // normally made non-blocking when the timeout is set, unless it was not open then.
+            if (s->m_blocking_timeout > clock::duration::zero())
+            {
+                deadline = clock::now() + s->m_blocking_timeout;
+                error_code ec;
+                s->prepare_async(ec, is_reactive());
+            }
+        }
+
+        ~blocking_scope() { release(); }
+
+        explicit operator bool() const { return reading || writing; }
+
+        // Whether to call GnuTLS again after it returned ret, waiting first if it would block
+        bool retry(int ret, error_code& ec) { return ret != GNUTLS_E_AGAIN || wait(ec); }
+
+        // Wait for the direction GnuTLS is blocked on, returns false with ec set on failure
+        bool wait(error_code& ec)
         {
-            int ret = gnutls_init(
-                &session, (type == client ? GNUTLS_CLIENT : GNUTLS_SERVER) | GNUTLS_NONBLOCK);
-            if (ret != GNUTLS_E_SUCCESS)
-                throw std::runtime_error("gnutls_init failed: " +
-                                         std::string(gnutls_strerror(ret)));
+            wait(ec, is_reactive());
+            return !ec;
+        }
+
+    private:
+        using layer_type = typename std::remove_reference<next_layer_type>::type;
+
+        void wait(error_code& ec, std::true_type)
+        {
+            auto const type =
+                detail::blocked_direction() == 0 ? layer_type::wait_read : layer_type::wait_write;
+            detail::wait_ready(
+                s->m_next_layer, type, deadline, ec, detail::has_native_socket<layer_type>());
+        }
+
+        // Buffered next layers block in their own synchronous operations, GnuTLS only blocks
+        // while the output of an asynchronous operation is being flushed
+        void wait(error_code& ec, std::false_type) { ec = boost::asio::error::would_block; }
+
+        void release()
+        {
+            if (std::exchange(reading, false)) im->is_blocking_read = false;
+            if (std::exchange(writing, false)) im->is_blocking_write = false;
+        }
+
+        stream* s;
+        std::shared_ptr<impl> im;
+        bool reading = false;
+        bool writing = false;
+        clock::time_point deadline; // epoch if none
+    };
+
+    next_layer_type m_next_layer;
+    bool m_handshake_tracing = false;
+    bool m_immediate_completion = false;
+    std::chrono::steady_clock::duration m_blocking_timeout{};
+    bool m_dynamic_record_sizing = false;
+    std::size_t m_cork_limit = default_cork_limit;
+    bool m_explicit_flush = false;
+    std::size_t m_coalescing_threshold = 0;
+    std::chrono::steady_clock::duration m_coalescing_delay{};
+
+    struct impl : public detail::tls_session, public std::enable_shared_from_this<impl>
+    {
+        using clock = std::chrono::steady_clock;
 
-            gnutls_session_set_ptr(session, this);
-            gnutls_handshake_set_post_client_hello_function(session, post_client_hello_func);
+        using timer_type = boost::asio::
+            basic_waitable_timer<clock, boost::asio::wait_traits<clock>, executor_type>;
 
+        impl(stream* p, handshake_type t)
+            : tls_session(p, t)
+            , executor(p->get_executor())
+            , coalescing_timer(executor)
+        {
             gnutls_transport_set_ptr(session, this);
             gnutls_transport_set_push_function(session, push_func);
             gnutls_transport_set_pull_function(session, pull_func);
+        }
 
-            auto context_impl = parent->m_context_impl;
-            auto const opts = context_impl->opts;
-            auto const tls_version = parent->m_tls_version;
+        ~impl()
+        {
+            release_queued(queue_batch);
+            release_queued(queue_head.exchange(nullptr));
+        }
+
+        stream* parent() const { return static_cast<stream*>(owner); }
 
-            std::ostringstream priority;
-            priority << "NORMAL";
-            if (opts & context::default_workarounds) priority << ":%COMPAT";
-            if (tls_version > 0 && tls_version < 10 && !(opts & context::no_sslv3))
-                priority << ":+VERS-SSL3.0";
-            if (tls_version >= 10)
-                priority << ":-VERS-TLS-ALL:+VERS-TLS" << (tls_version / 10) << '.'
-                         << (tls_version % 10);
+        template <typename... Args, typename... Values>
+        void post(detail::handler_slot<executor_type, Args...>& handler, Values&&... values)
+        {
+            if (owner)
+                handler.complete(parent()->get_executor(), false, std::forward<Values>(values)...);
+        }
+
+        // Complete a read or write, see set_immediate_completion
+        template <typename... Args, typename... Values>
+        void complete(unsigned int& depth,
+                      detail::handler_slot<executor_type, Args...>& handler,
+                      Values&&... values)
+        {
+            if (!owner) return;
+            if (!parent()->m_immediate_completion || depth >= max_completion_depth)
+                return post(handler, std::forward<Values>(values)...);
+
+            auto self = this->shared_from_this(); // the handler may destroy the stream
+            ++depth;
+            handler.complete(parent()->get_executor(), true, std::forward<Values>(values)...);
+            --depth;
+        }
+
+        void abort()
+        {
+            error_code const ec = boost::asio::error::operation_aborted;
+            if (handshake_handler)
+            {
+                handshake_finished(ec);
+                post(handshake_handler, ec);
+            }
+            if (shutdown_handler) post(shutdown_handler, ec);
+            if (read_handler) post(read_handler, ec, std::size_t(0));
+            if (write_handler) post(write_handler, ec, std::size_t(0));
+            if (shutdown_output_handler) post(shutdown_output_handler, ec);
+            if (take_queue_waiting()) handle_queue_write(ec);
+            coalescing_timer.cancel();
+        }
+
+        // Complete a pending operation with operation_aborted
+        void cancel(operation op)
+        {
+            namespace error = boost::asio::error;
+
+            switch (op)
+            {
+            case operation::handshake:
+                if (!handshake_handler) return;
+                want_direction = direction::none;
+                handshake_finished(error::operation_aborted);
+                post(handshake_handler, error_code(error::operation_aborted));
+                break;
+
+            case operation::shutdown:
+                if (!shutdown_handler && !shutdown_output_handler) return;
+                want_direction = direction::none;
+                post(shutdown_handler ? shutdown_handler : shutdown_output_handler,
+                     error_code(error::operation_aborted));
+                break;
+
+            case operation::read:
+                if (!read_handler) return;
+                read_buffers.clear();
+                post(read_handler,
+                     error_code(error::operation_aborted),
+                     std::exchange(bytes_read, std::size_t(0)));
+                break;
+
+            case operation::write:
+                // Records already accepted by GnuTLS are still sent
+                if (!write_handler) return;
+                write_buffers.clear();
+                {
+                    auto handler = release_write_handler();
+                    post(handler,
+                         error_code(error::operation_aborted),
+                         std::exchange(bytes_written, std::size_t(0)));
+                }
+                break;
+            }
+        }
+
+        bool want_read() const { return want_direction == direction::read || read_handler; }
+        bool want_write() const
+        {
+            return want_direction == direction::write || write_handler ||
+                   (!is_holding && gnutls_record_check_corked(session) > 0);
+        }
+
+        // Reads and writes only schedule their own direction, so that a reader and a writer may
+        // run on two threads, while the handshake and shutdown schedule both
+        void async_schedule(direction d = direction::none)
+        {
+            if (!owner) return;
+            auto self = this->shared_from_this(); // completions may destroy the stream
+            if (d != direction::write) schedule_read(is_reactive());
+            if (!owner) return;                   // destroyed by an immediate completion
+            if (d != direction::read) schedule_write(is_reactive());
+        }
+
+        void schedule_read(std::true_type)
+        {
+            constexpr auto wait_read = std::remove_reference<next_layer_type>::type::wait_read;
+
+            // Start a read operation if GnuTLS wants one
+            if (want_read() && !std::exchange(is_reading, true))
+            {
+                if (gnutls_record_check_pending(session) > 0 && read_handler)
+                    handle_read();
+                else
+                    parent()->m_next_layer.async_wait(wait_read,
+                                                      std::bind(&impl::handle_read,
+                                                                this->shared_from_this(),
+                                                                std::placeholders::_1));
+            }
+        }
+
+        void schedule_write(std::true_type)
+        {
+            constexpr auto wait_write = std::remove_reference<next_layer_type>::type::wait_write;
+
+            // Start a write operation if GnuTLS wants one
+            if (want_write() && !std::exchange(is_writing, true))
+            {
+                auto& next_layer = parent()->m_next_layer;
+                next_layer.async_wait(wait_write,
+                                      std::bind(&impl::handle_write,
+                                                this->shared_from_this(),
+                                                std::placeholders::_1));
+            }
+        }
+
+        void schedule_read(std::false_type)
+        {
+            // Read ciphertext if GnuTLS wants some and nothing is buffered
+            if (want_read() && !std::exchange(is_reading, true))
+            {
+                if (input_begin < input_end ||
+                    (gnutls_record_check_pending(session) > 0 && read_handler))
+                {
+                    handle_read();
+                }
+                else
+                {
+                    if (input.empty()) input.resize(input_buffer_size);
+                    input_begin = input_end = 0;
+                    parent()->m_next_layer.async_read_some(
+                        boost::asio::buffer(input),
+                        std::bind(&impl::handle_input,
+                                  this->shared_from_this(),
+                                  std::placeholders::_1,
+                                  std::placeholders::_2));
+                }
+            }
+        }
 
-            char const* err_pos = nullptr;
-            ret = gnutls_priority_set_direct(session, priority.str().c_str(), &err_pos);
-            if (ret != GNUTLS_E_SUCCESS)
-                throw std::runtime_error("gnutls_priority_set_direct failed for \"" +
-                                         priority.str() +
-                                         "\": " + std::string(gnutls_strerror(ret)));
+        void schedule_write(std::false_type)
+        {
+            // Let GnuTLS write as long as there is room in the output buffers
+            if (want_write() && !std::exchange(is_writing, true))
+            {
+                if (buffered_output() < output_buffer_limit) handle_write();
+            }
+        }
 
-            gnutls_certificate_set_verify_function(context_impl->cred, verify_func);
-            ret = gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, context_impl->cred);
-            if (ret != GNUTLS_E_SUCCESS)
-                throw std::runtime_error("gnutls_credentials_set failed: " +
-                                         std::string(gnutls_strerror(ret)));
+        void handle_input(error_code ec, std::size_t bytes)
+        {
+            input_end = bytes;
+            if (ec && ec != boost::asio::error::operation_aborted)
+            {
+                input_error = ec; // reported by pull_func once the input is drained
+                ec.clear();
+            }
+            handle_read(ec);
         }
 
-        ~impl() { gnutls_deinit(session); }
+        std::size_t buffered_output() const
+        {
+            return (output_flight.size() - output_flight_pos) + output_pending.size();
+        }
 
-        template <typename Function> void post(Function&& function) const
+        // Send buffered ciphertext, one async_write_some at a time
+        void flush()
         {
-            if (parent) boost::asio::post(parent->get_executor(), std::forward<Function>(function));
+            if (!owner || is_flushing || output_error) return;
+
+            if (output_flight_pos == output_flight.size())
+            {
+                retire_flight();
+                std::swap(output_flight, output_pending);
+            }
+            if (output_flight.empty()) return;
+
+            is_flushing = true;
+            parent()->m_next_layer.async_write_some(
+                boost::asio::buffer(output_flight.data() + output_flight_pos,
+                                    output_flight.size() - output_flight_pos),
+                std::bind(&impl::handle_flush,
+                          this->shared_from_this(),
+                          std::placeholders::_1,
+                          std::placeholders::_2));
         }
 
-        void abort()
+        // Empty the sent flight
+        void retire_flight()
         {
-            if (auto handler = std::exchange(handshake_handler, nullptr))
-                handler(boost::asio::error::operation_aborted);
-            if (auto handler = std::exchange(shutdown_handler, nullptr))
-                handler(boost::asio::error::operation_aborted);
-            if (auto handler = std::exchange(read_handler, nullptr))
-                handler(boost::asio::error::operation_aborted, std::size_t(0));
-            if (auto handler = std::exchange(write_handler, nullptr))
-                handler(boost::asio::error::operation_aborted, std::size_t(0));
+            output_flight.clear();
+            output_flight_pos = 0;
         }
 
-        std::string get_server_name() const
+        void handle_flush(error_code ec, std::size_t bytes)
         {
-            char buf[256];
-            size_t len = sizeof(buf);
-            unsigned int type = GNUTLS_NAME_DNS;
-            int ret = gnutls_server_name_get(session, buf, &len, &type, 0);
-            return ret == GNUTLS_E_SUCCESS ? std::string(buf, len) : "";
+            is_flushing = false;
+            output_flight_pos += bytes;
+            if (ec)
+            {
+                output_error = ec; // reported by push_func
+                retire_flight();
+                output_pending.clear();
+            }
+            else
+            {
+                flush();
+            }
+
+            if (buffered_output() == 0)
+                if (shutdown_output_handler) post(shutdown_output_handler, ec);
+
+            // Resume GnuTLS if it was waiting for room in the output buffers
+            if (is_writing && (ec || buffered_output() < output_buffer_limit))
+                handle_write(ec == boost::asio::error::operation_aborted ? ec : error_code());
         }
 
-        bool want_read() const { return want_direction == direction::read || read_handler; }
-        bool want_write() const { return want_direction == direction::write || write_handler; }
+        // Buffered transport functions, called by pull_func and push_func. A synchronous
+        // operation in either direction reads and writes through, since a reader and a writer
+        // on two threads are only supported over reactive next layers.
+        bool is_blocking() const { return is_blocking_read || is_blocking_write; }
 
-        void async_schedule()
+        std::size_t transport_read(void* data, std::size_t size, error_code& ec, std::false_type)
         {
-            constexpr auto wait_read = std::remove_reference<next_layer_type>::type::wait_read;
-            constexpr auto wait_write = std::remove_reference<next_layer_type>::type::wait_write;
+            if (input_begin < input_end)
+            {
+                std::size_t const n = std::min(size, input_end - input_begin);
+                std::memcpy(data, input.data() + input_begin, n);
+                input_begin += n;
+                ec.clear();
+                return n;
+            }
 
-            if (!parent) return;
-            auto& next_layer = parent->m_next_layer;
+            if (input_error)
+            {
+                ec = input_error;
+                return 0;
+            }
 
-            // Start a read operation if GnuTLS wants one
-            if (want_read() && !std::exchange(is_reading, true))
+            if (is_blocking()) return parent()->m_next_layer.read_some(buffer(data, size), ec);
+
+            ec = boost::asio::error::would_block;
+            return 0;
+        }
+
+        std::size_t
+        transport_write(const void* data, std::size_t size, error_code& ec, std::false_type)
+        {
+            if (output_error)
             {
-                if (gnutls_record_check_pending(session) > 0 && read_handler)
-                    handle_read();
-                else
-                    next_layer.async_wait(wait_read,
-                                          std::bind(&impl::handle_read,
-                                                    this->shared_from_this(),
-                                                    std::placeholders::_1));
+                ec = output_error;
+                return 0;
             }
 
-            // Start a write operation if GnuTLS wants one
-            if (want_write() && !std::exchange(is_writing, true))
+            if (is_blocking())
             {
-                next_layer.async_wait(wait_write,
-                                      std::bind(&impl::handle_write,
-                                                this->shared_from_this(),
-                                                std::placeholders::_1));
+                // Write through, after what a previous asynchronous operation left behind
+                if (is_flushing)
+                {
+                    ec = boost::asio::error::would_block;
+                    return 0;
+                }
+                boost::asio::write(
+                    parent()->m_next_layer,
+                    std::array<const_buffer, 2>{
+                        boost::asio::buffer(output_flight.data() + output_flight_pos,
+                                            output_flight.size() - output_flight_pos),
+                        boost::asio::buffer(output_pending)},
+                    ec);
+                retire_flight();
+                output_pending.clear();
+                if (ec) return 0;
+                return parent()->m_next_layer.write_some(const_buffer(data, size), ec);
             }
+
+            if (buffered_output() >= output_buffer_limit)
+            {
+                ec = boost::asio::error::would_block;
+                return 0;
+            }
+
+            auto const* begin = static_cast<const char*>(data);
+            output_pending.insert(output_pending.end(), begin, begin + size);
+            flush();
+            ec.clear();
+            return size;
+        }
+
+        // Reactive transport functions, the next layer is in non-blocking mode for async operations
+        std::size_t transport_read(void* data, std::size_t size, error_code& ec, std::true_type)
+        {
+            return parent()->m_next_layer.read_some(buffer(data, size), ec);
+        }
+
+        std::size_t
+        transport_write(const void* data, std::size_t size, error_code& ec, std::true_type)
+        {
+            return parent()->m_next_layer.write_some(const_buffer(data, size), ec);
         }
 
         void handle_read(error_code ec = {})
@@ -600,11 +1408,14 @@ private:
             {
                 if (!ec) bytes_read += recv_some(ec);
 
-                if (ec == error::try_again || ec == error::would_block) return async_schedule();
+                if (ec == error::try_again || ec == error::would_block)
+                    return async_schedule(direction::read);
 
                 read_buffers.clear();
-                auto handler = std::exchange(read_handler, nullptr);
-                post(std::bind(std::move(handler), ec, std::exchange(bytes_read, std::size_t(0))));
+                complete(detail::completion_depth(0),
+                         read_handler,
+                         ec,
+                         std::exchange(bytes_read, std::size_t(0)));
                 return;
             }
 
@@ -621,23 +1432,46 @@ private:
             {
                 if (!ec) bytes_written += send_some(ec);
 
-                if (ec == error::try_again || ec == error::would_block) return async_schedule();
-
+                // Records left corked by an interrupted uncork are sent before completing, as
+                // the handler may start the next write on another thread. A partial write stops.
+                bool const blocked = ec == error::try_again || ec == error::would_block;
+                bool const leftover =
+                    !ec && !is_holding && gnutls_record_check_corked(session) > 0;
+                if (leftover && !is_writing_all) write_buffers.clear();
+                if (blocked || leftover || (!ec && is_writing_all && !write_buffers.empty()))
+                    return async_schedule(direction::write);
+
+                // The handler may start the next write on another thread, so the state is left
+                // alone unless a handshake or shutdown waits for the write
                 write_buffers.clear();
-                auto handler = std::exchange(write_handler, nullptr);
-                post(std::bind(
-                    std::move(handler), ec, std::exchange(bytes_written, std::size_t(0))));
+                bool const waited = handshake_handler || shutdown_handler;
+                auto handler = release_write_handler();
+                complete(detail::completion_depth(1),
+                         handler,
+                         ec,
+                         std::exchange(bytes_written, std::size_t(0)));
+                if (!waited) return;
+            }
+            else if (!ec && !is_holding && gnutls_record_check_corked(session) > 0)
+            {
+                // Send the records left over by a completed write
+                send_corked(ec);
+                if (ec == error::try_again || ec == error::would_block)
+                    return async_schedule(direction::write);
             }
 
             if (handshake_handler) return handle_handshake(ec);
             if (shutdown_handler) return handle_shutdown(ec);
+            if (!ec && !is_holding && gnutls_record_check_corked(session) > 0)
+                async_schedule(direction::write);
         }
 
         void handle_handshake(error_code ec = {})
         {
+            handshake_started();
             if (!ec)
             {
-                int ret = gnutls_handshake(session);
+                int ret = call_handshake();
                 if (ret == GNUTLS_E_AGAIN)
                 {
                     want_direction = gnutls_record_get_direction(session) == 0 ? direction::read
@@ -647,18 +1481,81 @@ private:
 
                 want_direction = direction::none;
                 if (ret == GNUTLS_E_SUCCESS)
-                    is_handshake_done = true;
+                    resume_held_queue();
                 else if (ret == GNUTLS_E_PREMATURE_TERMINATION)
                     ec = error::stream_truncated;
                 else
                     ec = error_code(ret, error::get_ssl_category());
             }
 
-            if (handshake_handler != nullptr)
+            handshake_finished(ec);
+            if (handshake_handler) post(handshake_handler, ec);
+        }
+
+        void handshake_started()
+        {
+            if (!owner || handshake_start != clock::time_point()) return;
+
+            handshake_start = clock::now();
+            parent()->m_context_impl->metrics.handshake_started();
+            BOOST_ASIO_GNUTLS_PROBE1(handshake__start, session);
+
+            // The hook function is only touched when tracing, so that a hook set by the
+            // application through native_handle() is left in place otherwise
+            is_tracing = parent()->m_handshake_tracing;
+            if (is_tracing)
+            {
+                trace = handshake_trace();
+                trace.start = handshake_start;
+                gnutls_handshake_set_hook_function(
+                    session, GNUTLS_HANDSHAKE_ANY, GNUTLS_HOOK_BOTH, hook_func);
+            }
+        }
+
+        void handshake_finished(error_code const& ec)
+        {
+            auto const start = std::exchange(handshake_start, clock::time_point());
+            if (!owner || start == clock::time_point()) return;
+
+            BOOST_ASIO_GNUTLS_PROBE2(handshake__done, session, ec.value());
+            if (std::exchange(is_tracing, false))
+            {
+                trace.total = clock::now() - start;
+                trace.result = ec;
+
+                // Post-handshake messages would be appended by the reader without bound
+                gnutls_handshake_set_hook_function(
+                    session, GNUTLS_HANDSHAKE_ANY, GNUTLS_HOOK_BOTH, nullptr);
+            }
+
+            bool const resumed = !ec && gnutls_session_is_resumed(session) != 0;
+            parent()->m_context_impl->metrics.handshake_finished(ec, resumed, clock::now() - start);
+        }
+
+        int call_handshake()
+        {
+            int ret;
+            if (is_tracing)
+            {
+                auto const begin = clock::now();
+                auto const transport_before = transport_time;
+                ret = gnutls_handshake(session);
+                trace.processing += (clock::now() - begin) - (transport_time - transport_before);
+                if (ret == GNUTLS_E_AGAIN)
+                {
+                    if (gnutls_record_get_direction(session) == 0)
+                        ++trace.read_waits;
+                    else
+                        ++trace.write_waits;
+                }
+            }
+            else
             {
-                auto handler = std::exchange(handshake_handler, nullptr);
-                post(std::bind(std::move(handler), ec));
+                ret = gnutls_handshake(session);
             }
+
+            BOOST_ASIO_GNUTLS_PROBE2(handshake__step, session, ret);
+            return ret;
         }
 
         bool is_safe_renegotiation_enabled()
@@ -668,6 +1565,18 @@ private:
 
         void handle_shutdown(error_code ec = {})
         {
+            if (!ec && gnutls_record_check_corked(session) > 0)
+            {
+                // close_notify is not corked, held records must be sent before
+                is_holding = false;
+                send_corked(ec);
+                if (ec == boost::asio::error::would_block)
+                {
+                    want_direction = direction::write;
+                    return async_schedule();
+                }
+            }
+
             if (!ec)
             {
                 int ret = gnutls_bye(session, GNUTLS_SHUT_RDWR);
@@ -685,8 +1594,10 @@ private:
                     ec = error_code(ret, error::get_ssl_category());
             }
 
-            auto handler = std::exchange(shutdown_handler, nullptr);
-            post(std::bind(std::move(handler), ec));
+            // Deliver the close_notify alert before completing
+            shutdown_output_handler = std::exchange(shutdown_handler, nullptr);
+            if (!ec && buffered_output() > 0 && !output_error) return;
+            post(shutdown_output_handler, ec);
         }
 
         std::size_t recv_some(error_code& ec)
@@ -720,30 +1631,325 @@ private:
 
                 front += ret;
                 bytes_read += ret;
-                if (front.size() == 0) read_buffers.pop_front();
+                if (front.size() == 0) read_buffers.erase(read_buffers.begin());
 
                 if (gnutls_record_check_pending(session) == 0) break;
             }
 
-            if (bytes_read > 0) ec.clear();
+            if (bytes_read > 0)
+            {
+                ec.clear();
+                if (owner) parent()->m_context_impl->metrics.bytes_read(bytes_read);
+            }
+
+            BOOST_ASIO_GNUTLS_PROBE3(recv__some, session, bytes_read, ec.value());
 
             return bytes_read;
         }
 
+        // Plaintext accepted while corked counts as written: if uncorking is interrupted, the
+        // remaining records are sent by the following calls to uncork()
+        // A call without buffers, from async_flush(), only sends the corked records
         std::size_t send_some(error_code& ec)
         {
+            std::size_t const coalescing_threshold = owner ? parent()->m_coalescing_threshold : 0;
+            std::size_t const cork_limit = owner ? parent()->m_cork_limit : 0;
+            std::size_t hold_limit = coalescing_threshold > 0
+                                         ? coalescing_threshold
+                                         : std::numeric_limits<std::size_t>::max();
+            if (cork_limit > 0) hold_limit = std::min(hold_limit, cork_limit);
+            bool const hold = !write_buffers.empty() && owner &&
+                              (parent()->m_explicit_flush || coalescing_threshold > 0);
+            std::size_t record_size = small_record_limit();
+            std::size_t bytes_written = 0;
+            bool blocked = false;
+
+            send_scope scope(*this);
+            is_holding = false;
             gnutls_record_cork(session);
-            while (!write_buffers.empty())
+            auto next = write_buffers.begin(); // consumed buffers are erased at once
+            while (next != write_buffers.end())
             {
-                auto& front = write_buffers.front();
-                int ret = gnutls_record_send(session, front.data(), front.size());
-                if (ret < 0) break;
+                // GnuTLS fills records to the maximum size while corked, so each small record
+                // is sent by uncorking, as are the records once the cork limit is reached
+                std::size_t const limit = record_size > 0 ? record_size : cork_limit;
+                std::size_t const corked = gnutls_record_check_corked(session);
+                if (limit > 0 && corked >= limit)
+                {
+                    uncork(ec);
+                    if ((blocked = bool(ec))) break;
+                    if (warmup_bytes + bytes_written >= dynamic_record_threshold) record_size = 0;
+                    gnutls_record_cork(session);
+                    continue;
+                }
+
+                auto& front = *next;
+                std::size_t const length =
+                    limit > 0 ? std::min(front.size(), limit - corked) : front.size();
+                int ret = gnutls_record_send(session, front.data(), length);
+                if (ret < 0)
+                {
+                    // Reported once the plaintext accepted before is counted as written
+                    if (gnutls_error_is_fatal(ret))
+                    {
+                        ec = error_code(ret, error::get_ssl_category());
+                        blocked = true;
+                    }
+                    break;
+                }
 
                 front += ret;
-                if (front.size() == 0) write_buffers.pop_front();
+                bytes_written += ret;
+                if (front.size() == 0) ++next;
             }
+            write_buffers.erase(write_buffers.begin(), next);
 
-            std::size_t bytes_written = 0;
+            std::size_t const corked = blocked ? 0 : gnutls_record_check_corked(session);
+            if (hold && !blocked && corked < hold_limit)
+                hold_records(corked);
+            else if (!blocked)
+                uncork(ec);
+            warmup_bytes += bytes_written;
+
+            if (bytes_written > 0)
+            {
+                ec.clear();
+                if (owner) parent()->m_context_impl->metrics.bytes_written(bytes_written);
+            }
+
+            BOOST_ASIO_GNUTLS_PROBE3(send__some, session, bytes_written, ec.value());
+
+            return bytes_written;
+        }
+
+        void hold_records(std::size_t corked)
+        {
+            is_holding = corked > 0;
+            if (!is_holding || parent()->m_coalescing_threshold == 0 || is_coalescing) return;
+
+            is_coalescing = true;
+            coalescing_timer.expires_after(parent()->m_coalescing_delay);
+            coalescing_timer.async_wait(std::bind(
+                &impl::handle_coalescing, this->shared_from_this(), std::placeholders::_1));
+        }
+
+        // Held by the writer while it calls GnuTLS to send. The coalescing timer runs on any
+        // thread, so it only sends when the lock is free, and otherwise leaves the records held
+        // for too long to the writer, which sends them as it releases the lock.
+        struct send_scope
+        {
+            explicit send_scope(impl& im)
+                : im(im)
+                , lock(im.send_mutex)
+            {}
+
+            ~send_scope()
+            {
+                lock.unlock();
+                if (im.is_hold_due) im.send_due();
+            }
+
+            impl& im;
+            std::unique_lock<std::recursive_mutex> lock;
+        };
+
+        void send_corked(error_code& ec)
+        {
+            send_scope scope(*this);
+            uncork(ec);
+        }
+
+        // Send the records held for longer than the coalescing delay
+        void handle_coalescing(error_code ec)
+        {
+            if (ec || !owner) return;
+            is_hold_due = true;
+            send_due();
+        }
+
+        void send_due()
+        {
+            std::unique_lock<std::recursive_mutex> lock(send_mutex, std::try_to_lock);
+            if (!lock || !is_hold_due.exchange(false)) return;
+
+            is_coalescing = false;
+            if (!owner || !is_holding.exchange(false)) return;
+
+            error_code ec;
+            uncork(ec);
+            lock.unlock();
+            if (ec == boost::asio::error::would_block) wait_corked(is_reactive());
+        }
+
+        // The records left corked are sent once the next layer is writable, unless the writer
+        // sends them first
+        void wait_corked(std::true_type)
+        {
+            constexpr auto wait_write = std::remove_reference<next_layer_type>::type::wait_write;
+            parent()->m_next_layer.async_wait(wait_write,
+                                              std::bind(&impl::handle_corked,
+                                                        this->shared_from_this(),
+                                                        std::placeholders::_1));
+        }
+
+        // Buffered next layers only run on the stream executor
+        void wait_corked(std::false_type) { async_schedule(direction::write); }
+
+        void handle_corked(error_code ec)
+        {
+            if (ec || !owner) return;
+            std::unique_lock<std::recursive_mutex> lock(send_mutex, std::try_to_lock);
+            if (!lock || is_holding) return; // the writer is sending
+
+            uncork(ec);
+            lock.unlock();
+            if (ec == boost::asio::error::would_block) wait_corked(is_reactive());
+        }
+
+        // Called from any thread: the producer finding the queue idle posts the drain
+        void enqueue(detail::queued_write* node)
+        {
+            node->next = queue_head.load(std::memory_order_relaxed);
+            while (!queue_head.compare_exchange_weak(
+                node->next, node, std::memory_order_release, std::memory_order_relaxed))
+            {}
+
+            if (!is_draining.exchange(true, std::memory_order_acq_rel))
+                boost::asio::post(executor,
+                                  std::bind(&impl::drain_queue, this->shared_from_this()));
+        }
+
+        // Write everything queued so far as one batch, oldest first
+        void drain_queue()
+        {
+            auto* head = queue_head.exchange(nullptr, std::memory_order_acquire);
+            if (!head)
+            {
+                is_draining.store(false, std::memory_order_release);
+
+                // A producer may have queued since, and not posted as the drain was running
+                if (queue_head.load(std::memory_order_acquire) &&
+                    !is_draining.exchange(true, std::memory_order_acq_rel))
+                    drain_queue();
+                return;
+            }
+
+            // Producers push onto a stack, so reverse it
+            detail::queued_write* batch = nullptr;
+            while (head)
+            {
+                auto* next = head->next;
+                head->next = batch;
+                batch = head;
+                head = next;
+            }
+            queue_batch = batch;
+            resume_queue();
+        }
+
+        void resume_queue()
+        {
+            {
+                // A write started by the application before the queue restarts it once it is
+                // released, and messages queued before the handshake is done wait for it
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                if (write_handler || (!queue_error && !is_handshake_done))
+                {
+                    is_queue_waiting = true;
+                    return;
+                }
+            }
+
+            error_code ec = queue_error;
+            if (!ec && owner) parent()->prepare_async(ec, is_reactive());
+            if (ec || !owner) return handle_queue_write(ec);
+
+            for (auto* node = queue_batch; node; node = node->next)
+                if (node->data.size() > 0) write_buffers.push_back(node->data);
+            if (write_buffers.empty()) return handle_queue_write(ec);
+
+            write_handler.emplace(std::bind(&impl::handle_queue_write,
+                                            this->shared_from_this(),
+                                            std::placeholders::_1),
+                                  executor);
+            bytes_written = 0;
+            is_writing_all = true;
+            async_schedule(direction::write);
+        }
+
+        void handle_queue_write(error_code const& ec)
+        {
+            if (ec && !queue_error)
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                queue_error = ec;
+            }
+            release_queued(std::exchange(queue_batch, nullptr));
+
+            // Posted, so that batches dropped after an error do not recurse
+            boost::asio::post(executor, std::bind(&impl::drain_queue, this->shared_from_this()));
+        }
+
+        // Called once the handshake is done, possibly from the thread of a synchronous handshake
+        void resume_held_queue()
+        {
+            bool resume;
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                is_handshake_done = true;
+                resume = std::exchange(is_queue_waiting, false);
+            }
+            if (resume)
+                boost::asio::post(executor,
+                                  std::bind(&impl::resume_queue, this->shared_from_this()));
+        }
+
+        // Take the handler of a completing write, then hand the write direction over to the
+        // queue if it waits for that write. This happens before the handler is delivered, as it
+        // may start the next write on another thread.
+        detail::handler_slot<executor_type, error_code const&, std::size_t> release_write_handler()
+        {
+            bool resume;
+            detail::handler_slot<executor_type, error_code const&, std::size_t> handler;
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                handler = std::move(write_handler);
+                resume = std::exchange(is_queue_waiting, false);
+            }
+            if (resume) resume_queue();
+            return handler;
+        }
+
+        bool take_queue_waiting()
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            return std::exchange(is_queue_waiting, false);
+        }
+
+        error_code get_queue_error() const
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            return queue_error;
+        }
+
+        static void release_queued(detail::queued_write* node)
+        {
+            while (node) delete std::exchange(node, node->next);
+        }
+
+        // Size of the records to send with dynamic record sizing, 0 for the maximum size
+        std::size_t small_record_limit()
+        {
+            if (!owner || !parent()->m_dynamic_record_sizing) return 0;
+
+            auto const now = clock::now();
+            if (now - last_send > dynamic_record_idle_timeout) warmup_bytes = 0;
+            last_send = now;
+            return warmup_bytes < dynamic_record_threshold ? small_record_size : 0;
+        }
+
+        void uncork(error_code& ec)
+        {
             do {
                 int ret = gnutls_record_uncork(session, 0);
                 if (ret < 0)
@@ -759,13 +1965,7 @@ private:
 
                     break;
                 }
-
-                bytes_written += ret;
             } while (gnutls_record_check_corked(session) > 0);
-
-            if (bytes_written > 0) ec.clear();
-
-            return bytes_written;
         }
 
         static ssize_t pull_func(void* ptr, void* buffer, std::size_t size)
@@ -773,23 +1973,27 @@ private:
             namespace error = boost::asio::error;
 
             auto* im = static_cast<impl*>(ptr);
-            if (!im->parent)
+            if (!im->owner)
             {
                 gnutls_transport_set_errno(im->session, ECONNRESET);
                 return -1;
             }
 
-            auto& next_layer = im->parent->m_next_layer;
+            transport_timer timer(im);
+
             error_code ec;
-            std::size_t bytes_read = next_layer.read_some(boost::asio::buffer(buffer, size), ec);
+            std::size_t bytes_read = im->transport_read(buffer, size, ec, is_reactive());
             if (ec && ec != error::eof && ec != error::connection_reset) // consider reset as close
             {
-                gnutls_transport_set_errno(
-                    im->session,
-                    (ec == error::try_again || ec == error::would_block) ? EAGAIN : ECONNRESET);
+                int const err =
+                    (ec == error::try_again || ec == error::would_block) ? EAGAIN : ECONNRESET;
+                if (err == EAGAIN) detail::blocked_direction() = 0;
+                BOOST_ASIO_GNUTLS_PROBE4(pull, im->session, size, -1, err);
+                gnutls_transport_set_errno(im->session, err);
                 return -1;
             }
 
+            BOOST_ASIO_GNUTLS_PROBE4(pull, im->session, size, bytes_read, 0);
             gnutls_transport_set_errno(im->session, 0);
             return ssize_t(bytes_read);
         }
@@ -799,126 +2003,126 @@ private:
             namespace error = boost::asio::error;
 
             auto* im = static_cast<impl*>(ptr);
-            if (!im->parent)
+            if (!im->owner)
             {
                 gnutls_transport_set_errno(im->session, ECONNRESET);
                 return -1;
             }
 
-            auto& next_layer = im->parent->m_next_layer;
+            transport_timer timer(im);
+
             error_code ec;
-            std::size_t bytes_written =
-                next_layer.write_some(boost::asio::const_buffer(data, len), ec);
+            std::size_t bytes_written = im->transport_write(data, len, ec, is_reactive());
             if (ec)
             {
-                gnutls_transport_set_errno(
-                    im->session,
-                    (ec == error::try_again || ec == error::would_block) ? EAGAIN : ECONNRESET);
+                int const err =
+                    (ec == error::try_again || ec == error::would_block) ? EAGAIN : ECONNRESET;
+                if (err == EAGAIN) detail::blocked_direction() = 1;
+                BOOST_ASIO_GNUTLS_PROBE4(push, im->session, len, -1, err);
+                gnutls_transport_set_errno(im->session, err);
                 return -1;
             }
 
+            BOOST_ASIO_GNUTLS_PROBE4(push, im->session, len, bytes_written, 0);
             gnutls_transport_set_errno(im->session, 0);
             return ssize_t(bytes_written);
         }
 
-        static int verify_func(gnutls_session_t session)
+        // Accumulates the time spent in the transport while a traced handshake is running
+        struct transport_timer
         {
-            auto* im = static_cast<impl*>(gnutls_session_get_ptr(session));
-            if (!im->parent) return GNUTLS_E_INVALID_SESSION;
-            auto context_impl = im->parent->m_context_impl;
-
-            auto verify = im->parent->m_verify >= 0 ? im->parent->m_verify : context_impl->verify;
-            auto verify_callback = im->parent->m_verify_callback ? im->parent->m_verify_callback
-                                                                 : context_impl->verify_callback;
-
-            if (!(verify & context::verify_peer))
-                return GNUTLS_E_SUCCESS; // no verification requested
-
-            if (gnutls_certificate_type_get(session) != GNUTLS_CRT_X509)
-                return GNUTLS_E_NO_CERTIFICATE_FOUND;
-
-            unsigned int count = 0;
-            gnutls_datum_t const* array = gnutls_certificate_get_peers(session, &count);
-            if (!array || count == 0) return GNUTLS_E_NO_CERTIFICATE_FOUND;
-
-            gnutls_x509_crt_t cert;
-            gnutls_x509_crt_init(&cert);
-            int ret = gnutls_x509_crt_import(cert, &array[0], GNUTLS_X509_FMT_DER);
-            if (ret != GNUTLS_E_SUCCESS)
+            explicit transport_timer(impl* im)
+                : im(im)
             {
-                gnutls_x509_crt_deinit(cert);
-                return ret;
+                if (im->is_tracing) begin = clock::now();
             }
 
-            bool verified = false;
-            unsigned int status = 0;
-            ret = gnutls_certificate_verify_peers2(session, &status);
-            if (ret == GNUTLS_E_SUCCESS && !(status & GNUTLS_CERT_INVALID)) verified = true;
-
-            if (verify_callback)
+            ~transport_timer()
             {
-                verify_context ctx(cert);
-                verified = verify_callback(verified, ctx);
+                if (im->is_tracing) im->transport_time += clock::now() - begin;
             }
 
-            gnutls_x509_crt_deinit(cert);
-            return verified ? GNUTLS_E_SUCCESS : GNUTLS_E_CERTIFICATE_ERROR;
-        }
+            impl* im;
+            clock::time_point begin;
+        };
 
-        static int post_client_hello_func(gnutls_session_t session)
+        static int hook_func(gnutls_session_t session,
+                             unsigned int htype,
+                             unsigned int when,
+                             unsigned int incoming,
+                             const gnutls_datum_t*)
         {
-            auto* im = static_cast<impl*>(gnutls_session_get_ptr(session));
-            if (!im->parent) return GNUTLS_E_INVALID_SESSION;
-            auto context_impl = im->parent->m_context_impl;
-
-            auto& callback = context_impl->server_name_callback;
-            if (!callback) return GNUTLS_E_SUCCESS;
-
-            if (!callback(*im->parent, im->get_server_name())) return GNUTLS_E_UNRECOGNIZED_NAME;
-
-            // context may have been switched
-            context_impl = im->parent->m_context_impl;
-
-            // set credentials now
-            gnutls_certificate_set_verify_function(context_impl->cred, verify_func);
-            int ret = gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, context_impl->cred);
-            if (ret != GNUTLS_E_SUCCESS) return ret;
-
-            // set certificate request
-            auto const verify = context_impl->verify;
-            gnutls_certificate_request_t req = GNUTLS_CERT_IGNORE;
-            if (verify & context::verify_peer)
-            {
-                if (verify & context::verify_fail_if_no_peer_cert)
-                    req = GNUTLS_CERT_REQUIRE;
-                else
-                    req = GNUTLS_CERT_REQUEST;
-            }
-            gnutls_certificate_server_set_request(session, req);
-
-            return GNUTLS_E_SUCCESS;
+            auto* im = static_cast<impl*>(from(session));
+            handshake_trace::event e;
+            e.message = static_cast<gnutls_handshake_description_t>(htype);
+            e.incoming = incoming != 0;
+            e.post = when == GNUTLS_HOOK_POST;
+            e.offset = clock::now() - im->trace.start;
+            im->trace.events.push_back(e);
+            return 0;
         }
 
-        const handshake_type type;
-        stream* parent;
-
-        gnutls_session_t session;
-
         direction want_direction = direction::none;
         bool is_handshake_done = false;
         bool is_reading = false;
         bool is_writing = false;
 
-        std::function<void(error_code const&)> handshake_handler;
-        std::function<void(error_code const&)> shutdown_handler;
-        std::function<void(error_code const&, std::size_t)> read_handler;
-        std::function<void(error_code const&, std::size_t)> write_handler;
+        clock::time_point handshake_start; // epoch if no handshake is in progress
 
-        std::list<boost::asio::mutable_buffer> read_buffers;
-        std::list<boost::asio::const_buffer> write_buffers;
+        bool is_tracing = false; // a traced handshake is in progress
+        handshake_trace trace;
+        clock::duration transport_time{};
+
+        detail::handler_slot<executor_type, error_code const&> handshake_handler;
+        detail::handler_slot<executor_type, error_code const&> shutdown_handler;
+        detail::handler_slot<executor_type, error_code const&, std::size_t> read_handler;
+        detail::handler_slot<executor_type, error_code const&, std::size_t> write_handler;
+
+        // Vectors keep their capacity once cleared, so that operations do not allocate
+        std::vector<boost::asio::mutable_buffer> read_buffers;
+        std::vector<boost::asio::const_buffer> write_buffers;
 
         std::size_t bytes_read = 0;
         std::size_t bytes_written = 0;
+        bool is_writing_all = false; // the write handler is called once every buffer is written
+
+        // Dynamic record sizing, bytes sent in small records since the last idle period
+        std::size_t warmup_bytes = 0;
+        clock::time_point last_send;
+
+        // A synchronous operation is running in the direction, possibly on another thread
+        std::atomic<bool> is_blocking_read{false};
+        std::atomic<bool> is_blocking_write{false};
+        std::atomic<bool> is_holding{false};  // records are corked until the next flush
+        std::atomic<bool> is_hold_due{false}; // the coalescing timer has fired
+        bool is_coalescing = false;           // the coalescing timer is running
+        std::recursive_mutex send_mutex;      // see send_scope, reentered by inline completions
+        executor_type executor;     // of the owner, for operations started by any thread
+        timer_type coalescing_timer;
+
+        // Write queue, pushed onto by producers and drained by the stream executor
+        std::atomic<detail::queued_write*> queue_head{nullptr};
+        std::atomic<bool> is_draining{false}; // a drain is posted or running
+        detail::queued_write* queue_batch = nullptr; // being written, oldest first
+        // Hands the queue over between the drain, the handshake and the writes of the
+        // application, which may complete on different threads
+        mutable std::mutex queue_mutex;
+        bool is_queue_waiting = false; // the batch waits for a write or for the handshake
+        error_code queue_error;        // written by the drain, read by anyone under the mutex
+
+        // Ciphertext buffers, only used with non-reactive next layers
+        std::vector<char> input;
+        std::size_t input_begin = 0;
+        std::size_t input_end = 0;
+        error_code input_error;
+
+        std::vector<char> output_flight; // being written by async_write_some
+        std::size_t output_flight_pos = 0;
+        std::vector<char> output_pending; // appended to by push_func
+        bool is_flushing = false;
+        error_code output_error;
+        // shutdown handler, moved here until the close_notify alert is written out
+        detail::handler_slot<executor_type, error_code const&> shutdown_output_handler;
     };
 
     std::shared_ptr<impl> ensure_impl(handshake_type type)
@@ -927,7 +2131,7 @@ private:
             if (auto old = std::exchange(m_impl, std::make_shared<impl>(this, type)))
             {
                 old->abort();
-                old->parent = nullptr;
+                old->owner = nullptr;
             }
         return m_impl;
     }
@@ -935,7 +2139,60 @@ private:
     std::shared_ptr<impl> m_impl;
 };
 
+// Compared through a reference by the duration operators, so needs a definition before C++17
+template <typename NextLayer>
+constexpr std::chrono::milliseconds stream<NextLayer>::dynamic_record_idle_timeout;
+
 } // namespace gnutls
+
+template <typename Handler, typename Executor>
+struct associated_executor<gnutls::detail::buffered_handshake_handler<Handler>, Executor>
+{
+    using type = typename associated_executor<Handler, Executor>::type;
+
+    static type get(gnutls::detail::buffered_handshake_handler<Handler> const& h,
+                    Executor const& ex = Executor()) noexcept
+    {
+        return associated_executor<Handler, Executor>::get(h.handler, ex);
+    }
+};
+
+template <typename Handler, typename Allocator>
+struct associated_allocator<gnutls::detail::buffered_handshake_handler<Handler>, Allocator>
+{
+    using type = typename associated_allocator<Handler, Allocator>::type;
+
+    static type get(gnutls::detail::buffered_handshake_handler<Handler> const& h,
+                    Allocator const& a = Allocator()) noexcept
+    {
+        return associated_allocator<Handler, Allocator>::get(h.handler, a);
+    }
+};
+
+template <typename Handler, typename Executor>
+struct associated_executor<gnutls::detail::flush_write_handler<Handler>, Executor>
+{
+    using type = typename associated_executor<Handler, Executor>::type;
+
+    static type get(gnutls::detail::flush_write_handler<Handler> const& h,
+                    Executor const& ex = Executor()) noexcept
+    {
+        return associated_executor<Handler, Executor>::get(h.handler, ex);
+    }
+};
+
+template <typename Handler, typename Allocator>
+struct associated_allocator<gnutls::detail::flush_write_handler<Handler>, Allocator>
+{
+    using type = typename associated_allocator<Handler, Allocator>::type;
+
+    static type get(gnutls::detail::flush_write_handler<Handler> const& h,
+                    Allocator const& a = Allocator()) noexcept
+    {
+        return associated_allocator<Handler, Allocator>::get(h.handler, a);
+    }
+};
+
 } // namespace asio
 } // namespace boost
 
@@ -18,6 +18,7 @@
 #include <gnutls/gnutls.h>
 
 #include <exception>
+#include <functional>
 #include <memory>
 #include <string>
 
@@ -25,6 +26,10 @@ namespace boost {
 namespace asio {
 namespace gnutls {
 
+namespace detail {
+class tls_session;
+}
+
 class stream_base
 {
 public:
@@ -37,9 +42,16 @@ public:
         server
     };
 
-    stream_base(context& ctx) { set_context(ctx); }
+    stream_base(context& ctx)
+        : m_tls_version(ctx.m_impl->tls_version())
+    {
+        set_context(ctx);
+    }
     stream_base(stream_base&& other)
         : m_context_impl(std::move(other.m_context_impl))
+        , m_verify(other.m_verify)
+        , m_verify_callback(std::move(other.m_verify_callback))
+        , m_tls_version(other.m_tls_version)
     {}
     stream_base(stream_base const& other) = delete;
     virtual ~stream_base() = default;
@@ -53,6 +65,47 @@ public:
 
     void set_context(context& ctx) { m_context_impl = ctx.m_impl; }
 
+#ifndef BOOST_NO_EXCEPTIONS
+    void set_verify_mode(verify_mode v)
+    {
+        error_code ec;
+        set_verify_mode(v, ec);
+    }
+#endif
+
+    // Warning: for clients only (verify_none or verify_peer)
+    error_code set_verify_mode(verify_mode v, error_code& ec)
+    {
+        m_verify = v;
+        return ec;
+    }
+
+#ifndef BOOST_NO_EXCEPTIONS
+    void set_verify_depth(int depth)
+    {
+        error_code ec;
+        set_verify_depth(depth, ec);
+    }
+#endif
+
+    // Warning: ignored
+    error_code set_verify_depth(int, error_code& ec) { return ec; }
+
+#ifndef BOOST_NO_EXCEPTIONS
+    template <typename VerifyCallback> void set_verify_callback(VerifyCallback callback)
+    {
+        error_code ec;
+        set_verify_callback(callback, ec);
+    }
+#endif
+
+    template <typename VerifyCallback>
+    error_code set_verify_callback(VerifyCallback callback, error_code& ec)
+    {
+        m_verify_callback = callback;
+        return ec;
+    }
+
     virtual native_handle_type native_handle() = 0;
 
 #ifndef BOOST_NO_EXCEPTIONS
@@ -61,7 +114,12 @@ public:
     virtual error_code set_host_name(std::string const& name, error_code& ec) = 0;
 
 protected:
+    friend class detail::tls_session;
+
     std::shared_ptr<context::impl> m_context_impl;
+    verify_mode m_verify = -1;
+    std::function<bool(bool preverified, verify_context& ctx)> m_verify_callback;
+    unsigned int m_tls_version; // X*10 + Y => TLS X.Y, 0*10 + Z => SSL Z
 };
 
 } // namespace gnutls
@@ -53,6 +53,11 @@ void test()
 
         context.set_server_name_callback(server_name_callback);
         context.set_server_name_callback(server_name_callback, ec);
+
+        // Metrics
+
+        gnutls::context_metrics metrics = context.metrics();
+        (void)metrics;
     }
     catch (std::exception&)
     {}
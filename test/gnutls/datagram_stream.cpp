@@ -0,0 +1,193 @@
+//
+// datagram_stream.cpp
+// ~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2020 Paul-Louis Ageneau (paul-louis at ageneau dot org)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Disable autolinking for unit tests.
+#if !defined(BOOST_ALL_NO_LIB)
+#define BOOST_ALL_NO_LIB 1
+#endif // !defined(BOOST_ALL_NO_LIB)
+
+// Test that header file is self-contained.
+#include <boost/asio/gnutls/datagram_stream.hpp>
+
+#include "../unit_test.hpp"
+#include <boost/asio.hpp>
+#include <boost/asio/gnutls.hpp>
+
+#include <chrono>
+#include <functional>
+
+//------------------------------------------------------------------------------
+
+// gnutls_datagram_stream_compile test
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// The following test checks that all public member functions on the class
+// gnutls::datagram_stream compile and link correctly. Runtime failures are
+// ignored.
+
+namespace gnutls_datagram_stream_compile {
+
+void handshake_handler(const boost::system::error_code&) {}
+
+void shutdown_handler(const boost::system::error_code&) {}
+
+void send_handler(const boost::system::error_code&, std::size_t) {}
+
+void receive_handler(const boost::system::error_code&, std::size_t) {}
+
+void test()
+{
+    using namespace boost::asio;
+    namespace ip = boost::asio::ip;
+
+    try
+    {
+        io_context ioc;
+        char mutable_char_buffer[128] = "";
+        const char const_char_buffer[128] = "";
+        gnutls::context context(gnutls::context::tls);
+        boost::system::error_code ec;
+
+        // gnutls::datagram_stream constructors.
+
+        gnutls::datagram_stream<ip::udp::socket> stream1(ioc, context);
+        ip::udp::socket socket1(ioc, ip::udp::v4());
+        gnutls::datagram_stream<ip::udp::socket&> stream2(socket1, context);
+
+        // gnutls::datagram_stream functions.
+
+        gnutls::datagram_stream<ip::udp::socket>::executor_type ex = stream1.get_executor();
+        (void)ex;
+
+        gnutls::datagram_stream<ip::udp::socket>::native_handle_type native_handle =
+            stream1.native_handle();
+        (void)native_handle;
+
+        gnutls::datagram_stream<ip::udp::socket>::lowest_layer_type& lowest_layer =
+            stream1.lowest_layer();
+        (void)lowest_layer;
+
+        ip::udp::socket& next_layer = stream1.next_layer();
+        (void)next_layer;
+
+        stream1.set_verify_mode(gnutls::verify_none);
+        stream1.set_verify_mode(gnutls::verify_none, ec);
+        stream1.set_host_name("localhost");
+        stream1.set_host_name("localhost", ec);
+
+        stream1.set_mtu(1200);
+        (void)stream1.mtu();
+        (void)stream1.max_message_size();
+        stream1.set_timeouts(std::chrono::seconds(1), std::chrono::seconds(60));
+
+        stream1.handshake(gnutls::stream_base::client);
+        stream1.handshake(gnutls::stream_base::server, ec);
+        stream1.async_handshake(gnutls::stream_base::client, handshake_handler);
+
+        stream1.send(buffer(const_char_buffer));
+        stream1.send(buffer(const_char_buffer), ec);
+        stream1.async_send(buffer(const_char_buffer), send_handler);
+
+        stream1.receive(buffer(mutable_char_buffer));
+        stream1.receive(buffer(mutable_char_buffer), ec);
+        stream1.async_receive(buffer(mutable_char_buffer), receive_handler);
+
+        stream1.shutdown();
+        stream1.shutdown(ec);
+        stream1.async_shutdown(shutdown_handler);
+    }
+    catch (std::exception&)
+    {}
+}
+
+} // namespace gnutls_datagram_stream_compile
+
+//------------------------------------------------------------------------------
+
+// gnutls_datagram_stream_runtime test
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// The following test checks that a client handshake towards a silent peer
+// retransmits its hello, then times out, which needs no credentials.
+
+namespace gnutls_datagram_stream_runtime {
+
+void test()
+{
+    using namespace boost::asio;
+    namespace ip = boost::asio::ip;
+    using boost::system::error_code;
+
+    io_context ioc;
+    ip::udp::socket peer(ioc, ip::udp::endpoint(ip::address_v4::loopback(), 0));
+
+    gnutls::context context(gnutls::context::tls_client);
+    gnutls::datagram_stream<ip::udp::socket> stream(ioc, context);
+    stream.next_layer().connect(peer.local_endpoint());
+    stream.set_mtu(1000);
+    stream.set_timeouts(std::chrono::milliseconds(50), std::chrono::milliseconds(300));
+    BOOST_ASIO_CHECK(stream.mtu() == 1000);
+
+    // An operation of the application on the socket, which never completes by itself
+    bool waited = false;
+    stream.next_layer().async_wait(socket_base::wait_error,
+                                   [&waited](error_code const&) { waited = true; });
+
+    error_code result;
+    bool done = false;
+    stream.async_handshake(gnutls::stream_base::client, [&](error_code const& ec) {
+        result = ec;
+        done = true;
+    });
+    while (!done && ioc.run_one()) {}
+
+    BOOST_ASIO_CHECK(done);
+    BOOST_ASIO_CHECK(result == error::timed_out);
+
+    // The handshake gave up its wait for a datagram without cancelling the socket
+    ioc.poll();
+    BOOST_ASIO_CHECK(!waited);
+
+    // Each hello is a DTLS handshake record, sent again after each timeout
+    int hellos = 0;
+    char datagram[1500];
+    error_code ec;
+    peer.non_blocking(true);
+    while (std::size_t n = peer.receive(buffer(datagram), 0, ec))
+    {
+        BOOST_ASIO_CHECK(n <= 1000);
+        BOOST_ASIO_CHECK(datagram[0] == 22); // handshake
+        BOOST_ASIO_CHECK(static_cast<unsigned char>(datagram[1]) == 0xfe); // DTLS
+        ++hellos;
+    }
+    BOOST_ASIO_CHECK(hellos >= 2);
+
+    // Sending before the handshake is refused, and an lvalue handler is copied, not moved from
+    BOOST_ASIO_CHECK(stream.send(buffer("x", 1), ec) == 0);
+    BOOST_ASIO_CHECK(ec == error::operation_not_supported);
+
+    std::function<void(error_code const&, std::size_t)> handler =
+        [&result](error_code const& ec, std::size_t) { result = ec; };
+    stream.async_send(buffer("x", 1), handler);
+    BOOST_ASIO_CHECK(static_cast<bool>(handler));
+    ioc.poll();
+    BOOST_ASIO_CHECK(result == error::operation_not_supported);
+
+    // Closing the socket completes the remaining waits
+    stream.next_layer().close();
+    ioc.run();
+    BOOST_ASIO_CHECK(waited);
+}
+
+} // namespace gnutls_datagram_stream_runtime
+
+//------------------------------------------------------------------------------
+
+BOOST_ASIO_TEST_SUITE("gnutls/datagram_stream",
+                      BOOST_ASIO_TEST_CASE(gnutls_datagram_stream_compile::test)
+                          BOOST_ASIO_TEST_CASE(gnutls_datagram_stream_runtime::test))
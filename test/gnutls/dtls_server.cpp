@@ -0,0 +1,246 @@
+//
+// dtls_server.cpp
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2020 Paul-Louis Ageneau (paul-louis at ageneau dot org)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Disable autolinking for unit tests.
+#if !defined(BOOST_ALL_NO_LIB)
+#define BOOST_ALL_NO_LIB 1
+#endif // !defined(BOOST_ALL_NO_LIB)
+
+// Test that header file is self-contained.
+#include <boost/asio/gnutls/dtls_server.hpp>
+
+#include "../unit_test.hpp"
+#include "test_credentials.hpp"
+#include <boost/asio.hpp>
+#include <boost/asio/gnutls.hpp>
+
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <thread>
+
+//------------------------------------------------------------------------------
+
+// gnutls_dtls_server_compile test
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// The following test checks that all public member functions on the class
+// gnutls::dtls_server compile and link correctly. Runtime failures are ignored.
+
+namespace gnutls_dtls_server_compile {
+
+void accept_handler(const boost::system::error_code&) {}
+
+void test()
+{
+    using namespace boost::asio;
+    namespace ip = boost::asio::ip;
+
+    try
+    {
+        io_context ioc;
+        gnutls::context context(gnutls::context::tls_server);
+        boost::system::error_code ec;
+
+        gnutls::dtls_server server(ip::udp::socket(ioc, ip::udp::endpoint(ip::udp::v4(), 0)));
+
+        gnutls::dtls_server::executor_type ex = server.get_executor();
+        (void)ex;
+        ip::udp::socket& socket = server.socket();
+        (void)socket;
+        ip::udp::endpoint endpoint = server.local_endpoint();
+        (void)endpoint;
+        (void)server.peer_count();
+
+        gnutls::dtls_server::stream_type peer(ioc, context);
+        server.async_accept(peer, accept_handler);
+
+        gnutls::dtls_server::peer_socket& peer_socket = peer.next_layer();
+        (void)peer_socket.is_open();
+        endpoint = peer_socket.remote_endpoint();
+        peer_socket.wait(socket_base::wait_read, std::chrono::steady_clock::now(), ec);
+        peer_socket.cancel(ec);
+        peer_socket.close(ec);
+
+        server.close();
+        server.close(ec);
+    }
+    catch (std::exception&)
+    {}
+}
+
+} // namespace gnutls_dtls_server_compile
+
+//------------------------------------------------------------------------------
+
+// gnutls_dtls_server_runtime test
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// The following test checks that datagrams other than hellos are ignored, and
+// that a client is accepted once it returns the cookie of the server, which
+// needs no credentials.
+
+namespace gnutls_dtls_server_runtime {
+
+void test()
+{
+    using namespace boost::asio;
+    namespace ip = boost::asio::ip;
+    using boost::system::error_code;
+
+    io_context ioc;
+    ip::udp::endpoint const loopback(ip::address_v4::loopback(), 0);
+    gnutls::dtls_server server(ip::udp::socket(ioc, loopback));
+
+    gnutls::context server_context(gnutls::context::tls_server);
+    gnutls::dtls_server::stream_type peer(ioc, server_context);
+    error_code accept_result = error::would_block;
+    server.async_accept(peer, [&](error_code const& ec) {
+        accept_result = ec;
+        ioc.stop();
+    });
+
+    // Garbage is neither answered nor accepted
+    ip::udp::socket raw(ioc, loopback);
+    raw.send_to(buffer("\x17garbage", 8), server.local_endpoint());
+    ioc.run_for(std::chrono::milliseconds(100));
+    ioc.restart();
+    BOOST_ASIO_CHECK(accept_result == error::would_block);
+    BOOST_ASIO_CHECK(raw.available() == 0);
+    BOOST_ASIO_CHECK(server.peer_count() == 0);
+
+    // The first hello is answered with a cookie, the second one is accepted
+    gnutls::context client_context(gnutls::context::tls_client);
+    gnutls::datagram_stream<ip::udp::socket> client(ip::udp::socket(ioc, loopback),
+                                                    client_context);
+    client.next_layer().connect(server.local_endpoint());
+    client.async_handshake(gnutls::stream_base::client, [](error_code const&) {});
+    ioc.run_for(std::chrono::seconds(5));
+
+    BOOST_ASIO_CHECK(!accept_result);
+    BOOST_ASIO_CHECK(peer.next_layer().is_open());
+    BOOST_ASIO_CHECK(peer.next_layer().remote_endpoint() == client.next_layer().local_endpoint());
+    BOOST_ASIO_CHECK(server.peer_count() == 1);
+
+    // Peers wait for writability on the socket of the server
+    error_code ec;
+    BOOST_ASIO_CHECK(!peer.next_layer().wait(socket_base::wait_write, ec));
+    error_code wait_result = error::would_block;
+    peer.next_layer().async_wait(socket_base::wait_write, [&](error_code const& ec) {
+        wait_result = ec;
+        ioc.stop();
+    });
+    ioc.restart();
+    ioc.run_for(std::chrono::seconds(1));
+    BOOST_ASIO_CHECK(!wait_result);
+
+    // The result is posted to the executor associated with the handler
+    io_context handler_ioc;
+    wait_result = error::would_block;
+    peer.next_layer().async_wait(
+        socket_base::wait_write,
+        bind_executor(handler_ioc, [&](error_code const& ec) { wait_result = ec; }));
+    ioc.restart();
+    ioc.run_for(std::chrono::milliseconds(100));
+    BOOST_ASIO_CHECK(wait_result == error::would_block);
+    BOOST_ASIO_CHECK(handler_ioc.run() == 1);
+    BOOST_ASIO_CHECK(!wait_result);
+
+    server.socket().close(ec);
+    peer.next_layer().wait(socket_base::wait_write, ec);
+    BOOST_ASIO_CHECK(ec == error::bad_descriptor);
+
+    peer.next_layer().close(ec);
+    BOOST_ASIO_CHECK(server.peer_count() == 0);
+}
+
+} // namespace gnutls_dtls_server_runtime
+
+//------------------------------------------------------------------------------
+
+// gnutls_dtls_server_handshake test
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// The following test checks that an accepted peer completes the handshake
+// through the replayed hello, then exchanges a message both ways, using the
+// synchronous operations of the peer while the io_context of the server runs
+// on another thread. It also checks that a read wait on a peer times out.
+
+namespace gnutls_dtls_server_handshake {
+
+void test()
+{
+    using namespace boost::asio;
+    namespace ip = boost::asio::ip;
+    using boost::system::error_code;
+
+    io_context ioc;
+    auto work = make_work_guard(ioc);
+    ip::udp::endpoint const loopback(ip::address_v4::loopback(), 0);
+    gnutls::dtls_server server(ip::udp::socket(ioc, loopback));
+
+    gnutls::context server_context(gnutls::context::tls_server);
+    test_credentials::use_server_credentials(server_context);
+    gnutls::dtls_server::stream_type peer(ioc, server_context);
+    std::promise<error_code> accepted;
+    server.async_accept(peer, [&](error_code const& ec) { accepted.set_value(ec); });
+
+    std::thread runner([&ioc]() { ioc.run(); });
+
+    gnutls::context client_context(gnutls::context::tls_client);
+    gnutls::datagram_stream<ip::udp::socket> client(ip::udp::socket(ioc, loopback),
+                                                    client_context);
+    client.next_layer().connect(server.local_endpoint());
+    error_code client_ec;
+    std::thread client_thread(
+        [&]() { client.handshake(gnutls::stream_base::client, client_ec); });
+
+    auto accept_result = accepted.get_future();
+    BOOST_ASIO_CHECK(accept_result.wait_for(std::chrono::seconds(5)) ==
+                     std::future_status::ready);
+    BOOST_ASIO_CHECK(!accept_result.get());
+
+    error_code ec;
+    peer.handshake(gnutls::stream_base::server, ec);
+    client_thread.join();
+    BOOST_ASIO_CHECK(!ec);
+    BOOST_ASIO_CHECK(!client_ec);
+
+    char const request[] = "ping";
+    char const response[] = "pong";
+    char data[16];
+    BOOST_ASIO_CHECK(client.send(buffer(request, 4), ec) == 4);
+    BOOST_ASIO_CHECK(!ec);
+    BOOST_ASIO_CHECK(peer.receive(buffer(data), ec) == 4);
+    BOOST_ASIO_CHECK(!ec);
+    BOOST_ASIO_CHECK(std::memcmp(data, request, 4) == 0);
+
+    BOOST_ASIO_CHECK(peer.send(buffer(response, 4), ec) == 4);
+    BOOST_ASIO_CHECK(!ec);
+    BOOST_ASIO_CHECK(client.receive(buffer(data), ec) == 4);
+    BOOST_ASIO_CHECK(!ec);
+    BOOST_ASIO_CHECK(std::memcmp(data, response, 4) == 0);
+
+    // With nothing to read, a read wait ends at its deadline
+    auto const start = std::chrono::steady_clock::now();
+    peer.next_layer().wait(socket_base::wait_read, start + std::chrono::milliseconds(50), ec);
+    BOOST_ASIO_CHECK(ec == error::timed_out);
+    BOOST_ASIO_CHECK(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(50));
+
+    work.reset();
+    ioc.stop();
+    runner.join();
+}
+
+} // namespace gnutls_dtls_server_handshake
+
+//------------------------------------------------------------------------------
+
+BOOST_ASIO_TEST_SUITE("gnutls/dtls_server",
+                      BOOST_ASIO_TEST_CASE(gnutls_dtls_server_compile::test)
+                          BOOST_ASIO_TEST_CASE(gnutls_dtls_server_runtime::test)
+                              BOOST_ASIO_TEST_CASE(gnutls_dtls_server_handshake::test))
@@ -0,0 +1,224 @@
+//
+// engine.cpp
+// ~~~~~~~~~~
+//
+// Copyright (c) 2020 Paul-Louis Ageneau (paul-louis at ageneau dot org)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Disable autolinking for unit tests.
+#if !defined(BOOST_ALL_NO_LIB)
+#define BOOST_ALL_NO_LIB 1
+#endif // !defined(BOOST_ALL_NO_LIB)
+
+// Test that header file is self-contained.
+#include <boost/asio/gnutls/engine.hpp>
+
+#include "../unit_test.hpp"
+#include "test_credentials.hpp"
+#include <boost/asio.hpp>
+#include <boost/asio/gnutls.hpp>
+
+#include <string>
+#include <vector>
+
+//------------------------------------------------------------------------------
+
+// gnutls_engine_compile test
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// The following test checks that all public member functions on the class
+// gnutls::engine compile and link correctly. Runtime failures are ignored.
+
+namespace gnutls_engine_compile {
+
+bool verify_callback(bool, boost::asio::gnutls::verify_context&) { return false; }
+
+void test()
+{
+    using namespace boost::asio;
+
+    try
+    {
+        char mutable_char_buffer[128] = "";
+        const char const_char_buffer[128] = "";
+        boost::system::error_code ec;
+        std::size_t bytes_transferred = 0;
+
+        gnutls::context context(gnutls::context::tls);
+        gnutls::engine engine1(context);
+        gnutls::engine engine2(std::move(engine1));
+
+        gnutls::engine::native_handle_type native_handle = engine2.native_handle();
+        (void)native_handle;
+
+        engine2.set_verify_mode(gnutls::verify_none);
+        engine2.set_verify_mode(gnutls::verify_none, ec);
+        engine2.set_verify_depth(1);
+        engine2.set_verify_depth(1, ec);
+        engine2.set_verify_callback(verify_callback);
+        engine2.set_verify_callback(verify_callback, ec);
+        engine2.set_host_name("localhost");
+        engine2.set_host_name("localhost", ec);
+
+        gnutls::engine::want want = engine2.handshake(gnutls::stream_base::client, ec);
+        want = engine2.write(buffer(const_char_buffer), ec, bytes_transferred);
+        want = engine2.read(buffer(mutable_char_buffer), ec, bytes_transferred);
+        want = engine2.shutdown(ec);
+        (void)want;
+
+        const_buffer output = engine2.output();
+        engine2.consume_output(output.size());
+        mutable_buffer copied = engine2.get_output(buffer(mutable_char_buffer));
+        (void)copied;
+        const_buffer remaining = engine2.put_input(buffer(const_char_buffer));
+        (void)remaining;
+        engine2.put_eof();
+    }
+    catch (std::exception&)
+    {}
+}
+
+} // namespace gnutls_engine_compile
+
+//------------------------------------------------------------------------------
+
+// gnutls_engine_runtime test
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// The following tests check the first handshake flight of a client and the
+// bounds of the input buffer, then a whole session between two engines.
+
+namespace gnutls_engine_runtime {
+
+void test()
+{
+    using namespace boost::asio;
+    using boost::system::error_code;
+
+    gnutls::context context(gnutls::context::tls_client);
+    gnutls::engine engine(context);
+    engine.set_host_name("localhost");
+
+    // The client hello is written then the engine waits for the server
+    error_code ec;
+    BOOST_ASIO_CHECK(engine.handshake(gnutls::stream_base::client, ec) ==
+                     gnutls::engine::want_output_and_retry);
+    BOOST_ASIO_CHECK(!ec);
+    std::size_t const hello_size = engine.output().size();
+    BOOST_ASIO_CHECK(hello_size > 0);
+
+    std::vector<char> hello(hello_size);
+    BOOST_ASIO_CHECK(engine.get_output(buffer(hello)).size() == hello_size);
+    BOOST_ASIO_CHECK(engine.output().size() == 0);
+    BOOST_ASIO_CHECK(hello[0] == 22); // handshake record
+    BOOST_ASIO_CHECK(engine.handshake(gnutls::stream_base::client, ec) ==
+                     gnutls::engine::want_input_and_retry);
+
+    // Input beyond the limit is handed back
+    std::vector<char> input(gnutls::engine::max_input_size + 10);
+    BOOST_ASIO_CHECK(engine.put_input(buffer(input)).size() == 10);
+    BOOST_ASIO_CHECK(engine.put_input(buffer(input)).size() == input.size());
+
+    // Garbage fails the handshake, and a truncated stream is reported as such
+    BOOST_ASIO_CHECK(engine.handshake(gnutls::stream_base::client, ec) >=
+                     gnutls::engine::want_nothing);
+    BOOST_ASIO_CHECK(ec);
+
+    gnutls::engine truncated(context);
+    truncated.handshake(gnutls::stream_base::client, ec);
+    truncated.consume_output(truncated.output().size());
+    truncated.put_eof();
+    BOOST_ASIO_CHECK(truncated.handshake(gnutls::stream_base::client, ec) ==
+                     gnutls::engine::want_nothing);
+    BOOST_ASIO_CHECK(ec == gnutls::error::stream_truncated);
+}
+
+// Moves all pending output of an engine to the input of the other one
+void transfer(boost::asio::gnutls::engine& from, boost::asio::gnutls::engine& to)
+{
+    boost::asio::const_buffer output = from.output();
+    BOOST_ASIO_CHECK(to.put_input(output).size() == 0);
+    from.consume_output(output.size());
+}
+
+// Runs both handshakes to completion, returns the first error
+boost::system::error_code handshake(boost::asio::gnutls::engine& client,
+                                    boost::asio::gnutls::engine& server)
+{
+    using boost::asio::gnutls::engine;
+    using boost::asio::gnutls::stream_base;
+
+    boost::system::error_code client_ec, server_ec;
+    bool client_done = false, server_done = false;
+    for (int round = 0; round < 10 && !(client_done && server_done); ++round)
+    {
+        if (!client_done)
+            client_done = client.handshake(stream_base::client, client_ec) >= engine::want_nothing;
+        transfer(client, server);
+        if (!server_done)
+            server_done = server.handshake(stream_base::server, server_ec) >= engine::want_nothing;
+        transfer(server, client);
+    }
+    BOOST_ASIO_CHECK(client_done && server_done);
+    return client_ec ? client_ec : server_ec;
+}
+
+// Pumps ciphertext between a client and a server engine through a full handshake,
+// data in both directions, and the closure of the session
+void pump()
+{
+    using namespace boost::asio;
+    using boost::system::error_code;
+
+    gnutls::context client_context(gnutls::context::tls);
+    gnutls::context server_context(gnutls::context::tls);
+    client_context.set_verify_mode(gnutls::verify_none);
+    test_credentials::use_server_credentials(server_context);
+    gnutls::engine client(client_context), server(server_context);
+    BOOST_ASIO_CHECK(!handshake(client, server));
+
+    // A record sent by one engine is read by the other
+    std::string const request = "request", response = "response";
+    char data[64];
+    std::size_t n = 0;
+    error_code ec;
+    BOOST_ASIO_CHECK(client.write(buffer(request), ec, n) == gnutls::engine::want_output);
+    BOOST_ASIO_CHECK(!ec && n == request.size());
+    transfer(client, server);
+    BOOST_ASIO_CHECK(server.read(buffer(data), ec, n) == gnutls::engine::want_nothing);
+    BOOST_ASIO_CHECK(!ec && std::string(data, n) == request);
+    BOOST_ASIO_CHECK(server.read(buffer(data), ec, n) == gnutls::engine::want_input_and_retry);
+
+    BOOST_ASIO_CHECK(server.write(buffer(response), ec, n) == gnutls::engine::want_output);
+    transfer(server, client);
+    BOOST_ASIO_CHECK(client.read(buffer(data), ec, n) == gnutls::engine::want_nothing);
+    BOOST_ASIO_CHECK(!ec && std::string(data, n) == response);
+
+    // The client sends close_notify and waits for the server's, which reads eof first
+    BOOST_ASIO_CHECK(client.shutdown(ec) == gnutls::engine::want_output_and_retry && !ec);
+    transfer(client, server);
+    BOOST_ASIO_CHECK(client.shutdown(ec) == gnutls::engine::want_input_and_retry);
+    server.read(buffer(data), ec, n);
+    BOOST_ASIO_CHECK(ec == error::eof && n == 0);
+    BOOST_ASIO_CHECK(server.shutdown(ec) >= gnutls::engine::want_nothing && !ec);
+    transfer(server, client);
+    BOOST_ASIO_CHECK(client.shutdown(ec) == gnutls::engine::want_nothing && !ec);
+
+    // Once the transport is closed without close_notify, reads report a truncated stream
+    gnutls::engine truncated(client_context), peer(server_context);
+    BOOST_ASIO_CHECK(!handshake(truncated, peer));
+    BOOST_ASIO_CHECK(truncated.read(buffer(data), ec, n) == gnutls::engine::want_input_and_retry);
+    truncated.put_eof();
+    BOOST_ASIO_CHECK(truncated.read(buffer(data), ec, n) == gnutls::engine::want_nothing);
+    BOOST_ASIO_CHECK(ec == gnutls::error::stream_truncated);
+}
+
+} // namespace gnutls_engine_runtime
+
+//------------------------------------------------------------------------------
+
+BOOST_ASIO_TEST_SUITE("gnutls/engine",
+                      BOOST_ASIO_TEST_CASE(gnutls_engine_compile::test)
+                          BOOST_ASIO_TEST_CASE(gnutls_engine_runtime::test)
+                          BOOST_ASIO_TEST_CASE(gnutls_engine_runtime::pump))
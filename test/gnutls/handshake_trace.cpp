@@ -0,0 +1,161 @@
+//
+// handshake_trace.cpp
+// ~~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2020 Paul-Louis Ageneau (paul-louis at ageneau dot org)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Disable autolinking for unit tests.
+#if !defined(BOOST_ALL_NO_LIB)
+#define BOOST_ALL_NO_LIB 1
+#endif // !defined(BOOST_ALL_NO_LIB)
+
+// Test that header file is self-contained.
+#include <boost/asio/gnutls/handshake_trace.hpp>
+
+#include "../unit_test.hpp"
+#include "test_credentials.hpp"
+#include <boost/asio/gnutls.hpp>
+
+//------------------------------------------------------------------------------
+
+// gnutls_handshake_trace_compile test
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// The following test checks that all public members of gnutls::handshake_trace
+// compile and link correctly. Runtime failures are ignored.
+
+namespace gnutls_handshake_trace_compile {
+
+void test()
+{
+    using namespace boost::asio;
+
+    try
+    {
+        gnutls::handshake_trace trace;
+
+        gnutls::handshake_trace::clock::duration d = trace.waiting();
+        d += trace.total + trace.processing;
+        (void)d;
+        (void)trace.start;
+        (void)trace.read_waits;
+        (void)trace.write_waits;
+        (void)trace.result;
+
+        for (gnutls::handshake_trace::event const& e : trace.events)
+        {
+            (void)e.name();
+            (void)e.message;
+            (void)e.incoming;
+            (void)e.post;
+            (void)e.offset;
+        }
+    }
+    catch (std::exception&)
+    {}
+}
+
+} // namespace gnutls_handshake_trace_compile
+
+//------------------------------------------------------------------------------
+
+// gnutls_handshake_trace_runtime test
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// The following test checks that a traced handshake over a memory pipe records
+// its messages in order, and the time spent waiting on a delayed peer, while an
+// untraced one keeps the hook function set by the application.
+
+namespace gnutls_handshake_trace_runtime {
+
+void test()
+{
+    using namespace boost::asio;
+    using clock = gnutls::handshake_trace::clock;
+    using boost::system::error_code;
+
+    io_context ioc;
+    gnutls::context client_context(gnutls::context::tls);
+    gnutls::context server_context(gnutls::context::tls_server);
+    client_context.set_verify_mode(gnutls::verify_none);
+    test_credentials::use_server_credentials(server_context);
+
+    gnutls::stream<gnutls::memory_pipe> client(ioc, client_context);
+    gnutls::stream<gnutls::memory_pipe> server(ioc, server_context);
+    gnutls::connect_pair(client.next_layer(), server.next_layer());
+    client.set_handshake_tracing(true);
+
+    static int server_hooks;
+    server_hooks = 0;
+    gnutls_handshake_set_hook_function(
+        server.native_handle(),
+        GNUTLS_HANDSHAKE_ANY,
+        GNUTLS_HOOK_POST,
+        [](gnutls_session_t, unsigned int, unsigned int, unsigned int, gnutls_datum_t const*) {
+            ++server_hooks;
+            return 0;
+        });
+
+    // The server only answers after a delay, which the client spends waiting
+    auto const delay = std::chrono::milliseconds(20);
+    error_code client_ec, server_ec;
+    client.async_handshake(gnutls::stream_base::client,
+                           [&client_ec](error_code const& ec) { client_ec = ec; });
+    steady_timer timer(ioc, delay);
+    timer.async_wait([&](error_code const&) {
+        server.async_handshake(gnutls::stream_base::server,
+                               [&server_ec](error_code const& ec) { server_ec = ec; });
+    });
+    ioc.run();
+    ioc.restart();
+    BOOST_ASIO_CHECK(!client_ec && !server_ec);
+    BOOST_ASIO_CHECK(server_hooks > 0);
+
+    gnutls::handshake_trace const& trace = client.last_handshake_trace();
+    BOOST_ASIO_CHECK(!trace.result);
+    BOOST_ASIO_CHECK(trace.processing > clock::duration::zero());
+    BOOST_ASIO_CHECK(trace.waiting() >= delay);
+    BOOST_ASIO_CHECK(trace.read_waits > 0);
+
+    // The client hello goes out first, then the server messages come back in order
+    BOOST_ASIO_CHECK(!trace.events.empty());
+    BOOST_ASIO_CHECK(!trace.events.front().incoming);
+    BOOST_ASIO_CHECK(trace.events.front().message == GNUTLS_HANDSHAKE_CLIENT_HELLO);
+    gnutls_handshake_description_t const expected[] = {GNUTLS_HANDSHAKE_SERVER_HELLO,
+                                                       GNUTLS_HANDSHAKE_CERTIFICATE_PKT,
+                                                       GNUTLS_HANDSHAKE_FINISHED};
+    std::size_t next = 0;
+    clock::duration last = clock::duration::zero();
+    for (gnutls::handshake_trace::event const& e : trace.events)
+    {
+        BOOST_ASIO_CHECK(e.name() != nullptr);
+        BOOST_ASIO_CHECK(e.offset >= last && e.offset <= trace.total);
+        last = e.offset;
+        if (next < 3 && e.incoming && !e.post && e.message == expected[next]) ++next;
+    }
+    BOOST_ASIO_CHECK(next == 3);
+
+    // Post-handshake messages, like a TLS 1.3 key update read with the data, are not recorded
+    std::size_t const events = trace.events.size();
+    BOOST_ASIO_CHECK(gnutls_session_key_update(server.native_handle(), 0) == 0);
+    char data[4];
+    async_write(server, buffer("data", 4), [](error_code const&, std::size_t) {});
+    async_read(client, buffer(data), [](error_code const& ec, std::size_t) {
+        BOOST_ASIO_CHECK(!ec);
+    });
+    ioc.run();
+    BOOST_ASIO_CHECK(trace.events.size() == events);
+
+    // Tracing is off by default
+    BOOST_ASIO_CHECK(server.last_handshake_trace().events.empty());
+}
+
+} // namespace gnutls_handshake_trace_runtime
+
+//------------------------------------------------------------------------------
+
+BOOST_ASIO_TEST_SUITE("gnutls/handshake_trace",
+                      BOOST_ASIO_TEST_CASE(gnutls_handshake_trace_compile::test)
+                          BOOST_ASIO_TEST_CASE(gnutls_handshake_trace_runtime::test))
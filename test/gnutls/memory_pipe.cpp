@@ -0,0 +1,243 @@
+//
+// memory_pipe.cpp
+// ~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2020 Paul-Louis Ageneau (paul-louis at ageneau dot org)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Disable autolinking for unit tests.
+#if !defined(BOOST_ALL_NO_LIB)
+#define BOOST_ALL_NO_LIB 1
+#endif // !defined(BOOST_ALL_NO_LIB)
+
+// Test that header file is self-contained.
+#include <boost/asio/gnutls/memory_pipe.hpp>
+
+#include "../unit_test.hpp"
+#include <boost/asio.hpp>
+#include <boost/asio/gnutls.hpp>
+
+#include <array>
+#include <memory>
+#include <string>
+#include <thread>
+
+//------------------------------------------------------------------------------
+
+// gnutls_memory_pipe_compile test
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// The following test checks that all public member functions on the class
+// gnutls::memory_pipe compile and link correctly, including as the next layer
+// of a stream. Runtime failures are ignored.
+
+namespace gnutls_memory_pipe_compile {
+
+void wait_handler(const boost::system::error_code&) {}
+
+void test()
+{
+    using namespace boost::asio;
+
+    try
+    {
+        io_context ioc;
+        char mutable_char_buffer[128] = "";
+        const char const_char_buffer[128] = "";
+        boost::system::error_code ec;
+
+        gnutls::memory_pipe pipe1(ioc);
+        gnutls::memory_pipe pipe2(ioc.get_executor());
+        gnutls::connect_pair(pipe1, pipe2);
+        gnutls::connect_pair(pipe1, pipe2, 4096);
+
+        gnutls::memory_pipe::executor_type ex = pipe1.get_executor();
+        (void)ex;
+        gnutls::memory_pipe::lowest_layer_type& lowest_layer = pipe1.lowest_layer();
+        (void)lowest_layer;
+        (void)pipe1.is_open();
+
+        pipe1.non_blocking(true);
+        pipe1.non_blocking(true, ec);
+        (void)pipe1.non_blocking();
+
+        pipe1.write_some(buffer(const_char_buffer));
+        pipe1.write_some(buffer(const_char_buffer), ec);
+        pipe2.read_some(buffer(mutable_char_buffer));
+        pipe2.read_some(buffer(mutable_char_buffer), ec);
+
+        pipe1.wait(socket_base::wait_write);
+        pipe1.wait(socket_base::wait_write, ec);
+        pipe1.async_wait(socket_base::wait_read, wait_handler);
+
+        pipe1.shutdown(socket_base::shutdown_send);
+        pipe1.shutdown(socket_base::shutdown_send, ec);
+        pipe1.cancel();
+        pipe1.cancel(ec);
+        pipe1.close();
+        pipe1.close(ec);
+
+        gnutls::context context(gnutls::context::tls);
+        gnutls::stream<gnutls::memory_pipe> stream1(ioc, context);
+        gnutls::connect_pair(stream1.next_layer(), pipe2);
+        stream1.async_handshake(gnutls::stream_base::client, wait_handler);
+    }
+    catch (std::exception&)
+    {}
+}
+
+} // namespace gnutls_memory_pipe_compile
+
+//------------------------------------------------------------------------------
+
+// gnutls_memory_pipe_runtime test
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// The following test checks data transfer, readiness notifications and
+// closing between the two ends of a pipe.
+
+namespace gnutls_memory_pipe_runtime {
+
+template <typename T> struct counting_allocator
+{
+    using value_type = T;
+
+    explicit counting_allocator(std::size_t* count)
+        : count(count)
+    {}
+
+    template <typename U>
+    counting_allocator(counting_allocator<U> const& other)
+        : count(other.count)
+    {}
+
+    T* allocate(std::size_t n)
+    {
+        ++*count;
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* p, std::size_t n) { std::allocator<T>().deallocate(p, n); }
+
+    template <typename U> bool operator==(counting_allocator<U> const& other) const
+    {
+        return count == other.count;
+    }
+
+    template <typename U> bool operator!=(counting_allocator<U> const& other) const
+    {
+        return count != other.count;
+    }
+
+    std::size_t* count;
+};
+
+template <typename Payload> struct counting_handler
+{
+    using allocator_type = counting_allocator<void>;
+
+    allocator_type get_allocator() const noexcept { return allocator_type(count); }
+
+    void operator()(boost::system::error_code const& ec) { *ready = !ec && payload.size() > 0; }
+
+    Payload payload;
+    std::size_t* count;
+    bool* ready;
+};
+
+void test()
+{
+    using namespace boost::asio;
+    using boost::system::error_code;
+
+    io_context ioc;
+    gnutls::memory_pipe a(ioc), b(ioc);
+    gnutls::connect_pair(a, b, 8);
+
+    // The ring wraps around and a full ring reports would_block
+    error_code ec;
+    char data[16];
+    a.non_blocking(true);
+    b.non_blocking(true);
+    for (int i = 0; i < 3; ++i)
+    {
+        BOOST_ASIO_CHECK(a.write_some(buffer("abcde", 5), ec) == 5 && !ec);
+        BOOST_ASIO_CHECK(b.read_some(buffer(data), ec) == 5 && !ec);
+        BOOST_ASIO_CHECK(std::string(data, 5) == "abcde");
+    }
+    BOOST_ASIO_CHECK(b.read_some(buffer(data), ec) == 0 && ec == error::would_block);
+    BOOST_ASIO_CHECK(a.write_some(buffer(data), ec) == 8 && !ec);
+    BOOST_ASIO_CHECK(a.write_some(buffer(data), ec) == 0 && ec == error::would_block);
+
+    // A pending wait completes once the peer makes room
+    bool writable = false;
+    a.async_wait(socket_base::wait_write, [&writable](error_code const& ec) { writable = !ec; });
+    ioc.poll();
+    BOOST_ASIO_CHECK(!writable);
+    BOOST_ASIO_CHECK(b.read_some(buffer(data, 4), ec) == 4 && !ec);
+    ioc.run();
+    ioc.restart();
+    BOOST_ASIO_CHECK(writable);
+
+    // The result is posted to the executor associated with the handler
+    io_context handler_ioc;
+    bool ready = false;
+    a.async_wait(socket_base::wait_write,
+                 bind_executor(handler_ioc, [&ready](error_code const& ec) { ready = !ec; }));
+    ioc.run();
+    ioc.restart();
+    BOOST_ASIO_CHECK(!ready);
+    BOOST_ASIO_CHECK(handler_ioc.run() == 1);
+    BOOST_ASIO_CHECK(ready);
+
+    // Handlers too large to be stored in place are allocated with their associated allocator
+    std::size_t allocations = 0;
+    ready = false;
+    std::array<char, 256> large{};
+    a.async_wait(socket_base::wait_write,
+                 counting_handler<std::array<char, 256>>{large, &allocations, &ready});
+    ioc.run();
+    ioc.restart();
+    BOOST_ASIO_CHECK(ready);
+    BOOST_ASIO_CHECK(allocations > 0);
+
+    // Blocking reads wait for a writer on another thread
+    b.non_blocking(false);
+    BOOST_ASIO_CHECK(b.read_some(buffer(data), ec) == 4 && !ec);
+    std::thread writer([&a]() {
+        error_code ec;
+        a.write_some(buffer("xyz", 3), ec);
+    });
+    BOOST_ASIO_CHECK(b.read_some(buffer(data), ec) == 3 && !ec);
+    writer.join();
+
+    // Cancelled waits complete with operation_aborted, and move-only handlers are accepted
+    error_code wait_result;
+    std::unique_ptr<error_code> result_ptr(new error_code);
+    b.async_wait(socket_base::wait_read,
+                 [&wait_result, p = std::move(result_ptr)](error_code const& ec) {
+                     *p = ec;
+                     wait_result = *p;
+                 });
+    b.cancel();
+    ioc.run();
+    ioc.restart();
+    BOOST_ASIO_CHECK(wait_result == error::operation_aborted);
+
+    // Closing lets the peer drain the remaining data then read eof, and fails its writes
+    BOOST_ASIO_CHECK(a.write_some(buffer("end", 3), ec) == 3 && !ec);
+    a.close();
+    BOOST_ASIO_CHECK(!a.is_open());
+    BOOST_ASIO_CHECK(b.read_some(buffer(data), ec) == 3 && !ec);
+    BOOST_ASIO_CHECK(b.read_some(buffer(data), ec) == 0 && ec == error::eof);
+    BOOST_ASIO_CHECK(b.write_some(buffer(data), ec) == 0 && ec == error::broken_pipe);
+}
+
+} // namespace gnutls_memory_pipe_runtime
+
+//------------------------------------------------------------------------------
+
+BOOST_ASIO_TEST_SUITE("gnutls/memory_pipe",
+                      BOOST_ASIO_TEST_CASE(gnutls_memory_pipe_compile::test)
+                          BOOST_ASIO_TEST_CASE(gnutls_memory_pipe_runtime::test))
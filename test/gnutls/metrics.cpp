@@ -0,0 +1,199 @@
+//
+// metrics.cpp
+// ~~~~~~~~~~~
+//
+// Copyright (c) 2020 Paul-Louis Ageneau (paul-louis at ageneau dot org)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Disable autolinking for unit tests.
+#if !defined(BOOST_ALL_NO_LIB)
+#define BOOST_ALL_NO_LIB 1
+#endif // !defined(BOOST_ALL_NO_LIB)
+
+// Test that header file is self-contained.
+#include <boost/asio/gnutls/metrics.hpp>
+
+#include "../unit_test.hpp"
+#include "test_credentials.hpp"
+#include <boost/asio/gnutls.hpp>
+
+#include <memory>
+#include <string>
+#include <thread>
+
+//------------------------------------------------------------------------------
+
+// gnutls_metrics_compile test
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// The following test checks that all public members of gnutls::context_metrics
+// compile and link correctly. Runtime failures are ignored.
+
+namespace gnutls_metrics_compile {
+
+void test()
+{
+    using namespace boost::asio;
+
+    try
+    {
+        boost::asio::gnutls::context context(boost::asio::gnutls::context::tls);
+
+        gnutls::context_metrics m = context.metrics();
+        (void)m.handshakes_started;
+        (void)m.handshakes_completed;
+        (void)m.handshakes_failed;
+        (void)m.handshakes_resumed;
+        (void)m.bytes_read;
+        (void)m.bytes_written;
+
+        for (auto const& f : m.handshake_failures)
+            (void)f.first.message();
+
+        gnutls::latency_histogram const& h = m.handshake_latency;
+        for (std::size_t i = 0; i < gnutls::latency_histogram::bucket_count; ++i)
+            (void)(h.buckets[i] + gnutls::latency_histogram::bucket_bound(i));
+        (void)h.count;
+        (void)h.sum_us;
+    }
+    catch (std::exception&)
+    {}
+}
+
+} // namespace gnutls_metrics_compile
+
+//------------------------------------------------------------------------------
+
+// gnutls_metrics_runtime test
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// The following test checks that counters recorded from several threads are
+// merged into a single snapshot, including those of threads which exited.
+
+namespace gnutls_metrics_runtime {
+
+void test()
+{
+    using namespace boost::asio;
+    using latency_histogram = gnutls::latency_histogram;
+
+    BOOST_ASIO_CHECK(latency_histogram::bucket_index(0) == 0);
+    BOOST_ASIO_CHECK(latency_histogram::bucket_index(1) == 1);
+    BOOST_ASIO_CHECK(latency_histogram::bucket_index(1023) == 10);
+    BOOST_ASIO_CHECK(latency_histogram::bucket_index(1024) == 11);
+    BOOST_ASIO_CHECK(latency_histogram::bucket_index(~std::uint64_t(0)) ==
+                     latency_histogram::bucket_count - 1);
+
+    gnutls::detail::metrics_registry registry;
+    auto record = [&registry]() {
+        registry.handshake_started();
+        registry.handshake_finished({}, true, std::chrono::microseconds(100));
+        registry.handshake_started();
+        registry.handshake_finished(
+            boost::asio::error::operation_aborted, false, std::chrono::microseconds(0));
+        registry.bytes_read(10);
+        registry.bytes_written(20);
+    };
+
+    std::thread t1(record), t2(record);
+    t1.join();
+    t2.join();
+    record();
+
+    gnutls::context_metrics m = registry.snapshot();
+    BOOST_ASIO_CHECK(m.handshakes_started == 6);
+    BOOST_ASIO_CHECK(m.handshakes_completed == 3);
+    BOOST_ASIO_CHECK(m.handshakes_failed == 3);
+    BOOST_ASIO_CHECK(m.handshakes_resumed == 3);
+    BOOST_ASIO_CHECK(m.handshake_failures.size() == 1);
+    BOOST_ASIO_CHECK(m.handshake_failures[boost::asio::error::operation_aborted] == 3);
+    BOOST_ASIO_CHECK(m.bytes_read == 30);
+    BOOST_ASIO_CHECK(m.bytes_written == 60);
+    BOOST_ASIO_CHECK(m.handshake_latency.count == 3);
+    BOOST_ASIO_CHECK(m.handshake_latency.sum_us == 300);
+    BOOST_ASIO_CHECK(m.handshake_latency.buckets[latency_histogram::bucket_index(100)] == 3);
+
+    // The shards of exited threads are retired into the totals, so the registry only keeps the
+    // one of this thread however many threads come and go
+    BOOST_ASIO_CHECK(registry.shard_count() == 1);
+    for (int i = 0; i < 100; ++i)
+        std::thread(record).join();
+    BOOST_ASIO_CHECK(registry.shard_count() == 1);
+
+    m = registry.snapshot();
+    BOOST_ASIO_CHECK(m.handshakes_started == 206);
+    BOOST_ASIO_CHECK(m.handshake_failures[boost::asio::error::operation_aborted] == 103);
+    BOOST_ASIO_CHECK(m.bytes_written == 2060);
+    BOOST_ASIO_CHECK(m.handshake_latency.sum_us == 10300);
+}
+
+// Streams record their handshakes and traffic in the metrics of their context, including a
+// handshake aborted by destroying the stream
+void streams()
+{
+    using namespace boost::asio;
+    using boost::system::error_code;
+    using pipe_stream = gnutls::stream<gnutls::memory_pipe>;
+
+    io_context ioc;
+    gnutls::context client_context(gnutls::context::tls), server_context(gnutls::context::tls);
+    client_context.set_verify_mode(gnutls::verify_none);
+    test_credentials::use_server_credentials(server_context);
+
+    std::string const message = "metrics";
+    for (int i = 0; i < 2; ++i)
+    {
+        pipe_stream client(ioc, client_context), server(ioc, server_context);
+        gnutls::connect_pair(client.next_layer(), server.next_layer());
+        BOOST_ASIO_CHECK(!test_credentials::handshake_pair(ioc, client, server));
+
+        std::string received(message.size(), '\0');
+        async_write(client, buffer(message), [](error_code const&, std::size_t) {});
+        async_read(server, buffer(&received[0], received.size()),
+                   [](error_code const& ec, std::size_t) { BOOST_ASIO_CHECK(!ec); });
+        ioc.run();
+        ioc.restart();
+        BOOST_ASIO_CHECK(received == message);
+    }
+
+    {
+        std::unique_ptr<pipe_stream> client(new pipe_stream(ioc, client_context));
+        pipe_stream server(ioc, server_context);
+        gnutls::connect_pair(client->next_layer(), server.next_layer());
+        client->async_handshake(gnutls::stream_base::client, [](error_code const&) {});
+        client.reset();
+        ioc.run();
+        ioc.restart();
+    }
+
+    gnutls::context_metrics const c = client_context.metrics();
+    BOOST_ASIO_CHECK(c.handshakes_started == 3);
+    BOOST_ASIO_CHECK(c.handshakes_completed == 2);
+    BOOST_ASIO_CHECK(c.handshakes_failed == 1);
+    BOOST_ASIO_CHECK(c.handshake_failures.size() == 1);
+    BOOST_ASIO_CHECK(c.handshake_failures.count(error::operation_aborted) == 1);
+    BOOST_ASIO_CHECK(c.handshake_latency.count == 2);
+    BOOST_ASIO_CHECK(c.bytes_written == 2 * message.size());
+
+    gnutls::context_metrics const s = server_context.metrics();
+    BOOST_ASIO_CHECK(s.handshakes_started == 2);
+    BOOST_ASIO_CHECK(s.handshakes_completed == 2);
+    BOOST_ASIO_CHECK(s.handshakes_failed == 0);
+    BOOST_ASIO_CHECK(s.bytes_read == 2 * message.size());
+
+    std::uint64_t buckets = 0;
+    for (std::size_t i = 0; i < gnutls::latency_histogram::bucket_count; ++i)
+        buckets += s.handshake_latency.buckets[i];
+    BOOST_ASIO_CHECK(s.handshake_latency.count == 2 && buckets == 2);
+    BOOST_ASIO_CHECK(s.handshake_latency.sum_us > 0);
+}
+
+} // namespace gnutls_metrics_runtime
+
+//------------------------------------------------------------------------------
+
+BOOST_ASIO_TEST_SUITE("gnutls/metrics",
+                      BOOST_ASIO_TEST_CASE(gnutls_metrics_compile::test)
+                          BOOST_ASIO_TEST_CASE(gnutls_metrics_runtime::test)
+                          BOOST_ASIO_TEST_CASE(gnutls_metrics_runtime::streams))
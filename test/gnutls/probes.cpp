@@ -0,0 +1,49 @@
+//
+// probes.cpp
+// ~~~~~~~~~~
+//
+// Copyright (c) 2020 Paul-Louis Ageneau (paul-louis at ageneau dot org)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Disable autolinking for unit tests.
+#if !defined(BOOST_ALL_NO_LIB)
+#define BOOST_ALL_NO_LIB 1
+#endif // !defined(BOOST_ALL_NO_LIB)
+
+// Test that header file is self-contained.
+#include <boost/asio/gnutls/probes.hpp>
+
+#include "../unit_test.hpp"
+
+//------------------------------------------------------------------------------
+
+// gnutls_probes_compile test
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// The following test checks that the probe macros compile as statements.
+
+namespace gnutls_probes_compile {
+
+void test()
+{
+    void* session = nullptr;
+    int ret = 0;
+    std::size_t size = 0;
+
+    BOOST_ASIO_GNUTLS_PROBE1(handshake__start, session);
+    BOOST_ASIO_GNUTLS_PROBE2(handshake__step, session, ret);
+    BOOST_ASIO_GNUTLS_PROBE3(recv__some, session, size, ret);
+    BOOST_ASIO_GNUTLS_PROBE4(pull, session, size, ret, ret);
+
+    (void)session;
+    (void)ret;
+    (void)size;
+}
+
+} // namespace gnutls_probes_compile
+
+//------------------------------------------------------------------------------
+
+BOOST_ASIO_TEST_SUITE("gnutls/probes", BOOST_ASIO_TEST_CASE(gnutls_probes_compile::test))
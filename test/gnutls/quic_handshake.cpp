@@ -0,0 +1,282 @@
+//
+// quic_handshake.cpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Copyright (c) 2020 Paul-Louis Ageneau (paul-louis at ageneau dot org)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Disable autolinking for unit tests.
+#if !defined(BOOST_ALL_NO_LIB)
+#define BOOST_ALL_NO_LIB 1
+#endif // !defined(BOOST_ALL_NO_LIB)
+
+// Test that header file is self-contained.
+#include <boost/asio/gnutls/quic_handshake.hpp>
+
+#include "../unit_test.hpp"
+#include "test_credentials.hpp"
+#include <boost/asio.hpp>
+#include <boost/asio/gnutls.hpp>
+
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+
+//------------------------------------------------------------------------------
+
+// gnutls_quic_handshake_compile test
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// The following test checks that all public member functions on the class
+// gnutls::quic_handshake compile and link correctly. Runtime failures are ignored.
+
+namespace gnutls_quic_handshake_compile {
+
+void secret_callback(boost::asio::gnutls::quic_handshake::level,
+                     boost::asio::const_buffer,
+                     boost::asio::const_buffer)
+{}
+
+void test()
+{
+    using namespace boost::asio;
+    using level = gnutls::quic_handshake::level;
+
+    try
+    {
+        const char const_char_buffer[128] = "";
+        boost::system::error_code ec;
+
+        gnutls::context context(gnutls::context::tls);
+        gnutls::quic_handshake handshake1(context);
+        gnutls::quic_handshake handshake2(std::move(handshake1));
+
+        gnutls::quic_handshake::native_handle_type native_handle = handshake2.native_handle();
+        (void)native_handle;
+
+        handshake2.set_verify_mode(gnutls::verify_none);
+        handshake2.set_host_name("localhost");
+        handshake2.set_host_name("localhost", ec);
+        handshake2.set_secret_callback(secret_callback);
+        handshake2.set_transport_parameters(buffer(const_char_buffer));
+
+        gnutls::quic_handshake::want want =
+            handshake2.handshake(gnutls::stream_base::client, ec);
+        (void)want;
+        handshake2.put_input(level::initial_level, buffer(const_char_buffer), ec);
+
+        const_buffer output = handshake2.output(level::initial_level);
+        handshake2.consume_output(level::initial_level, output.size());
+        const_buffer parameters = handshake2.peer_transport_parameters();
+        (void)parameters;
+        int alert = handshake2.alert();
+        (void)alert;
+    }
+    catch (std::exception&)
+    {}
+}
+
+} // namespace gnutls_quic_handshake_compile
+
+//------------------------------------------------------------------------------
+
+// gnutls_quic_handshake_runtime test
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// The following test carries the client hello over a loopback UDP socket to a
+// server without certificate, which must fail the handshake with an alert.
+
+namespace gnutls_quic_handshake_runtime {
+
+void test()
+{
+    using namespace boost::asio;
+    namespace ip = boost::asio::ip;
+    using boost::system::error_code;
+    using level = gnutls::quic_handshake::level;
+
+    io_context ioc;
+    ip::udp::socket client_socket(ioc, ip::udp::endpoint(ip::address_v4::loopback(), 0));
+    ip::udp::socket server_socket(ioc, ip::udp::endpoint(ip::address_v4::loopback(), 0));
+
+    gnutls::context client_context(gnutls::context::tls_client);
+    gnutls::quic_handshake client(client_context);
+    client.set_host_name("localhost");
+    client.set_transport_parameters(buffer("client", 6));
+
+    // The client hello is a bare handshake message at the initial level, not a record
+    error_code ec;
+    BOOST_ASIO_CHECK(client.handshake(gnutls::stream_base::client, ec) ==
+                     gnutls::quic_handshake::want_output_and_retry);
+    BOOST_ASIO_CHECK(!ec);
+    const_buffer hello = client.output(level::initial_level);
+    BOOST_ASIO_CHECK(hello.size() > 0);
+    BOOST_ASIO_CHECK(static_cast<char const*>(hello.data())[0] == 1); // client_hello
+    // Without compatibility mode, the legacy_session_id after the version and random is empty
+    BOOST_ASIO_CHECK(hello.size() > 38);
+    BOOST_ASIO_CHECK(static_cast<char const*>(hello.data())[38] == 0);
+    BOOST_ASIO_CHECK(client.output(level::handshake_level).size() == 0);
+
+    client_socket.send_to(hello, server_socket.local_endpoint());
+    client.consume_output(level::initial_level, hello.size());
+    BOOST_ASIO_CHECK(client.output(level::initial_level).size() == 0);
+    BOOST_ASIO_CHECK(client.handshake(gnutls::stream_base::client, ec) ==
+                     gnutls::quic_handshake::want_input_and_retry);
+
+    char datagram[2048];
+    std::size_t const size = server_socket.receive(buffer(datagram));
+    BOOST_ASIO_CHECK(size == hello.size());
+
+    gnutls::context server_context(gnutls::context::tls_server);
+    gnutls::quic_handshake server(server_context);
+    BOOST_ASIO_CHECK(server.peer_transport_parameters().size() == 0);
+    server.put_input(level::initial_level, buffer(datagram, size), ec);
+    BOOST_ASIO_CHECK(!ec);
+
+    // The transport parameters are received, then the handshake fails for lack of credentials
+    BOOST_ASIO_CHECK(server.handshake(gnutls::stream_base::server, ec) >=
+                     gnutls::quic_handshake::want_nothing);
+    BOOST_ASIO_CHECK(ec);
+    BOOST_ASIO_CHECK(server.alert() != 0);
+    const_buffer parameters = server.peer_transport_parameters();
+    BOOST_ASIO_CHECK(parameters.size() == 6);
+    BOOST_ASIO_CHECK(std::memcmp(parameters.data(), "client", 6) == 0);
+}
+
+// Pass the pending output of one side to the other, at the same levels
+boost::system::error_code transfer(boost::asio::gnutls::quic_handshake& from,
+                                   boost::asio::gnutls::quic_handshake& to)
+{
+    using level = boost::asio::gnutls::quic_handshake::level;
+
+    boost::system::error_code ec;
+    for (level l : {level::initial_level, level::handshake_level, level::application_level})
+    {
+        boost::asio::const_buffer output = from.output(l);
+        if (output.size() == 0) continue;
+        if (to.put_input(l, output, ec)) return ec;
+        from.consume_output(l, output.size());
+    }
+    return ec;
+}
+
+// Runs the handshake of both sides against each other, returns the errors of each side
+void handshake_pair(boost::asio::gnutls::quic_handshake& client,
+                    boost::asio::gnutls::quic_handshake& server,
+                    boost::system::error_code& client_ec,
+                    boost::system::error_code& server_ec)
+{
+    using boost::asio::gnutls::quic_handshake;
+    using boost::asio::gnutls::stream_base;
+
+    for (int i = 0; i < 8; ++i)
+    {
+        quic_handshake::want client_want = client.handshake(stream_base::client, client_ec);
+        if (!client_ec) transfer(client, server);
+        quic_handshake::want server_want = server.handshake(stream_base::server, server_ec);
+        if (!server_ec) transfer(server, client);
+        if (client_ec || server_ec) return;
+        if (client_want >= quic_handshake::want_nothing &&
+            server_want >= quic_handshake::want_nothing)
+            return;
+    }
+}
+
+// Read and write secrets installed at each level, either may come in a separate call
+struct secrets
+{
+    void operator()(boost::asio::gnutls::quic_handshake::level l,
+                    boost::asio::const_buffer read_secret,
+                    boost::asio::const_buffer write_secret)
+    {
+        auto& installed = (*levels)[l];
+        if (read_secret.size() > 0)
+            installed.first.assign(static_cast<char const*>(read_secret.data()),
+                                   read_secret.size());
+        if (write_secret.size() > 0)
+            installed.second.assign(static_cast<char const*>(write_secret.data()),
+                                    write_secret.size());
+    }
+
+    std::shared_ptr<std::map<int, std::pair<std::string, std::string>>> levels =
+        std::make_shared<std::map<int, std::pair<std::string, std::string>>>();
+};
+
+// Both sides must send transport parameters, a handshake without them fails with a
+// missing_extension alert
+void missing_transport_parameters()
+{
+    using namespace boost::asio;
+    using boost::system::error_code;
+
+    gnutls::context client_context(gnutls::context::tls_client);
+    client_context.set_verify_mode(gnutls::verify_none);
+    gnutls::context server_context(gnutls::context::tls_server);
+    test_credentials::use_server_credentials(server_context);
+
+    {
+        gnutls::quic_handshake client(client_context), server(server_context);
+        client.set_transport_parameters(buffer("client", 6));
+        server.set_transport_parameters(buffer("server", 6));
+        secrets client_secrets, server_secrets;
+        client.set_secret_callback(client_secrets);
+        server.set_secret_callback(server_secrets);
+        error_code client_ec, server_ec;
+        handshake_pair(client, server, client_ec, server_ec);
+        BOOST_ASIO_CHECK(!client_ec && !server_ec);
+        BOOST_ASIO_CHECK(client.peer_transport_parameters().size() == 6);
+        BOOST_ASIO_CHECK(server.peer_transport_parameters().size() == 6);
+
+        // Initial secrets are derived by QUIC itself, at other levels each side reads with the
+        // secret the other one writes with
+        using level = gnutls::quic_handshake::level;
+        auto& client_levels = *client_secrets.levels;
+        auto& server_levels = *server_secrets.levels;
+        BOOST_ASIO_CHECK(client_levels.count(level::initial_level) == 0);
+        BOOST_ASIO_CHECK(server_levels.count(level::initial_level) == 0);
+        for (level l : {level::handshake_level, level::application_level})
+        {
+            BOOST_ASIO_CHECK(client_levels.count(l) == 1 && server_levels.count(l) == 1);
+            auto const& c = client_levels[l];
+            auto const& s = server_levels[l];
+            BOOST_ASIO_CHECK(!c.first.empty() && !c.second.empty());
+            BOOST_ASIO_CHECK(c.first == s.second);
+            BOOST_ASIO_CHECK(c.second == s.first);
+            BOOST_ASIO_CHECK(c.first != c.second);
+        }
+        BOOST_ASIO_CHECK(client_levels[level::handshake_level] !=
+                         client_levels[level::application_level]);
+    }
+
+    {
+        gnutls::quic_handshake client(client_context), server(server_context);
+        server.set_transport_parameters(buffer("server", 6));
+        error_code client_ec, server_ec;
+        handshake_pair(client, server, client_ec, server_ec);
+        BOOST_ASIO_CHECK(server_ec);
+        BOOST_ASIO_CHECK(server.alert() == GNUTLS_A_MISSING_EXTENSION);
+    }
+
+    {
+        gnutls::quic_handshake client(client_context), server(server_context);
+        client.set_transport_parameters(buffer("client", 6));
+        error_code client_ec, server_ec;
+        handshake_pair(client, server, client_ec, server_ec);
+        BOOST_ASIO_CHECK(!server_ec);
+        BOOST_ASIO_CHECK(client_ec);
+        BOOST_ASIO_CHECK(client.alert() == GNUTLS_A_MISSING_EXTENSION);
+    }
+}
+
+} // namespace gnutls_quic_handshake_runtime
+
+//------------------------------------------------------------------------------
+
+BOOST_ASIO_TEST_SUITE("gnutls/quic_handshake",
+                      BOOST_ASIO_TEST_CASE(gnutls_quic_handshake_compile::test)
+                          BOOST_ASIO_TEST_CASE(gnutls_quic_handshake_runtime::test)
+                              BOOST_ASIO_TEST_CASE(
+                                  gnutls_quic_handshake_runtime::missing_transport_parameters))
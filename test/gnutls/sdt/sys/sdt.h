@@ -0,0 +1,71 @@
+//
+// sys/sdt.h
+// ~~~~~~~~~
+//
+// Copyright (c) 2020 Paul-Louis Ageneau (paul-louis at ageneau dot org)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Stand-in for <sys/sdt.h> from SystemTap, so that the probes are compiled where it is not
+// installed. Each probe checks that it is one of the probes listed in gnutls/probes.hpp with
+// the listed number of arguments, and that its arguments are integers, enumerations or pointers
+// of at most 8 bytes, as SDT passes them as assembler operands. It compiles to nothing.
+
+#ifndef BOOST_ASIO_GNUTLS_TEST_SYS_SDT_H
+#define BOOST_ASIO_GNUTLS_TEST_SYS_SDT_H
+
+#include <type_traits>
+
+namespace sdt_stub {
+
+// Number of arguments of each probe of the boost_asio_gnutls provider
+namespace boost_asio_gnutls {
+constexpr int handshake__start = 1;
+constexpr int handshake__step = 2;
+constexpr int handshake__done = 2;
+constexpr int recv__some = 3;
+constexpr int send__some = 3;
+constexpr int pull = 4;
+constexpr int push = 4;
+constexpr int verify = 3;
+} // namespace boost_asio_gnutls
+
+template <typename T> struct is_probe_argument
+{
+    using type = typename std::decay<T>::type;
+
+    static constexpr bool value = (std::is_integral<type>::value || std::is_enum<type>::value ||
+                                   std::is_pointer<type>::value) &&
+                                  sizeof(type) <= 8;
+};
+
+template <typename... Args> struct all_probe_arguments : std::true_type
+{};
+
+template <typename First, typename... Rest>
+struct all_probe_arguments<First, Rest...>
+    : std::integral_constant<bool,
+                             is_probe_argument<First>::value &&
+                                 all_probe_arguments<Rest...>::value>
+{};
+
+template <int Expected, typename... Args> inline void probe(Args const&...)
+{
+    static_assert(Expected == sizeof...(Args), "probe argument count differs from probes.hpp");
+    static_assert(all_probe_arguments<Args...>::value,
+                  "probe arguments must be integers or pointers of at most 8 bytes");
+}
+
+} // namespace sdt_stub
+
+#define DTRACE_PROBE1(provider, name, a1) ::sdt_stub::probe<::sdt_stub::provider::name>(a1)
+#define DTRACE_PROBE2(provider, name, a1, a2)                                                    \
+    ::sdt_stub::probe<::sdt_stub::provider::name>(a1, a2)
+#define DTRACE_PROBE3(provider, name, a1, a2, a3)                                                \
+    ::sdt_stub::probe<::sdt_stub::provider::name>(a1, a2, a3)
+#define DTRACE_PROBE4(provider, name, a1, a2, a3, a4)                                            \
+    ::sdt_stub::probe<::sdt_stub::provider::name>(a1, a2, a3, a4)
+
+#endif
@@ -17,9 +17,22 @@
 #include <boost/asio/gnutls/stream.hpp>
 
 #include "../unit_test.hpp"
+#include "test_credentials.hpp"
 #include <boost/asio.hpp>
 #include <boost/asio/gnutls.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <future>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
 //------------------------------------------------------------------------------
 
 // gnutls_stream_compile test
@@ -127,23 +140,1123 @@ void test()
     stream1.async_write_some(buffer(mutable_char_buffer), write_some_handler);
     stream1.async_write_some(buffer(const_char_buffer), write_some_handler);
 
+    stream1.async_write(buffer(mutable_char_buffer), write_some_handler);
+    stream1.async_write(buffer(const_char_buffer), write_some_handler);
+
+    stream1.flush();
+    stream1.flush(ec);
+    stream1.async_flush(shutdown_handler);
+
     stream1.read_some(buffer(mutable_char_buffer));
     stream1.read_some(buffer(mutable_char_buffer), ec);
 
     stream1.async_read_some(buffer(mutable_char_buffer), read_some_handler);
 
+    // Completion tokens and move-only handlers
+
+    std::future<void> handshake_future =
+        stream1.async_handshake(gnutls::stream_base::client, use_future);
+    std::future<std::size_t> read_future =
+        stream1.async_read_some(buffer(mutable_char_buffer), use_future);
+    std::future<std::size_t> write_future =
+        stream1.async_write_some(buffer(const_char_buffer), use_future);
+    std::future<std::size_t> write_all_future =
+        stream1.async_write(buffer(const_char_buffer), use_future);
+    std::future<void> flush_future = stream1.async_flush(use_future);
+    std::future<void> shutdown_future = stream1.async_shutdown(use_future);
+
+    strand<io_context::executor_type> strand1(ioc.get_executor());
+    stream1.async_read_some(buffer(mutable_char_buffer), bind_executor(strand1, read_some_handler));
+    stream1.async_handshake(gnutls::stream_base::client,
+                            buffer(const_char_buffer),
+                            bind_executor(strand1, buffered_handshake_handler));
+
+    std::unique_ptr<int> move_only(new int(0));
+    stream1.async_read_some(buffer(mutable_char_buffer),
+                            [move_only = std::move(move_only)](
+                                const boost::system::error_code&, std::size_t) {});
+
+    // Cancellation
+
+    stream1.cancel_read();
+    stream1.cancel_write();
+
     // SNI extension
 
     stream1.set_host_name(hostname);
     stream1.set_host_name(hostname, ec);
+
+    // Immediate completion
+
+    stream1.set_immediate_completion(true);
+
+    // Blocking timeout
+
+    stream1.set_blocking_timeout(std::chrono::seconds(1));
+
+    // Dynamic record sizing
+
+    stream1.set_dynamic_record_sizing(true);
+
+    // Write flushing
+
+    stream1.set_cork_limit(gnutls::stream<ip::tcp::socket>::default_cork_limit);
+    stream1.set_explicit_flush(true);
+    stream1.set_write_coalescing(16 * 1024, std::chrono::milliseconds(1));
+
+    // Write queue
+
+    stream1.queue_write(std::string("message"));
+    stream1.queue_write(buffer(const_char_buffer), std::make_shared<std::string>("owner"));
+    ec = stream1.queue_error();
+
+    // Handshake tracing
+
+    stream1.set_handshake_tracing(true);
+    const gnutls::handshake_trace& trace = stream1.last_handshake_trace();
+    (void)trace;
+
+    // Next layer without readiness waits, driven through internal buffers
+
+    gnutls::stream<gnutls::stream<ip::tcp::socket>> tunnel(
+        gnutls::stream<ip::tcp::socket>(ioc, context), context);
+    tunnel.handshake(gnutls::stream_base::client, ec);
+    tunnel.async_handshake(gnutls::stream_base::client, handshake_handler);
+    tunnel.write_some(buffer(const_char_buffer), ec);
+    tunnel.async_write_some(buffer(const_char_buffer), write_some_handler);
+    tunnel.async_write(buffer(const_char_buffer), write_some_handler);
+    tunnel.async_flush(shutdown_handler);
+    tunnel.read_some(buffer(mutable_char_buffer), ec);
+    tunnel.async_read_some(buffer(mutable_char_buffer), read_some_handler);
+    tunnel.shutdown(ec);
+    tunnel.async_shutdown(shutdown_handler);
   }
   catch (std::exception&)
   {
   }
 }
 
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+boost::asio::awaitable<void> coroutine(boost::asio::gnutls::stream<boost::asio::ip::tcp::socket>& s)
+{
+  using boost::asio::use_awaitable;
+
+  char buffer[128] = "";
+  co_await s.async_handshake(boost::asio::gnutls::stream_base::client, use_awaitable);
+  std::size_t n = co_await s.async_read_some(boost::asio::buffer(buffer), use_awaitable);
+  co_await s.async_write_some(boost::asio::buffer(buffer, n), use_awaitable);
+  co_await s.async_shutdown(use_awaitable);
+}
+#endif
+
 } // namespace gnutls_stream_compile
 
 //------------------------------------------------------------------------------
 
-BOOST_ASIO_TEST_SUITE("gnutls/stream", BOOST_ASIO_TEST_CASE(gnutls_stream_compile::test))
+// gnutls_stream_runtime test
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// The following tests run a client and a server stream against each other over
+// a memory pipe or a loopback TCP connection, with a self-signed test certificate.
+
+// Count allocations, to check that handlers are stored in place. The replacements form a
+// matching set, and the one calling free is not inlined into callers of new, which GCC would
+// report as a mismatch.
+static std::atomic<std::size_t> allocation_count{0};
+
+void* operator new(std::size_t size)
+{
+  ++allocation_count;
+  if (void* p = std::malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) { return operator new(size); }
+
+BOOST_NOINLINE void operator delete(void* p) noexcept { std::free(p); }
+
+void operator delete[](void* p) noexcept { operator delete(p); }
+
+void operator delete(void* p, std::size_t) noexcept { operator delete(p); }
+
+void operator delete[](void* p, std::size_t) noexcept { operator delete(p); }
+
+namespace gnutls_stream_runtime {
+
+using boost::system::error_code;
+using memory_pipe = boost::asio::gnutls::memory_pipe;
+using tcp_socket = boost::asio::ip::tcp::socket;
+
+struct tls_contexts
+{
+  tls_contexts()
+    : client_context(boost::asio::gnutls::context::tls),
+      server_context(boost::asio::gnutls::context::tls)
+  {
+    client_context.set_verify_mode(boost::asio::gnutls::verify_none);
+    test_credentials::use_server_credentials(server_context);
+  }
+
+  boost::asio::gnutls::context client_context;
+  boost::asio::gnutls::context server_context;
+};
+
+// Connect the next layers of a client and a server, a pipe buffering up to capacity bytes
+void connect_layers(memory_pipe& client, memory_pipe& server, std::size_t capacity)
+{
+  boost::asio::gnutls::connect_pair(client, server, capacity);
+}
+
+void connect_layers(tcp_socket& client, tcp_socket& server, std::size_t)
+{
+  using namespace boost::asio;
+  ip::tcp::acceptor acceptor(client.get_executor(),
+                             ip::tcp::endpoint(ip::address_v4::loopback(), 0));
+  client.connect(acceptor.local_endpoint());
+  acceptor.accept(server);
+}
+
+template <typename Socket> struct stream_fixture : tls_contexts
+{
+  explicit stream_fixture(std::size_t capacity = memory_pipe::default_capacity)
+    : client(ioc, client_context),
+      server(ioc, server_context)
+  {
+    connect_layers(client.next_layer(), server.next_layer(), capacity);
+  }
+
+  error_code handshake()
+  {
+    return test_credentials::handshake_pair(ioc, client, server);
+  }
+
+  boost::asio::io_context ioc;
+  boost::asio::gnutls::stream<Socket> client;
+  boost::asio::gnutls::stream<Socket> server;
+};
+
+using pipe_fixture = stream_fixture<memory_pipe>;
+
+// Handshake, data in both directions and shutdown
+template <typename Socket> void round_trip()
+{
+  using namespace boost::asio;
+
+  stream_fixture<Socket> f;
+  BOOST_ASIO_CHECK(!f.handshake());
+
+  std::string request = "ping", response = "pong";
+  std::string received(request.size(), '\0');
+  error_code ec;
+  async_write(f.client, buffer(request), [](error_code const&, std::size_t) {});
+  async_read(f.server, buffer(&received[0], received.size()),
+             [&](error_code const& e, std::size_t) {
+               ec = e;
+               async_write(f.server, buffer(response), [](error_code const&, std::size_t) {});
+             });
+  f.ioc.run();
+  f.ioc.restart();
+  BOOST_ASIO_CHECK(!ec && received == request);
+
+  received.assign(response.size(), '\0');
+  async_read(f.client, buffer(&received[0], received.size()),
+             [&ec](error_code const& e, std::size_t) { ec = e; });
+  f.ioc.run();
+  f.ioc.restart();
+  BOOST_ASIO_CHECK(!ec && received == response);
+
+  error_code client_ec, server_ec;
+  f.client.async_shutdown([&client_ec](error_code const& e) { client_ec = e; });
+  f.server.async_shutdown([&server_ec](error_code const& e) { server_ec = e; });
+  f.ioc.run();
+  BOOST_ASIO_CHECK(!client_ec && !server_ec);
+}
+
+// TLS over TLS: the outer streams are driven through internal ciphertext buffers
+template <typename Socket> void tunnel_round_trip()
+{
+  using namespace boost::asio;
+  using inner_stream = gnutls::stream<Socket>;
+
+  tls_contexts contexts;
+  io_context ioc;
+  gnutls::stream<inner_stream> client(inner_stream(ioc, contexts.client_context),
+                                      contexts.client_context);
+  gnutls::stream<inner_stream> server(inner_stream(ioc, contexts.server_context),
+                                      contexts.server_context);
+  connect_layers(client.next_layer().next_layer(), server.next_layer().next_layer(),
+                 memory_pipe::default_capacity);
+
+  BOOST_ASIO_CHECK(!test_credentials::handshake_pair(ioc, client.next_layer(),
+                                                     server.next_layer()));
+  BOOST_ASIO_CHECK(!test_credentials::handshake_pair(ioc, client, server));
+
+  std::string request = "through the tunnel", response;
+  std::string received(request.size(), '\0');
+  error_code write_ec, read_ec;
+  async_write(client, buffer(request),
+              [&write_ec](error_code const& ec, std::size_t) { write_ec = ec; });
+  async_read(server, buffer(&received[0], received.size()),
+             [&read_ec](error_code const& ec, std::size_t) { read_ec = ec; });
+  ioc.run();
+  ioc.restart();
+  BOOST_ASIO_CHECK(!write_ec && !read_ec);
+  BOOST_ASIO_CHECK(received == request);
+
+  // Both sides close the outer session, then the inner one
+  error_code client_ec, server_ec;
+  client.async_shutdown([&](error_code const& ec) {
+    client_ec = ec;
+    if (!ec) client.next_layer().async_shutdown([&](error_code const& ec) { client_ec = ec; });
+  });
+  server.async_shutdown([&](error_code const& ec) {
+    server_ec = ec;
+    if (!ec) server.next_layer().async_shutdown([&](error_code const& ec) { server_ec = ec; });
+  });
+  ioc.run();
+  BOOST_ASIO_CHECK(!client_ec && !server_ec);
+}
+
+// stream::async_write of a buffer sequence completes once, with the total, after many partial
+// sends through a small pipe or a socket
+template <typename Socket> void async_write_all()
+{
+  using namespace boost::asio;
+
+  stream_fixture<Socket> f(8 * 1024);
+  BOOST_ASIO_CHECK(!f.handshake());
+
+  std::string message(1024 * 1024, '\0');
+  for (std::size_t i = 0; i < message.size(); ++i)
+    message[i] = char(i % 251);
+  std::string received(message.size(), '\0');
+
+  int completions = 0;
+  std::size_t written = 0;
+  std::vector<const_buffer> const gather = {buffer(message.data(), 1000),
+                                             buffer(message.data() + 1000, message.size() - 1000)};
+  f.client.async_write(gather, [&](error_code const& ec, std::size_t n) {
+    BOOST_ASIO_CHECK(!ec);
+    ++completions;
+    written = n;
+  });
+  async_read(f.server, buffer(&received[0], received.size()),
+             [](error_code const& ec, std::size_t) { BOOST_ASIO_CHECK(!ec); });
+  f.ioc.run();
+  BOOST_ASIO_CHECK(completions == 1);
+  BOOST_ASIO_CHECK(written == message.size());
+  BOOST_ASIO_CHECK(received == message);
+}
+
+// Allocator counting the allocations made through it, bypassing operator new
+template <typename T> struct counting_allocator
+{
+  using value_type = T;
+
+  explicit counting_allocator(std::size_t* count) : count(count) {}
+
+  template <typename U> counting_allocator(counting_allocator<U> const& other) : count(other.count)
+  {
+  }
+
+  T* allocate(std::size_t n)
+  {
+    ++*count;
+    if (void* p = std::malloc(n * sizeof(T))) return static_cast<T*>(p);
+    throw std::bad_alloc();
+  }
+
+  void deallocate(T* p, std::size_t) { std::free(p); }
+
+  template <typename U> bool operator==(counting_allocator<U> const& other) const
+  {
+    return count == other.count;
+  }
+
+  template <typename U> bool operator!=(counting_allocator<U> const& other) const
+  {
+    return count != other.count;
+  }
+
+  std::size_t* count;
+};
+
+// Small handlers are stored in place, larger ones are allocated with their associated
+// allocator, and both are destroyed once, when completed or when the slot is reset
+void handler_slot_storage()
+{
+  using namespace boost::asio;
+  using executor_type = io_context::executor_type;
+  using slot_type = gnutls::detail::handler_slot<executor_type, error_code const&, std::size_t>;
+
+  tls_contexts contexts;
+  io_context ioc;
+  executor_type ex = ioc.get_executor();
+  auto owner = std::make_shared<int>(0);
+  std::size_t result = 0;
+
+  slot_type slot;
+  std::size_t allocations = allocation_count;
+  slot.emplace([owner, &result](error_code const&, std::size_t n) { result = n; }, ex);
+  slot_type moved(std::move(slot));
+  BOOST_ASIO_CHECK(allocation_count == allocations);
+  BOOST_ASIO_CHECK(!slot && moved);
+  BOOST_ASIO_CHECK(owner.use_count() == 2);
+
+  moved.complete(ex, false, error_code(), 42);
+  BOOST_ASIO_CHECK(!moved);
+  ioc.run();
+  ioc.restart();
+  BOOST_ASIO_CHECK(result == 42);
+  BOOST_ASIO_CHECK(owner.use_count() == 1);
+
+  struct large
+  {
+    char data[2 * slot_type::inline_size];
+  } payload = {};
+  allocations = allocation_count;
+  slot.emplace([owner, payload](error_code const&, std::size_t) { (void)payload; }, ex);
+  BOOST_ASIO_CHECK(allocation_count == allocations + 1);
+  BOOST_ASIO_CHECK(owner.use_count() == 2);
+  slot = nullptr;
+  BOOST_ASIO_CHECK(owner.use_count() == 1);
+
+  struct allocating_handler
+  {
+    using allocator_type = counting_allocator<void>;
+
+    allocator_type get_allocator() const noexcept { return allocator_type(count); }
+
+    void operator()(error_code const&, std::size_t n) { *result = n + payload.data[0]; }
+
+    large payload;
+    std::size_t* count;
+    std::size_t* result;
+  };
+  std::size_t handler_allocations = 0;
+  allocations = allocation_count;
+  slot.emplace(allocating_handler{payload, &handler_allocations, &result}, ex);
+  BOOST_ASIO_CHECK(handler_allocations == 1);
+  BOOST_ASIO_CHECK(allocation_count == allocations);
+  slot.complete(ex, false, error_code(), 7);
+  ioc.run();
+  ioc.restart();
+  BOOST_ASIO_CHECK(result == 7);
+
+  // An lvalue handler is copied into the operation, not moved from
+  gnutls::stream<gnutls::memory_pipe> stream(ioc, contexts.client_context);
+  std::function<void(error_code const&, std::size_t)> handler =
+      [&result](error_code const&, std::size_t n) { result = n + 1; };
+  char byte;
+  stream.async_read_some(buffer(&byte, 0), handler);
+  stream.async_write_some(buffer(&byte, 0), handler);
+  BOOST_ASIO_CHECK(static_cast<bool>(handler));
+  ioc.run();
+  BOOST_ASIO_CHECK(result == 1);
+}
+
+// Once warmed up, awaiting reads and writes with use_awaitable in a loop does not allocate, as
+// the pending handler is stored in place and Asio recycles the coroutine frames
+void awaitable_allocations()
+{
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+  using namespace boost::asio;
+
+  pipe_fixture f;
+  BOOST_ASIO_CHECK(!f.handshake());
+
+  std::size_t const warmup = 16, rounds = 256;
+  std::size_t allocations = 0, received = 0;
+  co_spawn(
+      f.ioc,
+      [&]() -> awaitable<void> {
+        char out = 'x', in = 0;
+        for (std::size_t i = 0; i < warmup + rounds; ++i)
+        {
+          if (i == warmup) allocations = allocation_count;
+          co_await f.client.async_write_some(buffer(&out, 1), use_awaitable);
+          received += co_await f.server.async_read_some(buffer(&in, 1), use_awaitable);
+        }
+        allocations = allocation_count - allocations;
+      },
+      detached);
+  f.ioc.run();
+  BOOST_ASIO_CHECK(received == warmup + rounds);
+  BOOST_ASIO_CHECK(allocations == 0);
+#endif
+}
+
+// A read cancelled while waiting for data completes with operation_aborted, and the
+// session stays usable
+void cancel_read()
+{
+  using namespace boost::asio;
+
+  pipe_fixture f;
+  BOOST_ASIO_CHECK(!f.handshake());
+
+  char data[16];
+  error_code read_ec;
+  std::size_t read_size = 1;
+  auto on_read = [&](error_code const& ec, std::size_t n) {
+    read_ec = ec;
+    read_size = n;
+  };
+
+  // Cancelling the read leaves the session usable, and a second cancellation is ignored. The
+  // wait on the next layer stays pending for the next read, so the context is only polled.
+  f.server.async_read_some(buffer(data), on_read);
+  f.ioc.poll();
+  f.server.cancel_read();
+  f.server.cancel_read();
+  f.ioc.poll();
+  f.ioc.restart();
+  BOOST_ASIO_CHECK(read_ec == error::operation_aborted && read_size == 0);
+
+  // Cancelling the next layer aborts the wait of the read
+  f.server.async_read_some(buffer(data), on_read);
+  f.ioc.poll();
+  f.server.next_layer().cancel();
+  f.ioc.run();
+  f.ioc.restart();
+  BOOST_ASIO_CHECK(read_ec == error::operation_aborted && read_size == 0);
+
+  f.client.write_some(buffer("after", 5));
+  f.server.async_read_some(buffer(data), on_read);
+  f.ioc.run();
+  BOOST_ASIO_CHECK(!read_ec && std::string(data, read_size) == "after");
+}
+
+// A write cancelled while the next layer is full completes with operation_aborted and the bytes
+// accepted so far, and the following writes are sent after the records already accepted
+void cancel_write()
+{
+  using namespace boost::asio;
+
+  pipe_fixture f(4096);
+  BOOST_ASIO_CHECK(!f.handshake());
+
+  std::string const large(256 * 1024, 'x');
+  error_code write_ec;
+  std::size_t written = large.size();
+  f.client.async_write_some(buffer(large), [&](error_code const& ec, std::size_t n) {
+    write_ec = ec;
+    written = n;
+  });
+  f.ioc.poll();
+  f.client.cancel_write();
+  f.client.cancel_write();
+  f.ioc.poll();
+  f.ioc.restart();
+  BOOST_ASIO_CHECK(write_ec == error::operation_aborted);
+  BOOST_ASIO_CHECK(written < large.size());
+
+  std::string const tail = "tail";
+  async_write(f.client, buffer(tail), [&write_ec](error_code const& ec, std::size_t) {
+    write_ec = ec;
+  });
+
+  std::string received;
+  std::function<void()> read_more;
+  char data[4096];
+  read_more = [&]() {
+    f.server.async_read_some(buffer(data), [&](error_code const& ec, std::size_t n) {
+      received.append(data, n);
+      if (!ec && received.size() < written + tail.size()) read_more();
+    });
+  };
+  read_more();
+  f.ioc.run();
+  BOOST_ASIO_CHECK(!write_ec);
+  BOOST_ASIO_CHECK(received.size() >= written + tail.size());
+  BOOST_ASIO_CHECK(received.compare(received.size() - tail.size(), tail.size(), tail) == 0);
+}
+
+// With immediate completion, a read served from already decrypted plaintext completes before
+// async_read_some returns, and otherwise it is posted
+void immediate_completion()
+{
+  using namespace boost::asio;
+
+  for (bool immediate : {false, true})
+  {
+    pipe_fixture f;
+    BOOST_ASIO_CHECK(!f.handshake());
+    f.server.set_immediate_completion(immediate);
+    f.client.write_some(buffer("abc", 3));
+
+    char data[3];
+    bool completed = false, completed_inline = false;
+    f.server.async_read_some(buffer(data, 1), [&](error_code const& ec, std::size_t n) {
+      BOOST_ASIO_CHECK(!ec && n == 1);
+      f.server.async_read_some(buffer(data + 1, 1), [&](error_code const& ec, std::size_t n) {
+        BOOST_ASIO_CHECK(!ec && n == 1);
+        completed = true;
+      });
+      completed_inline = completed;
+    });
+    f.ioc.run();
+    BOOST_ASIO_CHECK(completed);
+    BOOST_ASIO_CHECK(completed_inline == immediate);
+    BOOST_ASIO_CHECK(data[0] == 'a' && data[1] == 'b');
+  }
+
+  // Nesting stops at max_completion_depth, then completions are posted again
+  using stream_type = gnutls::stream<gnutls::memory_pipe>;
+  pipe_fixture f;
+  BOOST_ASIO_CHECK(!f.handshake());
+  f.server.set_immediate_completion(true);
+  std::string const message(4 * stream_type::max_completion_depth, 'x');
+  f.client.write_some(buffer(message));
+
+  char byte;
+  std::size_t total = 0;
+  unsigned int depth = 0, max_depth = 0;
+  std::function<void(error_code const&, std::size_t)> on_read;
+  on_read = [&](error_code const& ec, std::size_t n) {
+    total += n;
+    if (ec || total == message.size()) return;
+    max_depth = std::max(max_depth, ++depth);
+    f.server.async_read_some(buffer(&byte, 1), on_read);
+    --depth;
+  };
+  f.server.async_read_some(buffer(&byte, 1), on_read);
+  f.ioc.run();
+  BOOST_ASIO_CHECK(total == message.size());
+  BOOST_ASIO_CHECK(max_depth <= stream_type::max_completion_depth + 1);
+}
+
+// A handler bound to another io_context completes there, and keeps it running meanwhile
+void associated_executor()
+{
+  using namespace boost::asio;
+
+  pipe_fixture f;
+  BOOST_ASIO_CHECK(!f.handshake());
+
+  io_context handler_ioc;
+  char data[8];
+  std::size_t read_size = 0;
+  bool completed_on_handler_ioc = false;
+  f.server.async_read_some(buffer(data),
+                           bind_executor(handler_ioc, [&](error_code const& ec, std::size_t n) {
+                             BOOST_ASIO_CHECK(!ec);
+                             read_size = n;
+                             completed_on_handler_ioc = handler_ioc.get_executor()
+                                                            .running_in_this_thread();
+                           }));
+
+  // The pending operation counts as work on the handler's io_context
+  handler_ioc.poll();
+  BOOST_ASIO_CHECK(!handler_ioc.stopped());
+
+  f.client.write_some(buffer("data", 4));
+  f.ioc.run();
+  BOOST_ASIO_CHECK(read_size == 0);
+
+  handler_ioc.run();
+  BOOST_ASIO_CHECK(read_size == 4);
+  BOOST_ASIO_CHECK(completed_on_handler_ioc);
+  BOOST_ASIO_CHECK(handler_ioc.stopped());
+}
+
+// A synchronous read past the blocking timeout fails with timed_out and may be called again.
+// Sockets are used here, as their waits honour the deadline.
+void blocking_timeout()
+{
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+  using namespace boost::asio;
+  using socket_type = local::stream_protocol::socket;
+
+  tls_contexts contexts;
+  io_context ioc;
+  gnutls::stream<socket_type> client(ioc, contexts.client_context);
+  gnutls::stream<socket_type> server(ioc, contexts.server_context);
+  local::connect_pair(client.next_layer(), server.next_layer());
+  BOOST_ASIO_CHECK(!test_credentials::handshake_pair(ioc, client, server));
+
+  server.set_blocking_timeout(std::chrono::milliseconds(50));
+  char data[8];
+  error_code ec;
+  auto const start = std::chrono::steady_clock::now();
+  BOOST_ASIO_CHECK(server.read_some(buffer(data), ec) == 0);
+  BOOST_ASIO_CHECK(ec == error::timed_out);
+  BOOST_ASIO_CHECK(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(50));
+
+  client.write_some(buffer("late", 4), ec);
+  BOOST_ASIO_CHECK(!ec);
+  BOOST_ASIO_CHECK(server.read_some(buffer(data), ec) == 4);
+  BOOST_ASIO_CHECK(!ec && std::string(data, 4) == "late");
+  BOOST_ASIO_CHECK(server.next_layer().non_blocking());
+#endif
+}
+
+// A synchronous reader and writer run at once on two threads with a blocking timeout, both
+// waiting on a full or empty socket, while the peer is driven asynchronously
+void concurrent_blocking_timeout()
+{
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+  using namespace boost::asio;
+  using socket_type = local::stream_protocol::socket;
+
+  tls_contexts contexts;
+  io_context ioc;
+  gnutls::stream<socket_type> client(ioc, contexts.client_context);
+  gnutls::stream<socket_type> server(ioc, contexts.server_context);
+  local::connect_pair(client.next_layer(), server.next_layer());
+  BOOST_ASIO_CHECK(!test_credentials::handshake_pair(ioc, client, server));
+  ioc.restart();
+  client.next_layer().non_blocking(false);
+  client.set_blocking_timeout(std::chrono::seconds(10));
+
+  std::string upstream(1024 * 1024, '\0'), downstream(1024 * 1024, '\0');
+  for (std::size_t i = 0; i < upstream.size(); ++i)
+  {
+    upstream[i] = char(i % 251);
+    downstream[i] = char(i % 241);
+  }
+  std::string received_up(upstream.size(), '\0'), received_down(downstream.size(), '\0');
+
+  async_read(server, buffer(&received_up[0], received_up.size()),
+             [](error_code const& ec, std::size_t) { BOOST_ASIO_CHECK(!ec); });
+  async_write(server, buffer(downstream),
+              [](error_code const& ec, std::size_t) { BOOST_ASIO_CHECK(!ec); });
+  std::thread peer([&ioc] { ioc.run(); });
+
+  error_code write_ec;
+  std::thread writer([&] {
+    std::size_t offset = 0;
+    while (!write_ec && offset < upstream.size())
+    {
+      std::size_t const size = std::min<std::size_t>(16 * 1024, upstream.size() - offset);
+      offset += client.write_some(buffer(upstream.data() + offset, size), write_ec);
+    }
+  });
+  error_code read_ec;
+  std::size_t offset = 0;
+  while (!read_ec && offset < received_down.size())
+    offset += client.read_some(buffer(&received_down[offset], received_down.size() - offset),
+                               read_ec);
+  writer.join();
+  peer.join();
+
+  BOOST_ASIO_CHECK(!write_ec && !read_ec);
+  BOOST_ASIO_CHECK(received_up == upstream);
+  BOOST_ASIO_CHECK(received_down == downstream);
+  BOOST_ASIO_CHECK(client.next_layer().non_blocking());
+#endif
+}
+
+// With dynamic record sizing, records start small and grow to the maximum size once
+// dynamic_record_threshold bytes have been written
+void dynamic_record_sizing()
+{
+  using namespace boost::asio;
+  using stream_type = gnutls::stream<gnutls::memory_pipe>;
+
+  pipe_fixture f;
+  BOOST_ASIO_CHECK(!f.handshake());
+  f.client.set_dynamic_record_sizing(true);
+
+  // The ciphertext is read from the pipe directly, to see the records
+  std::string const payload(2 * stream_type::dynamic_record_threshold, 'x');
+  std::vector<unsigned char> wire;
+  bool written = false;
+  f.client.async_write(buffer(payload), [&](error_code const& ec, std::size_t n) {
+    BOOST_ASIO_CHECK(!ec && n == payload.size());
+    written = true;
+  });
+  gnutls::memory_pipe& raw = f.server.next_layer();
+  raw.non_blocking(true);
+  unsigned char chunk[16 * 1024];
+  error_code ec;
+  for (;;)
+  {
+    f.ioc.poll();
+    std::size_t n = raw.read_some(buffer(chunk), ec);
+    wire.insert(wire.end(), chunk, chunk + n);
+    if (written && ec == error::would_block) break;
+  }
+
+  std::vector<std::size_t> records;
+  for (std::size_t pos = 0; pos + 5 <= wire.size(); pos += 5 + records.back())
+  {
+    BOOST_ASIO_CHECK(wire[pos] == 23); // application data
+    records.push_back(std::size_t(wire[pos + 3]) << 8 | wire[pos + 4]);
+  }
+  BOOST_ASIO_CHECK(records.size() > 2);
+  std::size_t const overhead = 64;
+  BOOST_ASIO_CHECK(records.front() <= stream_type::small_record_size + overhead);
+  BOOST_ASIO_CHECK(*std::max_element(records.begin(), records.end()) >= 16 * 1024);
+  BOOST_ASIO_CHECK(std::is_sorted(records.begin(), records.end() - 1)); // the last one is partial
+}
+
+// With explicit flush, written records are held until flush() or until the cork limit is
+// reached
+void explicit_flush()
+{
+  using namespace boost::asio;
+
+  pipe_fixture f;
+  BOOST_ASIO_CHECK(!f.handshake());
+  f.client.set_explicit_flush(true);
+
+  char data[64];
+  std::size_t read_size = 0;
+  auto on_read = [&read_size](error_code const& ec, std::size_t n) {
+    BOOST_ASIO_CHECK(!ec);
+    read_size = n;
+  };
+  f.server.async_read_some(buffer(data), on_read);
+
+  std::size_t written = 0;
+  f.client.async_write_some(buffer("held", 4), [&written](error_code const& ec, std::size_t n) {
+    BOOST_ASIO_CHECK(!ec);
+    written = n;
+  });
+  f.ioc.poll();
+  f.ioc.restart();
+  BOOST_ASIO_CHECK(written == 4);
+  BOOST_ASIO_CHECK(read_size == 0);
+
+  error_code ec;
+  f.client.flush(ec);
+  BOOST_ASIO_CHECK(!ec);
+  f.ioc.run();
+  f.ioc.restart();
+  BOOST_ASIO_CHECK(read_size == 4 && std::string(data, 4) == "held");
+
+  // Reaching the cork limit sends the held records without a flush, up to the last one
+  f.client.set_cork_limit(1024);
+  std::string const large(4096, 'y');
+  std::string received(large.size(), '\0');
+  bool complete = false;
+  async_read(f.server, buffer(&received[0], received.size()),
+             [&complete](error_code const& ec, std::size_t) { complete = !ec; });
+  f.client.async_write(buffer(large), [](error_code const&, std::size_t) {});
+  f.ioc.run();
+  f.ioc.restart();
+  BOOST_ASIO_CHECK(complete && received == large);
+
+  // Below the limit, records stay held until flushed
+  f.client.async_write_some(buffer("tail", 4), [](error_code const&, std::size_t) {});
+  read_size = 0;
+  f.server.async_read_some(buffer(data), on_read);
+  f.ioc.poll();
+  f.ioc.restart();
+  BOOST_ASIO_CHECK(read_size == 0);
+  f.client.async_flush([](error_code const& ec) { BOOST_ASIO_CHECK(!ec); });
+  f.ioc.run();
+  BOOST_ASIO_CHECK(read_size == 4 && std::string(data, 4) == "tail");
+}
+
+// With write coalescing, small writes complete at once and share records, which are sent in
+// order once the delay has passed
+void write_coalescing()
+{
+  using namespace boost::asio;
+
+  std::string message;
+  for (int i = 0; i < 100; ++i)
+    message += "message " + std::to_string(1000 + i) + ";";
+  std::size_t const part = message.size() / 100;
+
+  for (bool raw : {true, false})
+  {
+    pipe_fixture f;
+    BOOST_ASIO_CHECK(!f.handshake());
+    f.client.set_write_coalescing(16 * 1024, std::chrono::milliseconds(50));
+
+    // Each write is started from the completion of the previous one
+    std::size_t offset = 0;
+    std::function<void(error_code const&, std::size_t)> on_write;
+    on_write = [&](error_code const& ec, std::size_t n) {
+      BOOST_ASIO_CHECK(!ec);
+      offset += n;
+      if (offset < message.size())
+        f.client.async_write_some(buffer(message.data() + offset, part), on_write);
+    };
+    f.client.async_write_some(buffer(message.data(), part), on_write);
+
+    if (raw)
+    {
+      // Every write has completed before the timer sends the held records
+      f.ioc.poll();
+      f.ioc.restart();
+      BOOST_ASIO_CHECK(offset == message.size());
+      gnutls::memory_pipe& pipe = f.server.next_layer();
+      pipe.non_blocking(true);
+      char chunk[64];
+      error_code ec;
+      BOOST_ASIO_CHECK(pipe.read_some(buffer(chunk), ec) == 0 && ec == error::would_block);
+
+      f.ioc.run();
+      std::vector<char> wire(64 * 1024);
+      std::size_t const size = pipe.read_some(buffer(wire), ec);
+      std::size_t records = 0;
+      for (std::size_t pos = 0; pos + 5 <= size; ++records)
+        pos += 5 + (std::size_t(static_cast<unsigned char>(wire[pos + 3])) << 8 |
+                    static_cast<unsigned char>(wire[pos + 4]));
+      BOOST_ASIO_CHECK(records == 1);
+    }
+    else
+    {
+      std::string received(message.size(), '\0');
+      async_read(f.server, buffer(&received[0], received.size()),
+                 [](error_code const& ec, std::size_t) { BOOST_ASIO_CHECK(!ec); });
+      f.ioc.run();
+      BOOST_ASIO_CHECK(received == message);
+    }
+  }
+}
+
+// Messages queued by several threads at once arrive complete and in order for each producer,
+// after a write of the application which was still pending
+void write_queue()
+{
+  using namespace boost::asio;
+
+  // The greeting does not fit in the pipe, so it is still pending when the queue is drained
+  pipe_fixture f(4 * 1024);
+  BOOST_ASIO_CHECK(!f.handshake());
+
+  int const producers = 4, count = 200;
+  std::string const greeting(16 * 1024, 'g');
+  auto const shared = std::make_shared<std::string>("shared;");
+  std::weak_ptr<std::string> const watch = shared;
+
+  std::size_t total = greeting.size();
+  for (int p = 0; p < producers; ++p)
+    total += count * (p == 0 ? shared->size() : 7);
+  std::string received(total, '\0');
+  int write_completions = 0;
+  async_write(f.client, buffer(greeting), [&](error_code const& ec, std::size_t) {
+    BOOST_ASIO_CHECK(!ec);
+    ++write_completions;
+  });
+  async_read(f.server, buffer(&received[0], received.size()),
+             [](error_code const& ec, std::size_t) { BOOST_ASIO_CHECK(!ec); });
+
+  // No strand: the drain, the greeting and the reader run on any of the threads, while the
+  // producers queue, until the reader has everything
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i)
+    threads.emplace_back([&f] { f.ioc.run(); });
+  for (int p = 0; p < producers; ++p)
+    threads.emplace_back([&f, &shared, p] {
+      for (int i = 0; i < count; ++i)
+      {
+        if (p == 0)
+          f.client.queue_write(buffer(*shared), shared);
+        else
+          f.client.queue_write(std::to_string(p) + std::to_string(1000 + i) + ";\n");
+      }
+    });
+  for (auto& t : threads)
+    t.join();
+
+  BOOST_ASIO_CHECK(write_completions == 1);
+  BOOST_ASIO_CHECK(received.compare(0, greeting.size(), greeting) == 0);
+  std::vector<int> next(producers, 0);
+  std::size_t pos = greeting.size();
+  bool ordered = true;
+  while (pos < received.size())
+  {
+    if (received.compare(pos, shared->size(), *shared) == 0)
+    {
+      ++next[0];
+      pos += shared->size();
+      continue;
+    }
+    int const p = received[pos] - '0';
+    int const i = std::atoi(received.substr(pos + 1, 4).c_str()) - 1000;
+    if (p <= 0 || p >= producers || i != next[p]++) ordered = false;
+    pos += 7;
+  }
+  BOOST_ASIO_CHECK(ordered);
+  for (int p = 0; p < producers; ++p)
+    BOOST_ASIO_CHECK(next[p] == count);
+
+  // Every shared owner has been released once written
+  BOOST_ASIO_CHECK(watch.use_count() == 1);
+}
+
+// Messages queued before the handshake are held until it is done, and a failed write stops the
+// queue with an error that can be read back
+void write_queue_errors()
+{
+  using namespace boost::asio;
+
+  pipe_fixture f;
+  f.client.queue_write(std::string("early;"));
+  f.ioc.poll();
+  f.ioc.restart();
+  BOOST_ASIO_CHECK(!f.client.queue_error());
+  BOOST_ASIO_CHECK(!f.handshake());
+
+  char data[16];
+  std::size_t received = 0;
+  async_read(f.server, buffer(data, 6), [&received](error_code const& ec, std::size_t n) {
+    if (!ec) received = n;
+  });
+  f.ioc.run();
+  f.ioc.restart();
+  BOOST_ASIO_CHECK(received == 6 && std::string(data, 6) == "early;");
+  BOOST_ASIO_CHECK(!f.client.queue_error());
+
+  // Once the peer is gone, the write fails and the following messages are dropped
+  f.server.next_layer().close();
+  auto const owner = std::make_shared<std::string>("dropped;");
+  std::weak_ptr<std::string> const watch = owner;
+  f.client.queue_write(std::string("lost;"));
+  f.ioc.run();
+  f.ioc.restart();
+  error_code const queue_error = f.client.queue_error();
+  BOOST_ASIO_CHECK(queue_error);
+  f.client.queue_write(buffer(*owner), owner);
+  f.client.queue_write(std::string("lost;"));
+  f.ioc.run();
+  BOOST_ASIO_CHECK(f.client.queue_error() == queue_error);
+  BOOST_ASIO_CHECK(watch.use_count() == 1);
+}
+
+// A reader and a writer run at once on two threads, with immediate completion and a coalescing
+// timer firing while writes are started
+void concurrent_read_write()
+{
+  using namespace boost::asio;
+
+  pipe_fixture f(16 * 1024);
+  BOOST_ASIO_CHECK(!f.handshake());
+  f.client.set_immediate_completion(true);
+  f.client.set_write_coalescing(4 * 1024, std::chrono::microseconds(50));
+
+  std::string upstream(256 * 1024, '\0'), downstream(256 * 1024, '\0');
+  for (std::size_t i = 0; i < upstream.size(); ++i)
+  {
+    upstream[i] = char(i % 251);
+    downstream[i] = char(i % 241);
+  }
+  std::string received_up(upstream.size(), '\0'), received_down(downstream.size(), '\0');
+
+  // Small writes, each started by the completion of the previous one
+  std::size_t offset = 0;
+  std::function<void(error_code const&, std::size_t)> on_write;
+  on_write = [&](error_code const& ec, std::size_t n) {
+    BOOST_ASIO_CHECK(!ec);
+    offset += n;
+    if (!ec && offset < upstream.size())
+      f.client.async_write_some(
+          buffer(upstream.data() + offset, std::min<std::size_t>(100, upstream.size() - offset)),
+          on_write);
+  };
+  f.client.async_write_some(buffer(upstream.data(), 100), on_write);
+  async_read(f.client, buffer(&received_down[0], received_down.size()),
+             [](error_code const& ec, std::size_t) { BOOST_ASIO_CHECK(!ec); });
+  async_read(f.server, buffer(&received_up[0], received_up.size()),
+             [](error_code const& ec, std::size_t) { BOOST_ASIO_CHECK(!ec); });
+  async_write(f.server, buffer(downstream),
+              [](error_code const& ec, std::size_t) { BOOST_ASIO_CHECK(!ec); });
+
+  std::thread thread([&f] { f.ioc.run(); });
+  f.ioc.run();
+  thread.join();
+
+  BOOST_ASIO_CHECK(offset == upstream.size());
+  BOOST_ASIO_CHECK(received_up == upstream);
+  BOOST_ASIO_CHECK(received_down == downstream);
+}
+
+// cancel_read() is part of the reader: called from the io_context running the read, it aborts
+// the read while a synchronous writer keeps going on its own thread
+void concurrent_cancel_read()
+{
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+  using namespace boost::asio;
+  using socket_type = local::stream_protocol::socket;
+
+  tls_contexts contexts;
+  io_context ioc;
+  gnutls::stream<socket_type> client(ioc, contexts.client_context);
+  gnutls::stream<socket_type> server(ioc, contexts.server_context);
+  local::connect_pair(client.next_layer(), server.next_layer());
+  BOOST_ASIO_CHECK(!test_credentials::handshake_pair(ioc, client, server));
+  ioc.restart();
+  client.set_blocking_timeout(std::chrono::seconds(10));
+
+  std::string upstream(1024 * 1024, '\0');
+  for (std::size_t i = 0; i < upstream.size(); ++i)
+    upstream[i] = char(i % 251);
+  std::string received(upstream.size(), '\0');
+
+  // The server never writes, so the read only completes once cancelled
+  char data[16];
+  error_code read_ec;
+  std::size_t read_bytes = 1;
+  client.async_read_some(buffer(data), [&](error_code const& ec, std::size_t n) {
+    read_ec = ec;
+    read_bytes = n;
+  });
+
+  // Cancel the read once the writer is under way
+  std::size_t offset = 0;
+  std::function<void(error_code const&, std::size_t)> on_read;
+  on_read = [&](error_code const& ec, std::size_t n) {
+    BOOST_ASIO_CHECK(!ec);
+    if (offset == 0)
+      client.cancel_read();
+    offset += n;
+    if (!ec && offset < received.size())
+      server.async_read_some(buffer(&received[offset], received.size() - offset), on_read);
+    else
+      ioc.stop(); // the wait of the cancelled read stays pending
+  };
+  server.async_read_some(buffer(&received[0], received.size()), on_read);
+  std::thread runner([&ioc] { ioc.run(); });
+
+  error_code write_ec;
+  std::size_t written = 0;
+  while (!write_ec && written < upstream.size())
+  {
+    std::size_t const size = std::min<std::size_t>(16 * 1024, upstream.size() - written);
+    written += client.write_some(buffer(upstream.data() + written, size), write_ec);
+  }
+  runner.join();
+
+  BOOST_ASIO_CHECK(read_ec == error::operation_aborted);
+  BOOST_ASIO_CHECK(read_bytes == 0);
+  BOOST_ASIO_CHECK(!write_ec);
+  BOOST_ASIO_CHECK(received == upstream);
+#endif
+}
+
+} // namespace gnutls_stream_runtime
+
+//------------------------------------------------------------------------------
+
+using gnutls_stream_runtime::memory_pipe;
+using gnutls_stream_runtime::tcp_socket;
+
+BOOST_ASIO_TEST_SUITE("gnutls/stream",
+                      BOOST_ASIO_TEST_CASE(gnutls_stream_compile::test)
+                          BOOST_ASIO_TEST_CASE(gnutls_stream_runtime::round_trip<memory_pipe>)
+                          BOOST_ASIO_TEST_CASE(gnutls_stream_runtime::round_trip<tcp_socket>)
+                          BOOST_ASIO_TEST_CASE(
+                              gnutls_stream_runtime::tunnel_round_trip<memory_pipe>)
+                          BOOST_ASIO_TEST_CASE(gnutls_stream_runtime::tunnel_round_trip<tcp_socket>)
+                          BOOST_ASIO_TEST_CASE(gnutls_stream_runtime::handler_slot_storage)
+                          BOOST_ASIO_TEST_CASE(gnutls_stream_runtime::awaitable_allocations)
+                          BOOST_ASIO_TEST_CASE(gnutls_stream_runtime::cancel_read)
+                          BOOST_ASIO_TEST_CASE(gnutls_stream_runtime::cancel_write)
+                          BOOST_ASIO_TEST_CASE(gnutls_stream_runtime::immediate_completion)
+                          BOOST_ASIO_TEST_CASE(gnutls_stream_runtime::associated_executor)
+                          BOOST_ASIO_TEST_CASE(gnutls_stream_runtime::blocking_timeout)
+                          BOOST_ASIO_TEST_CASE(gnutls_stream_runtime::concurrent_blocking_timeout)
+                          BOOST_ASIO_TEST_CASE(gnutls_stream_runtime::dynamic_record_sizing)
+                          BOOST_ASIO_TEST_CASE(gnutls_stream_runtime::explicit_flush)
+                          BOOST_ASIO_TEST_CASE(gnutls_stream_runtime::async_write_all<memory_pipe>)
+                          BOOST_ASIO_TEST_CASE(gnutls_stream_runtime::async_write_all<tcp_socket>)
+                          BOOST_ASIO_TEST_CASE(gnutls_stream_runtime::write_coalescing)
+                          BOOST_ASIO_TEST_CASE(gnutls_stream_runtime::write_queue)
+                          BOOST_ASIO_TEST_CASE(gnutls_stream_runtime::write_queue_errors)
+                          BOOST_ASIO_TEST_CASE(gnutls_stream_runtime::concurrent_read_write)
+                          BOOST_ASIO_TEST_CASE(gnutls_stream_runtime::concurrent_cancel_read))